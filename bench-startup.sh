@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Startup time of each qmodemhelper command, averaged over N runs.
+#
+#   ./bench-startup.sh [path/to/qmodemhelper] [runs]
+#
+# To run from a build tree, point QMODEMHELPER_MBIM_MODULE at
+# <build>/lib/qmodemhelper-mbim.so. Commands that talk to the modem
+# (get_fw_info) include the MBIM round trip unless the firmware-info cache or
+# a running --daemon answers. Nothing here resets or flashes the modem:
+# power_enable_gpio is run without --reboot.
+
+BIN=${1:-qmodemhelper}
+RUNS=${2:-50}
+
+now_usec() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+bench() {
+    start=$(now_usec)
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        "$BIN" "$@" >/dev/null 2>&1
+        i=$((i + 1))
+    done
+    end=$(now_usec)
+    printf "%-32s %8d us\n" "$*" $(((end - start) / RUNS))
+}
+
+printf "%-32s %11s\n" "command" "avg/run"
+bench --help
+bench --get_heartbeat_config
+bench --flash_mode_check
+bench --power_enable_gpio=gpiochip0,0
+bench --get_fw_info
+bench --get_heartbeat_config --flash_mode_check --get_fw_info
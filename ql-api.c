@@ -0,0 +1,239 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-sahara-core.h"
+#include "ql-usb-index.h"
+#include "ql-fleet.h"
+#include "ql-fw-cache.h"
+#include "ql-gpio.h"
+#include "ql-mbim.h"
+#include "qmodemhelper.h"
+
+/*
+ * The library entry points. A context is bound to a port and looks its
+ * modem up by probing that port, its MBIM session and flash target carry
+ * the port too, so neither the process-wide USB index nor the default MBIM
+ * session is read or written and contexts can live in different threads.
+ */
+
+struct qmh_context
+{
+    char port[32];                 /* empty until bound to the first modem found */
+    struct FwUpdaterData *session; /* created on the first MBIM operation */
+    struct qdl_target target;
+    qmh_progress_cb progress;
+    void *user;
+};
+
+static struct usb_index *qmh_scan(void)
+{
+    struct usb_index *index = calloc(1, sizeof(struct usb_index));
+
+    if (index && usb_index_scan(index) < 0)
+    {
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/* Where ctx's modem is now, binding ctx to the first modem if it has no port */
+static int qmh_find(struct qmh_context *ctx, struct usb_index_device *dev)
+{
+    struct usb_index *index;
+    int ret = -ENODEV;
+
+    if (ctx->port[0])
+        return usb_index_probe(ctx->port, dev) ? -ENODEV : 0;
+
+    index = qmh_scan();
+    if (!index)
+        return -ENODEV;
+    if (index->count)
+    {
+        memcpy(dev, &index->devices[0], sizeof(struct usb_index_device));
+        snprintf(ctx->port, sizeof(ctx->port), "%s", dev->port);
+        ret = 0;
+    }
+    free(index);
+    return ret;
+}
+
+static const struct mbim_ops *qmh_mbim(struct qmh_context *ctx)
+{
+    const struct mbim_ops *mbim = mbim_load();
+
+    if (!mbim)
+        return NULL;
+    if (!ctx->session)
+        ctx->session = mbim->session_new(ctx->port);
+    return ctx->session ? mbim : NULL;
+}
+
+static void qmh_target_progress(struct qdl_target *target)
+{
+    struct qmh_context *ctx = (struct qmh_context *)target->user;
+
+    if (ctx->progress)
+        ctx->progress(ctx->user, target->stage, target->percent);
+}
+
+struct qmh_context *qmh_context_new(const char *port)
+{
+    struct qmh_context *ctx = calloc(1, sizeof(struct qmh_context));
+
+    if (!ctx)
+        return NULL;
+    if (port)
+        snprintf(ctx->port, sizeof(ctx->port), "%s", port);
+    ctx->target.port = ctx->port;
+    ctx->target.name = ctx->port;
+    ctx->target.progress = qmh_target_progress;
+    ctx->target.user = ctx;
+
+    return ctx;
+}
+
+void qmh_context_free(struct qmh_context *ctx)
+{
+    if (!ctx)
+        return;
+    if (ctx->session)
+        mbim_loaded()->session_free(ctx->session);
+    free(ctx);
+}
+
+int qmh_discover(struct qmh_modem *modems, unsigned max)
+{
+    struct usb_index *index = qmh_scan();
+    unsigned i;
+    int count;
+
+    if (!index)
+        return -ENODEV;
+
+    for (i = 0; i < index->count && i < max; i++)
+    {
+        const struct usb_index_device *dev = &index->devices[i];
+
+        memset(&modems[i], 0, sizeof(struct qmh_modem));
+        snprintf(modems[i].port, sizeof(modems[i].port), "%s", dev->port);
+        snprintf(modems[i].dev_node, sizeof(modems[i].dev_node), "%s", dev->dev_node);
+        snprintf(modems[i].cdc_wdm, sizeof(modems[i].cdc_wdm), "%s", dev->cdc_wdm);
+        snprintf(modems[i].serial, sizeof(modems[i].serial), "%s", dev->serial);
+        modems[i].vid = dev->idVendor;
+        modems[i].pid = dev->idProduct;
+        modems[i].mode = dev->mode;
+    }
+    count = index->count;
+    free(index);
+
+    return count;
+}
+
+int qmh_get_version(struct qmh_context *ctx, struct qmh_version *version)
+{
+    struct usb_index_device dev;
+    const struct mbim_ops *mbim;
+    int ret;
+
+    ret = qmh_find(ctx, &dev);
+    if (ret)
+        return ret;
+    mbim = qmh_mbim(ctx);
+    if (!mbim)
+        return -ENOENT;
+
+    if (mbim->get_version(ctx->session, version->main_version, version->carrier_uuid,
+                          version->carrier_version, version->oem_version))
+        return -EIO;
+    return 0;
+}
+
+int qmh_prepare_to_flash(struct qmh_context *ctx)
+{
+    struct usb_index_device dev;
+    const struct mbim_ops *mbim;
+    int ret;
+
+    ret = qmh_find(ctx, &dev);
+    if (ret)
+        return ret;
+    if (dev.mode != NORMAL_OPERATION)
+        return 0;
+    mbim = qmh_mbim(ctx);
+    if (!mbim)
+        return -ENOENT;
+
+    return mbim->prepare_to_flash(ctx->session) ? -EIO : 0;
+}
+
+int qmh_flash(struct qmh_context *ctx,
+              const char *main_file_path,
+              const char *oem_file_path,
+              const char *carrier_file_path,
+              qmh_progress_cb progress,
+              void *user)
+{
+    struct fleet_job job = {
+        .main_file_path = main_file_path ? main_file_path : "",
+        .oem_file_path = oem_file_path ? oem_file_path : "",
+        .carrier_file_path = carrier_file_path ? carrier_file_path : "",
+    };
+    struct usb_index_device dev;
+    int ret;
+
+    ret = qmh_find(ctx, &dev);
+    if (ret)
+        return ret;
+    /* fleet_flash_modem() would fall back to the shared default session */
+    if (dev.mode == NORMAL_OPERATION && !qmh_mbim(ctx))
+        return -ENOENT;
+
+    job.session = ctx->session;
+    ctx->progress = progress;
+    ctx->user = user;
+    ctx->target.stage = NULL;
+    ctx->target.percent = 0;
+    ret = fleet_flash_modem(&job, &dev, &ctx->target);
+    ctx->progress = NULL;
+
+    return ret;
+}
+
+int qmh_reset(struct qmh_context *ctx, const char *gpio_chip, int reset_line, unsigned long pulse_usec)
+{
+    struct usb_index_device dev;
+    const struct mbim_ops *mbim;
+    int ret;
+
+    ret = qmh_find(ctx, &dev);
+    if (ret)
+        return ret;
+    fw_cache_invalidate(ctx->port);
+
+    if (gpio_chip)
+    {
+        if (ctx->session)
+            mbim_loaded()->release_device(ctx->session);
+        return gpio_reset_modem((char *)gpio_chip, reset_line, pulse_usec) ? -EIO : 0;
+    }
+
+    mbim = qmh_mbim(ctx);
+    if (!mbim)
+        return -ENOENT;
+    return mbim->reboot_modem(ctx->session) ? -EIO : 0;
+}
@@ -0,0 +1,580 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-sahara-core.h"
+#include "ql-bundle.h"
+#include "ql-crc32.h"
+#include "ql-qdl-firehose.h"
+#include "ql-qdl-sahara.h"
+#include <endian.h>
+#include <libgen.h>
+
+/*
+ * A firmware bundle packs the main, oem and carrier single images together
+ * with the EDL programmer, the rawprogram XML and the files it programs into
+ * one file, indexed by name. The bundle stands in for the firmware
+ * directory: "fw.qfb/oem.bin" or "fw.qfb/prog_nand_firehose_9x55.mbn" are
+ * served from the mapped bundle, so the Sahara and Firehose paths need no
+ * other change than going through bundle_resolve() or bundle_fopen().
+ */
+
+static pthread_mutex_t bundle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bundle *bundle_list;
+
+uint64_t bundle_entry_offset(const struct bundle_entry *entry)
+{
+    return le64toh(entry->offset);
+}
+
+uint64_t bundle_entry_length(const struct bundle_entry *entry)
+{
+    return le64toh(entry->length);
+}
+
+static int bundle_check(struct bundle *b)
+{
+    const struct bundle_header *hdr = (const struct bundle_header *)b->base;
+    uint32_t i, count, header_size;
+
+    if (b->size < sizeof(struct bundle_header) || memcmp(hdr->magic, BUNDLE_MAGIC, sizeof(hdr->magic)))
+        return -1;
+    count = le_uint32(hdr->entry_count);
+    header_size = le_uint32(hdr->header_size);
+    if (count > BUNDLE_MAX_ENTRIES || header_size > b->size
+        || header_size < sizeof(struct bundle_header) + count * sizeof(struct bundle_entry))
+    {
+        printf("%s: bad bundle index\n", b->path);
+        return -1;
+    }
+
+    b->hdr = hdr;
+    b->entries = (const struct bundle_entry *)(hdr + 1);
+    b->entry_count = count;
+    if (crc32_update(0, b->entries, count * sizeof(struct bundle_entry)) != le_uint32(hdr->index_crc))
+    {
+        printf("%s: bundle index CRC mismatch\n", b->path);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        const struct bundle_entry *entry = &b->entries[i];
+        uint64_t offset = bundle_entry_offset(entry), length = bundle_entry_length(entry);
+
+        if (!memchr(entry->name, 0, sizeof(entry->name)) || offset < header_size
+            || offset > b->size || length > b->size - offset
+            || (i && strcmp(b->entries[i - 1].name, entry->name) >= 0))
+        {
+            printf("%s: bad bundle entry %u\n", b->path, i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void bundle_free(struct bundle *b)
+{
+    if (b->base && b->base != MAP_FAILED)
+        munmap(b->base, b->size);
+    if (b->fd >= 0)
+        close(b->fd);
+    free(b);
+}
+
+/* The bundle at path, mapped once for every user as long as the file does not change */
+static struct bundle *bundle_get(const char *path, const struct stat *st)
+{
+    struct bundle *b;
+
+    pthread_mutex_lock(&bundle_lock);
+    for (b = bundle_list; b; b = b->next)
+    {
+        if (!strcmp(b->path, path) && b->dev == st->st_dev && b->ino == st->st_ino
+            && b->size == (size_t)st->st_size && b->mtime.tv_sec == st->st_mtim.tv_sec
+            && b->mtime.tv_nsec == st->st_mtim.tv_nsec)
+        {
+            b->refs++;
+            pthread_mutex_unlock(&bundle_lock);
+            return b;
+        }
+    }
+    pthread_mutex_unlock(&bundle_lock);
+
+    b = (struct bundle *)calloc(1, sizeof(struct bundle));
+    if (!b || strlen(path) >= sizeof(b->path))
+    {
+        free(b);
+        return NULL;
+    }
+    snprintf(b->path, sizeof(b->path), "%s", path);
+    b->dev = st->st_dev;
+    b->ino = st->st_ino;
+    b->mtime = st->st_mtim;
+    b->size = st->st_size;
+    b->refs = 1;
+    b->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (b->fd < 0 || b->size < sizeof(struct bundle_header))
+        goto ERROR;
+    b->base = (uint8_t *)mmap(NULL, b->size, PROT_READ, MAP_SHARED, b->fd, 0);
+    if (b->base == MAP_FAILED || bundle_check(b))
+        goto ERROR;
+
+    pthread_mutex_lock(&bundle_lock);
+    b->next = bundle_list;
+    bundle_list = b;
+    pthread_mutex_unlock(&bundle_lock);
+    return b;
+
+ERROR:
+    bundle_free(b);
+    return NULL;
+}
+
+void bundle_put(struct bundle *bundle)
+{
+    struct bundle **p;
+
+    if (!bundle)
+        return;
+    pthread_mutex_lock(&bundle_lock);
+    if (--bundle->refs)
+    {
+        pthread_mutex_unlock(&bundle_lock);
+        return;
+    }
+    for (p = &bundle_list; *p; p = &(*p)->next)
+    {
+        if (*p == bundle)
+        {
+            *p = bundle->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bundle_lock);
+    bundle_free(bundle);
+}
+
+static int bundle_compare_name(const void *key, const void *elem)
+{
+    return strcmp((const char *)key, ((const struct bundle_entry *)elem)->name);
+}
+
+/*
+ * 1 and a reference to the bundle if path is a file inside one, 0 if path
+ * is not inside a bundle, -ENOENT if the bundle has no such entry.
+ */
+int bundle_resolve(const char *path, struct bundle **bundle, const struct bundle_entry **entry)
+{
+    char prefix[PATH_LENGTH];
+    struct stat st;
+    const char *p;
+
+    *bundle = NULL;
+    *entry = NULL;
+    /* the common case, a plain file, costs a single stat() */
+    if (!path || !path[0] || stat(path, &st) == 0 || errno != ENOTDIR)
+        return 0;
+
+    /* a leading component is a file, which must then be a bundle */
+    for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/'))
+    {
+        size_t len = p - path;
+
+        if (len >= sizeof(prefix))
+            return 0;
+        memcpy(prefix, path, len);
+        prefix[len] = 0;
+        if (stat(prefix, &st))
+            return 0;
+        if (!S_ISREG(st.st_mode))
+            continue;
+
+        *bundle = bundle_get(prefix, &st);
+        if (!*bundle)
+            return 0;
+        while (*p == '/')
+            p++;
+        *entry = (const struct bundle_entry *)bsearch(p, (*bundle)->entries, (*bundle)->entry_count,
+                                                      sizeof(struct bundle_entry), bundle_compare_name);
+        if (!*entry)
+        {
+            bundle_put(*bundle);
+            *bundle = NULL;
+            errno = ENOENT;
+            return -ENOENT;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/* A stdio stream over a bundle entry, for the code that reads images with fread() */
+struct bundle_file
+{
+    struct bundle *bundle;
+    const uint8_t *data;
+    uint64_t length;
+    uint64_t pos;
+};
+
+static ssize_t bundle_file_read(void *cookie, char *buf, size_t size)
+{
+    struct bundle_file *file = (struct bundle_file *)cookie;
+
+    if (file->pos >= file->length)
+        return 0;
+    size = MIN((uint64_t)size, file->length - file->pos);
+    memcpy(buf, file->data + file->pos, size);
+    file->pos += size;
+    return size;
+}
+
+static int bundle_file_seek(void *cookie, off64_t *offset, int whence)
+{
+    struct bundle_file *file = (struct bundle_file *)cookie;
+    int64_t pos = *offset;
+
+    if (whence == SEEK_CUR)
+        pos += file->pos;
+    else if (whence == SEEK_END)
+        pos += file->length;
+    if (pos < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    /* as with a file, seeking past the end is allowed and reads nothing */
+    file->pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+static int bundle_file_close(void *cookie)
+{
+    struct bundle_file *file = (struct bundle_file *)cookie;
+
+    bundle_put(file->bundle);
+    free(file);
+    return 0;
+}
+
+/* fopen(path, "rb"), for a path that may be inside a bundle */
+FILE *bundle_fopen(const char *path)
+{
+    cookie_io_functions_t io = {bundle_file_read, NULL, bundle_file_seek, bundle_file_close};
+    const struct bundle_entry *entry;
+    struct bundle_file *file;
+    struct bundle *bundle;
+    FILE *fp;
+    int ret;
+
+    ret = bundle_resolve(path, &bundle, &entry);
+    if (ret == 0)
+        return fopen(path, "rb");
+    if (ret < 0)
+        return NULL;
+
+    file = (struct bundle_file *)calloc(1, sizeof(struct bundle_file));
+    if (!file)
+    {
+        bundle_put(bundle);
+        return NULL;
+    }
+    file->bundle = bundle;
+    file->data = bundle->base + bundle_entry_offset(entry);
+    file->length = bundle_entry_length(entry);
+
+    fp = fopencookie(file, "rb", io);
+    if (!fp)
+        bundle_file_close(file);
+    return fp;
+}
+
+/*
+ * The descriptor and the byte range holding path, for what needs more than
+ * a stream: a bundle_fopen() stream has no descriptor. Inside a bundle this
+ * is the bundle file, held in *bundle; otherwise *bundle is NULL and the
+ * caller closes *fd.
+ */
+int bundle_open_range(const char *path, int *fd, uint64_t *offset, uint64_t *length, struct bundle **bundle)
+{
+    const struct bundle_entry *entry;
+    struct stat st;
+    int ret;
+
+    ret = bundle_resolve(path, bundle, &entry);
+    if (ret < 0)
+        return -ENOENT;
+    if (ret > 0)
+    {
+        *fd = (*bundle)->fd;
+        *offset = bundle_entry_offset(entry);
+        *length = bundle_entry_length(entry);
+        return 0;
+    }
+
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0)
+        return -errno;
+    if (fstat(*fd, &st))
+    {
+        ret = -errno;
+        close(*fd);
+        return ret;
+    }
+    *offset = 0;
+    *length = st.st_size;
+    return 0;
+}
+
+/* Bundle creation */
+
+struct bundle_source
+{
+    struct bundle_entry entry;
+    char path[PATH_LENGTH];
+};
+
+struct bundle_builder
+{
+    struct bundle_source sources[BUNDLE_MAX_ENTRIES];
+    unsigned count;
+    const char *dir;
+};
+
+static int bundle_add(struct bundle_builder *builder, const char *dir, const char *name, uint32_t type)
+{
+    struct bundle_source *source;
+    unsigned i;
+
+    for (i = 0; i < builder->count; i++)
+    {
+        if (!strcmp(builder->sources[i].entry.name, name))
+            return 0;
+    }
+    if (builder->count == BUNDLE_MAX_ENTRIES || strlen(name) >= BUNDLE_NAME_LENGTH)
+    {
+        printf("cannot add %s to the bundle\n", name);
+        return -1;
+    }
+
+    source = &builder->sources[builder->count++];
+    memset(source, 0, sizeof(struct bundle_source));
+    snprintf(source->entry.name, sizeof(source->entry.name), "%s", name);
+    source->entry.type = le_uint32(type);
+    snprintf(source->path, sizeof(source->path), "%s/%s", dir, name);
+    return 0;
+}
+
+static int bundle_add_program_file(void *user, const char *name)
+{
+    struct bundle_builder *builder = (struct bundle_builder *)user;
+
+    return bundle_add(builder, builder->dir, name, BUNDLE_ENTRY_FIREHOSE);
+}
+
+static int bundle_compare_sources(const void *a, const void *b)
+{
+    return strcmp(((const struct bundle_source *)a)->entry.name, ((const struct bundle_source *)b)->entry.name);
+}
+
+/* Append the file of source at offset, filling in its entry */
+static int bundle_copy(int out, struct bundle_source *source, uint64_t offset)
+{
+    static const uint8_t zero[BUNDLE_ALIGN];
+    uint32_t crc = 0;
+    uint64_t length = 0;
+    size_t pad;
+    char buf[64 * 1024];
+    FILE *fp;
+    size_t n;
+
+    /* the images may come from another bundle */
+    fp = bundle_fopen(source->path);
+    if (!fp)
+    {
+        printf("fail to open %s, errno: %d (%s)\n", source->path, errno, strerror(errno));
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        if (pwrite(out, buf, n, offset + length) != (ssize_t)n)
+        {
+            fclose(fp);
+            return -1;
+        }
+        crc = crc32_update(crc, buf, n);
+        length += n;
+    }
+    fclose(fp);
+
+    pad = (BUNDLE_ALIGN - length % BUNDLE_ALIGN) % BUNDLE_ALIGN;
+    if (pad && pwrite(out, zero, pad, offset + length) != (ssize_t)pad)
+        return -1;
+
+    source->entry.crc = le_uint32(crc);
+    source->entry.offset = htole64(offset);
+    source->entry.length = htole64(length);
+
+    if (le_uint32(source->entry.type) <= BUNDLE_ENTRY_CARRIER)
+    {
+        char versions[3][16]; /* main, oem, carrier */
+
+        if (!sahara_image_versions(source->path, versions[0], versions[1], versions[2]))
+            memcpy(source->entry.version, versions[le_uint32(source->entry.type) - BUNDLE_ENTRY_MAIN],
+                   sizeof(source->entry.version));
+    }
+    return 0;
+}
+
+static int bundle_readable(const char *path)
+{
+    FILE *fp = bundle_fopen(path);
+
+    if (!fp)
+        return 0;
+    fclose(fp);
+    return 1;
+}
+
+/*
+ * Pack the images of a --flash_fw command into a bundle at path. The EDL
+ * programmer, the rawprogram XML and the files it programs are taken from
+ * the oem image's directory, as qdl_flash_target() would.
+ */
+int bundle_create(const char *path, const char *main_file_path, const char *oem_file_path, const char *carrier_file_path)
+{
+    const char *components[3] = {main_file_path, oem_file_path, carrier_file_path};
+    struct bundle_header hdr;
+    struct bundle_builder *builder;
+    char tmp_path[PATH_LENGTH + 16];
+    char dir[PATH_LENGTH];
+    uint32_t header_size;
+    uint64_t offset;
+    unsigned i;
+    int out = -1;
+    int ret = -1;
+
+    builder = (struct bundle_builder *)calloc(1, sizeof(struct bundle_builder));
+    if (!builder)
+        return -1;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic));
+
+    for (i = 0; i < 3; i++)
+    {
+        struct single_image_hdr image;
+        char name[PATH_LENGTH];
+        FILE *fp;
+
+        if (!components[i] || !components[i][0])
+            continue;
+        snprintf(dir, sizeof(dir), "%s", components[i]);
+        snprintf(name, sizeof(name), "%s", components[i]);
+        if (bundle_add(builder, dirname(dir), basename(name), BUNDLE_ENTRY_MAIN + i))
+            goto EXIT;
+        /* the modem the bundle is for, which every single image must agree on */
+        fp = bundle_fopen(components[i]);
+        if (fp && fread(&image, sizeof(image), 1, fp) == 1 && !memcmp(image.magic, "Quec", sizeof(image.magic)))
+        {
+            if (!hdr.module_id[0])
+                memcpy(hdr.module_id, image.module_id, sizeof(hdr.module_id));
+            else if (strncmp(hdr.module_id, image.module_id, sizeof(hdr.module_id)))
+            {
+                printf("%s is for %.32s, not %.32s\n", components[i], image.module_id, hdr.module_id);
+                fclose(fp);
+                goto EXIT;
+            }
+        }
+        if (fp)
+            fclose(fp);
+    }
+
+    if (oem_file_path && oem_file_path[0])
+    {
+        char xml_file[PATH_LENGTH + 64];
+
+        snprintf(dir, sizeof(dir), "%s", oem_file_path);
+        builder->dir = dirname(dir);
+        snprintf(xml_file, sizeof(xml_file), "%s/%s", builder->dir, QDL_PROGRAMMER_FILE);
+        if (bundle_readable(xml_file) && bundle_add(builder, builder->dir, QDL_PROGRAMMER_FILE, BUNDLE_ENTRY_PROGRAMMER))
+            goto EXIT;
+        snprintf(xml_file, sizeof(xml_file), "%s/%s", builder->dir, RAW_PROGRAM_FILE);
+        if (bundle_readable(xml_file)
+            && (bundle_add(builder, builder->dir, RAW_PROGRAM_FILE, BUNDLE_ENTRY_RAWPROGRAM)
+                || fh_xml_program_files(xml_file, bundle_add_program_file, builder)))
+            goto EXIT;
+    }
+
+    if (!builder->count)
+    {
+        printf("nothing to put in the bundle\n");
+        goto EXIT;
+    }
+    qsort(builder->sources, builder->count, sizeof(struct bundle_source), bundle_compare_sources);
+
+    out = file_replace_open(path, tmp_path, sizeof(tmp_path));
+    if (out < 0)
+    {
+        printf("fail to create %s, errno: %d (%s)\n", path, errno, strerror(errno));
+        goto EXIT;
+    }
+
+    header_size = sizeof(hdr) + builder->count * sizeof(struct bundle_entry);
+    offset = (header_size + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+    for (i = 0; i < builder->count; i++)
+    {
+        if (bundle_copy(out, &builder->sources[i], offset))
+            goto EXIT;
+        offset += (bundle_entry_length(&builder->sources[i].entry) + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+        printf("%s: %llu bytes\n", builder->sources[i].entry.name,
+               (unsigned long long)bundle_entry_length(&builder->sources[i].entry));
+    }
+
+    hdr.header_size = le_uint32(header_size);
+    hdr.entry_count = le_uint32(builder->count);
+    for (i = 0; i < builder->count; i++)
+    {
+        hdr.index_crc = crc32_update(hdr.index_crc, &builder->sources[i].entry, sizeof(struct bundle_entry));
+        if (pwrite(out, &builder->sources[i].entry, sizeof(struct bundle_entry),
+                   sizeof(hdr) + i * sizeof(struct bundle_entry)) != (ssize_t)sizeof(struct bundle_entry))
+            goto EXIT;
+    }
+    hdr.index_crc = le_uint32(hdr.index_crc);
+    if (pwrite(out, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) || fsync(out))
+        goto EXIT;
+    close(out);
+    out = -1;
+
+    if (file_replace_commit(tmp_path, path, 1))
+    {
+        printf("fail to rename %s, errno: %d (%s)\n", tmp_path, errno, strerror(errno));
+        goto EXIT;
+    }
+    printf("%s: %u entries, %llu bytes\n", path, builder->count, (unsigned long long)offset);
+    ret = 0;
+
+EXIT:
+    if (out >= 0)
+    {
+        close(out);
+        file_replace_commit(tmp_path, path, 0);
+    }
+    free(builder);
+    return ret;
+}
@@ -0,0 +1,88 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_BUNDLE_H_
+#define __QL_BUNDLE_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define BUNDLE_MAGIC "QFWBNDL1"
+#define BUNDLE_ALIGN 4096
+#define BUNDLE_MAX_ENTRIES 256
+#define BUNDLE_NAME_LENGTH 96
+
+#define BUNDLE_MAIN_FILE "main.bin"
+#define BUNDLE_OEM_FILE "oem.bin"
+#define BUNDLE_CARRIER_FILE "carrier.bin"
+
+enum bundle_type
+{
+    BUNDLE_ENTRY_MAIN = 1,
+    BUNDLE_ENTRY_OEM,
+    BUNDLE_ENTRY_CARRIER,
+    BUNDLE_ENTRY_PROGRAMMER,
+    BUNDLE_ENTRY_RAWPROGRAM,
+    BUNDLE_ENTRY_FIREHOSE, /* a file the rawprogram XML programs */
+};
+
+/* Little endian, followed by the index, then the payloads at BUNDLE_ALIGN offsets */
+struct bundle_header
+{
+    char magic[8];
+    uint32_t header_size; /* header and index */
+    uint32_t entry_count;
+    uint32_t index_crc;
+    char module_id[32];   /* of the main image: the modem the bundle is for */
+    uint8_t reserved[76];
+} __attribute__ ((__packed__));
+
+/* Sorted by name */
+struct bundle_entry
+{
+    char name[BUNDLE_NAME_LENGTH]; /* relative to the firmware directory, '/' separated */
+    uint32_t type;
+    uint32_t crc;       /* of the payload */
+    uint64_t offset;
+    uint64_t length;
+    char version[16];   /* "MM.mmm" of a single image, empty otherwise */
+} __attribute__ ((__packed__));
+
+/* A bundle mapped once and shared by everything reading from it */
+struct bundle
+{
+    char path[512];
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint8_t *base;
+    size_t size;
+    const struct bundle_header *hdr;
+    const struct bundle_entry *entries;
+    uint32_t entry_count;
+    int refs;
+    struct bundle *next;
+};
+
+int bundle_resolve(const char *path, struct bundle **bundle, const struct bundle_entry **entry);
+void bundle_put(struct bundle *bundle);
+uint64_t bundle_entry_offset(const struct bundle_entry *entry);
+uint64_t bundle_entry_length(const struct bundle_entry *entry);
+FILE *bundle_fopen(const char *path);
+int bundle_open_range(const char *path, int *fd, uint64_t *offset, uint64_t *length, struct bundle **bundle);
+int bundle_create(const char *path, const char *main_file_path, const char *oem_file_path, const char *carrier_file_path);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-crc32.h"
+#include <pthread.h>
+#include <string.h>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/*
+ * The reflected 0xedb88320 CRC used by the single image headers. ARMv8 has
+ * an instruction for this polynomial; elsewhere a slice-by-8 table walk
+ * consumes 8 bytes per step. The x86 crc32 instruction computes CRC-32C, a
+ * different polynomial, so it is of no use here.
+ */
+
+#define CRC32_POLY 0xedb88320
+
+#if defined(__ARM_FEATURE_CRC32)
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7))
+    {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t word;
+
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32d(crc, word);
+    }
+    while (len--)
+        crc = __crc32b(crc, *p++);
+    return ~crc;
+}
+
+#else
+
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+    uint32_t i, j, crc;
+
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32_POLY & -(crc & 1));
+        crc32_table[0][i] = crc;
+    }
+    /* table[k][i]: the CRC of byte i followed by k zero bytes */
+    for (i = 0; i < 256; i++)
+    {
+        for (j = 1; j < 8; j++)
+            crc32_table[j][i] = (crc32_table[j - 1][i] >> 8) ^ crc32_table[0][crc32_table[j - 1][i] & 0xff];
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    pthread_once(&crc32_once, crc32_init);
+
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint32_t lo, hi;
+
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff]
+            ^ crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24]
+            ^ crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff]
+            ^ crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+    }
+#endif
+    while (len--)
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+#endif
@@ -0,0 +1,24 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_CRC32_H_
+#define __QL_CRC32_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/* crc32_update(0, buf, len) is the zlib/IEEE 802.3 CRC of buf */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+#endif
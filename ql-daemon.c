@@ -0,0 +1,386 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-sahara-core.h"
+#include "ql-daemon.h"
+#include "ql-mbim.h"
+#include "ql-usb-index.h"
+#include <libudev.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Daemon mode: one long-running process answers the query commands over a
+ * Unix socket, so modemfwd's frequent calls don't each pay for glib setup,
+ * a sysfs scan and an MBIM open. The USB index, the MbimDevice and the
+ * answers of cacheable commands are kept until udev reports a USB or
+ * cdc-wdm change.
+ *
+ * Protocol, one request per connection: the client sends the command name
+ * and a newline, the daemon answers with the exit code on the first line
+ * followed by exactly what the command prints in the one-shot CLI.
+ */
+
+struct daemon_cache
+{
+    char *text;
+    size_t len;
+    int status;
+    int valid;
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+    (void)sig;
+    daemon_stop = 1;
+}
+
+static int daemon_connect(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int daemon_listen(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        dbg("socket path too long: %s", socket_path);
+        return -1;
+    }
+
+    fd = daemon_connect(socket_path);
+    if (fd >= 0)
+    {
+        dbg("a daemon is already listening on %s", socket_path);
+        close(fd);
+        return -1;
+    }
+    /* left behind by a daemon that did not exit cleanly */
+    unlink(socket_path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8))
+    {
+        dbg("can't listen on %s: %s", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int daemon_write_all(int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void daemon_flush(struct daemon_cache *cache, unsigned count)
+{
+    unsigned i;
+
+    usb_index_invalidate();
+    if (mbim_loaded())
+        mbim_loaded()->release_device(NULL);
+    for (i = 0; i < count; i++)
+    {
+        free(cache[i].text);
+        memset(&cache[i], 0, sizeof(struct daemon_cache));
+    }
+}
+
+static void daemon_serve(int client, const struct daemon_command *commands, struct daemon_cache *cache,
+                         int use_cache)
+{
+    struct timeval tv = { DAEMON_IO_TIMEOUT_MS / 1000, (DAEMON_IO_TIMEOUT_MS % 1000) * 1000 };
+    char request[DAEMON_MAX_REQUEST];
+    char header[16];
+    size_t len = 0;
+    char *text = NULL;
+    size_t text_len = 0;
+    int status;
+    FILE *fp;
+    int i;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while (len < sizeof(request) - 1)
+    {
+        ssize_t n = read(client, request + len, sizeof(request) - 1 - len);
+
+        if (n <= 0)
+            break;
+        len += n;
+        if (memchr(request, '\n', len))
+            break;
+    }
+    request[len] = '\0';
+    request[strcspn(request, "\r\n")] = '\0';
+
+    for (i = 0; commands[i].name; i++)
+    {
+        if (!strcmp(commands[i].name, request))
+            break;
+    }
+    if (!commands[i].name)
+    {
+        dprintf(client, "%d\nunknown command: %s\n", EXIT_FAILURE, request);
+        return;
+    }
+
+    if (use_cache && commands[i].cacheable && cache[i].valid)
+    {
+        snprintf(header, sizeof(header), "%d\n", cache[i].status);
+        if (daemon_write_all(client, header, strlen(header)) == 0)
+            daemon_write_all(client, cache[i].text, cache[i].len);
+        return;
+    }
+
+    fp = open_memstream(&text, &text_len);
+    if (!fp)
+    {
+        dprintf(client, "%d\n", EXIT_FAILURE);
+        return;
+    }
+    status = commands[i].handler(fp);
+    fclose(fp);
+
+    snprintf(header, sizeof(header), "%d\n", status);
+    if (daemon_write_all(client, header, strlen(header)) == 0)
+        daemon_write_all(client, text, text_len);
+
+    if (use_cache && commands[i].cacheable && status == 0)
+    {
+        free(cache[i].text);
+        cache[i].text = text;
+        cache[i].len = text_len;
+        cache[i].status = status;
+        cache[i].valid = 1;
+    }
+    else
+    {
+        free(text);
+    }
+}
+
+/* Serve commands on socket_path until SIGTERM/SIGINT */
+int daemon_run(const char *socket_path, const struct daemon_command *commands)
+{
+    struct daemon_cache *cache;
+    struct udev *udev = udev_new();
+    struct udev_monitor *mon = NULL;
+    struct pollfd pfd[2];
+    struct sigaction sa;
+    unsigned count = 0;
+    int ret = EXIT_FAILURE;
+
+    while (commands[count].name)
+        count++;
+    cache = calloc(count, sizeof(struct daemon_cache));
+    if (!cache)
+        goto EXIT;
+
+    pfd[0].fd = daemon_listen(socket_path);
+    pfd[0].events = POLLIN;
+    if (pfd[0].fd < 0)
+        goto EXIT;
+
+    pfd[1].fd = -1;
+    pfd[1].events = POLLIN;
+    if (udev)
+        mon = udev_monitor_new_from_netlink(udev, "udev");
+    if (mon)
+    {
+        udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", "usb_device");
+        udev_monitor_filter_add_match_subsystem_devtype(mon, "usbmisc", NULL);
+        if (udev_monitor_enable_receiving(mon) == 0)
+            pfd[1].fd = udev_monitor_get_fd(mon);
+    }
+    if (pfd[1].fd < 0)
+        dbg("udev monitor not available, answers are not cached");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    mbim_keep_device = 1;
+    syslog(0, "serving on %s\n", socket_path);
+
+    while (!daemon_stop)
+    {
+        if (poll(pfd, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfd[1].revents & POLLIN)
+        {
+            struct udev_device *event;
+
+            while ((event = udev_monitor_receive_device(mon)) != NULL)
+                udev_device_unref(event);
+            daemon_flush(cache, count);
+        }
+
+        if (pfd[0].revents & POLLIN)
+        {
+            int client = accept4(pfd[0].fd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (client < 0)
+                continue;
+            /* without hotplug events nothing would tell us the modem changed */
+            if (pfd[1].fd < 0)
+                usb_index_invalidate();
+            daemon_serve(client, commands, cache, pfd[1].fd >= 0);
+            close(client);
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+    close(pfd[0].fd);
+    unlink(socket_path);
+
+EXIT:
+    if (cache)
+    {
+        daemon_flush(cache, count);
+        free(cache);
+    }
+    if (mon)
+        udev_monitor_unref(mon);
+    if (udev)
+        udev_unref(udev);
+    return ret;
+}
+
+/*
+ * Run one command in the daemon listening on socket_path and copy its
+ * output to out. Returns the command's exit code, or -1 if no daemon
+ * answers in time and the caller should run the command itself. Nothing
+ * is written to out unless the whole answer arrived.
+ */
+int daemon_request(const char *socket_path, const char *name, FILE *out)
+{
+    struct timeval tv = { DAEMON_IO_TIMEOUT_MS / 1000, (DAEMON_IO_TIMEOUT_MS % 1000) * 1000 };
+    struct timeval reply_tv = { DAEMON_REPLY_TIMEOUT_MS / 1000, (DAEMON_REPLY_TIMEOUT_MS % 1000) * 1000 };
+    char buf[DAEMON_MAX_RESPONSE];
+    char *text = NULL;
+    size_t text_len = 0;
+    int status = -1;
+    int complete = 0;
+    char *body;
+    FILE *fp;
+    int fd;
+
+    fd = daemon_connect(socket_path);
+    if (fd < 0)
+        return -1;
+
+    /* a wedged daemon must not hang modemfwd */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (dprintf(fd, "%s\n", name) < 0 || shutdown(fd, SHUT_WR))
+    {
+        close(fd);
+        return -1;
+    }
+    /*
+     * The daemon answers once its handler is done. Giving up earlier would
+     * run the same MBIM session here while the daemon still holds the device.
+     */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &reply_tv, sizeof(reply_tv));
+
+    fp = open_memstream(&text, &text_len);
+    if (!fp)
+    {
+        close(fd);
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        /* EOF is the end of the answer, a timeout or an error is no answer */
+        complete = n == 0;
+        if (n <= 0)
+            break;
+        fwrite(buf, 1, n, fp);
+    }
+    close(fd);
+    if (fclose(fp) || !complete || !text_len)
+        goto EXIT;
+
+    body = memchr(text, '\n', text_len);
+    if (!body || sscanf(text, "%d", &status) != 1)
+    {
+        status = -1;
+        goto EXIT;
+    }
+    body++;
+    fwrite(body, 1, text_len - (body - text), out);
+
+EXIT:
+    free(text);
+    return status;
+}
@@ -0,0 +1,36 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_DAEMON_H_
+#define __QL_DAEMON_H_
+#include <stdio.h>
+
+#define DAEMON_DEFAULT_SOCKET "/run/qmodemhelper.sock"
+#define DAEMON_MAX_REQUEST 128
+#define DAEMON_MAX_RESPONSE 4096
+#define DAEMON_IO_TIMEOUT_MS 1000     /* connecting and sending a request */
+#define DAEMON_REPLY_TIMEOUT_MS 30000 /* the handler, e.g. a cold MBIM open */
+
+struct daemon_command
+{
+    const char *name;          /* the long option name, e.g. get_fw_info */
+    int (*handler)(FILE *out); /* prints what the CLI would, returns the exit code */
+    int cacheable;             /* the answer holds until the next hotplug event */
+};
+
+int daemon_run(const char *socket_path, const struct daemon_command *commands);
+int daemon_request(const char *socket_path, const char *name, FILE *out);
+
+#endif
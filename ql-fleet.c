@@ -0,0 +1,249 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-fleet.h"
+#include "ql-fw-cache.h"
+#include "ql-mbim.h"
+#include "ql-qdl-sahara.h"
+
+/*
+ * Fleet mode: flash every Quectel modem attached to the host at once, one
+ * worker thread per modem, each with its own qdl_device. Modems are tracked
+ * by their sysfs port name because their device node changes every time
+ * they switch between normal, EDL and download mode.
+ */
+
+unsigned fleet_per_hub = FLEET_DEFAULT_PER_HUB;
+
+static struct fleet_hub *fleet_hub(struct fleet *fleet, int busnum)
+{
+    unsigned i;
+
+    for (i = 0; i < fleet->hub_count; i++)
+    {
+        if (fleet->hubs[i].busnum == busnum)
+            return &fleet->hubs[i];
+    }
+    if (fleet->hub_count == FLEET_MAX_HUBS)
+        return NULL;
+
+    fleet->hubs[fleet->hub_count].busnum = busnum;
+    sem_init(&fleet->hubs[fleet->hub_count].slots, 0, fleet_per_hub ? fleet_per_hub : FLEET_MAX_DEVICES);
+    return &fleet->hubs[fleet->hub_count++];
+}
+
+/*
+ * The same sequence as flash_firmware(), for the modem on usb->port: recover
+ * it through EDL, switch it to download mode over MBIM, then flash. usb is
+ * refreshed every time the modem re-enumerates.
+ */
+int fleet_flash_modem(const struct fleet_job *job, struct usb_index_device *usb, struct qdl_target *target)
+{
+    const struct mbim_ops *mbim;
+    /* qdl_flash_target() edits the oem path in place */
+    char *main_fw = strdup(job->main_file_path);
+    char *oem_fw = strdup(job->oem_file_path);
+    char *carrier_fw = strdup(job->carrier_file_path);
+    int ret = 0;
+
+    if (!main_fw || !oem_fw || !carrier_fw)
+    {
+        ret = -ENOMEM;
+        goto EXIT;
+    }
+    fw_cache_invalidate(usb->port);
+
+    if (usb->mode == SWITCHED_TO_EDL)
+    {
+        qdl_target_report(target, "recovery", -1);
+        if (job->slots)
+            sem_wait(job->slots);
+        ret = qdl_flash_target(target, main_fw, oem_fw, carrier_fw);
+        if (job->slots)
+            sem_post(job->slots);
+        if (ret)
+            goto EXIT;
+        strcpy(oem_fw, job->oem_file_path);
+
+        qdl_target_report(target, "rebooting", -1);
+        ret = usb_index_wait(usb->port, USB_INDEX_MODE(NORMAL_OPERATION) | USB_INDEX_MODE(SWITCHED_TO_SBL), NULL, FLEET_REBOOT_TIMEOUT_MS, usb);
+        if (ret)
+            goto EXIT;
+    }
+
+    if (usb->mode == NORMAL_OPERATION)
+    {
+        qdl_target_report(target, "switching", -1);
+        if (!usb->cdc_wdm[0])
+        {
+            ret = -ENODEV;
+            goto EXIT;
+        }
+        /* workers share the default session */
+        if (job->mbim_lock)
+            pthread_mutex_lock(job->mbim_lock);
+        mbim = mbim_load();
+        if (mbim)
+            mbim->switch_to_download(job->session, usb->cdc_wdm);
+        if (job->mbim_lock)
+            pthread_mutex_unlock(job->mbim_lock);
+        if (!mbim)
+        {
+            ret = -ENOENT;
+            goto EXIT;
+        }
+
+        ret = usb_index_wait(usb->port, USB_INDEX_MODE(SWITCHED_TO_SBL), NULL, FLEET_SWITCH_TIMEOUT_MS, usb);
+        if (ret)
+            goto EXIT;
+    }
+
+    qdl_target_report(target, "flashing", 0);
+    if (job->slots)
+        sem_wait(job->slots);
+    ret = sahara_flash_target(target, main_fw, oem_fw, carrier_fw);
+    if (job->slots)
+        sem_post(job->slots);
+
+EXIT:
+    free(main_fw);
+    free(oem_fw);
+    free(carrier_fw);
+    qdl_target_report(target, ret ? "failed" : "done", -1);
+    return ret;
+}
+
+static void *fleet_worker(void *arg)
+{
+    struct fleet_device *dev = (struct fleet_device *)arg;
+    struct fleet *fleet = dev->fleet;
+    struct fleet_job job = {
+        .main_file_path = fleet->main_file_path,
+        .oem_file_path = fleet->oem_file_path,
+        .carrier_file_path = fleet->carrier_file_path,
+        .slots = &fleet_hub(fleet, dev->usb.busnum)->slots,
+        .session = NULL,
+        .mbim_lock = &fleet->mbim_lock,
+    };
+
+    dev->start_usec = qdl_time_usec();
+    dev->result = fleet_flash_modem(&job, &dev->usb, &dev->target);
+    dev->end_usec = qdl_time_usec();
+    dev->done = 1;
+    return NULL;
+}
+
+static void fleet_print_progress(struct fleet *fleet)
+{
+    unsigned i;
+
+    for (i = 0; i < fleet->count; i++)
+    {
+        struct fleet_device *dev = &fleet->devices[i];
+        printf("FLEET: %-12s bus %-3d %-10s %3d%%\n", dev->usb.port, dev->usb.busnum, dev->target.stage, dev->target.percent);
+    }
+}
+
+int fleet_flash_all(char *main_file_path, char *oem_file_path, char *carrier_file_path)
+{
+    const struct usb_index *index;
+    struct fleet *fleet;
+    unsigned i, pending, failed = 0;
+    int count;
+
+    fleet = calloc(1, sizeof(struct fleet));
+    if (!fleet)
+        return EXIT_FAILURE;
+
+    fleet->main_file_path = main_file_path;
+    fleet->oem_file_path = oem_file_path;
+    fleet->carrier_file_path = carrier_file_path;
+    pthread_mutex_init(&fleet->mbim_lock, NULL);
+
+    index = usb_index_refresh();
+    if (!index || index->count == 0)
+    {
+        printf("FLEET: no Quectel modem found\n");
+        free(fleet);
+        return EXIT_FAILURE;
+    }
+    fleet->count = count = index->count;
+    for (i = 0; i < fleet->count; i++)
+        memcpy(&fleet->devices[i].usb, &index->devices[i], sizeof(struct usb_index_device));
+
+    for (i = 0; i < fleet->count; i++)
+    {
+        struct fleet_device *dev = &fleet->devices[i];
+
+        dev->fleet = fleet;
+        dev->target.stage = "queued";
+        dev->target.port = dev->usb.port;
+        dev->target.name = dev->usb.port;
+        if (!fleet_hub(fleet, dev->usb.busnum))
+        {
+            dev->target.stage = "failed";
+            dev->result = -ENOSPC;
+            dev->done = 1;
+            continue;
+        }
+    }
+
+    syslog(0, "FLEET: flashing %u modems on %u root hubs, %u at a time per hub\n",
+           fleet->count, fleet->hub_count, fleet_per_hub);
+    for (i = 0; i < fleet->count; i++)
+    {
+        struct fleet_device *dev = &fleet->devices[i];
+
+        if (dev->done)
+            continue;
+        if (pthread_create(&dev->thread, NULL, fleet_worker, dev))
+        {
+            dev->target.stage = "failed";
+            dev->result = -errno;
+            dev->done = 1;
+        }
+    }
+
+    do
+    {
+        usleep(FLEET_PROGRESS_INTERVAL_MS * 1000);
+        pending = 0;
+        for (i = 0; i < fleet->count; i++)
+            pending += !fleet->devices[i].done;
+        fleet_print_progress(fleet);
+    } while (pending);
+
+    for (i = 0; i < fleet->count; i++)
+    {
+        struct fleet_device *dev = &fleet->devices[i];
+
+        if (dev->thread)
+            pthread_join(dev->thread, NULL);
+        if (dev->result)
+            failed++;
+        printf("FLEET: %s %s (%d) in %llu s\n", dev->usb.port, dev->result ? "FAILED" : "OK", dev->result,
+               (unsigned long long)((dev->end_usec - dev->start_usec) / 1000000));
+        syslog(0, "FLEET: %s %s (%d)\n", dev->usb.port, dev->result ? "FAILED" : "OK", dev->result);
+    }
+
+    for (i = 0; i < fleet->hub_count; i++)
+        sem_destroy(&fleet->hubs[i].slots);
+    pthread_mutex_destroy(&fleet->mbim_lock);
+    free(fleet);
+
+    printf("FLEET: %u of %d modems flashed\n", count - failed, count);
+    return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,81 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_FLEET_H_
+#define __QL_FLEET_H_
+#include "ql-sahara-core.h"
+#include "ql-usb-index.h"
+#include "ql-mbim.h"
+#include <pthread.h>
+#include <semaphore.h>
+
+#define FLEET_MAX_DEVICES USB_INDEX_MAX_DEVICES
+#define FLEET_MAX_HUBS 32
+/* Modems flashed at the same time behind one root hub */
+#define FLEET_DEFAULT_PER_HUB 4
+#define FLEET_SWITCH_TIMEOUT_MS 30000
+#define FLEET_REBOOT_TIMEOUT_MS 120000
+#define FLEET_PROGRESS_INTERVAL_MS 2000
+
+struct fleet;
+
+/* How to flash one modem, shared by the fleet workers and libqmodemhelper */
+struct fleet_job
+{
+    const char *main_file_path;
+    const char *oem_file_path;
+    const char *carrier_file_path;
+    sem_t *slots;                  /* transfers allowed on the modem's root hub, NULL: no limit */
+    struct FwUpdaterData *session; /* MBIM session for the mode switch, NULL: the default one */
+    pthread_mutex_t *mbim_lock;    /* held around the mode switch, NULL if session is not shared */
+};
+
+struct fleet_device
+{
+    struct usb_index_device usb; /* refreshed whenever the modem re-enumerates */
+    struct qdl_target target; /* stage and percent for the progress report */
+    int result;
+    volatile int done;
+    uint64_t start_usec;
+    uint64_t end_usec;
+    pthread_t thread;
+    struct fleet *fleet;
+};
+
+/* Root hubs share their bandwidth between every modem on the bus */
+struct fleet_hub
+{
+    int busnum;
+    sem_t slots;
+};
+
+struct fleet
+{
+    char *main_file_path;
+    char *oem_file_path;
+    char *carrier_file_path;
+    struct fleet_device devices[FLEET_MAX_DEVICES];
+    unsigned count;
+    struct fleet_hub hubs[FLEET_MAX_HUBS];
+    unsigned hub_count;
+    pthread_mutex_t mbim_lock; /* the MBIM code keeps one global context */
+};
+
+extern unsigned fleet_per_hub;
+
+int fleet_flash_modem(const struct fleet_job *job, struct usb_index_device *usb, struct qdl_target *target);
+int fleet_flash_all(char *main_file_path, char *oem_file_path, char *carrier_file_path);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-sahara-core.h"
+#include "ql-fw-cache.h"
+
+/*
+ * The firmware versions only change with a flash, so after the first MBIM
+ * query they are kept in a small file per modem under /run (gone on
+ * reboot). An entry is only used for the same port, usbfs node, serial
+ * number and boot; the usbfs node changes whenever the modem re-enumerates,
+ * which every flash and reset does. Flashing also drops the entries
+ * explicitly.
+ */
+
+static void fw_cache_path(const char *port, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s%s", FW_CACHE_DIR, FW_CACHE_PREFIX, port);
+}
+
+static int fw_cache_make_key(const struct usb_index_device *dev, struct fw_cache_key *key)
+{
+    FILE *fp;
+
+    memset(key, 0, sizeof(struct fw_cache_key));
+    snprintf(key->port, sizeof(key->port), "%s", dev->port);
+    snprintf(key->dev_node, sizeof(key->dev_node), "%s", dev->dev_node);
+    snprintf(key->serial, sizeof(key->serial), "%s", dev->serial);
+
+    fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!fp)
+        return -1;
+    if (!fgets(key->boot_id, sizeof(key->boot_id), fp))
+    {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    key->boot_id[strcspn(key->boot_id, "\n")] = '\0';
+
+    return 0;
+}
+
+/* 0 and the cached versions if there is a valid entry for dev */
+int fw_cache_load(const struct usb_index_device *dev, struct fw_cache_entry *entry)
+{
+    struct fw_cache_key key;
+    char path[PATH_LENGTH];
+    ssize_t len;
+    int fd;
+
+    if (fw_cache_make_key(dev, &key))
+        return -1;
+
+    fw_cache_path(dev->port, path, sizeof(path));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    len = read(fd, entry, sizeof(struct fw_cache_entry));
+    close(fd);
+
+    if (len != sizeof(struct fw_cache_entry) || memcmp(entry->magic, FW_CACHE_MAGIC, sizeof(entry->magic))
+        || memcmp(&entry->key, &key, sizeof(key)))
+        return -1;
+
+    return 0;
+}
+
+int fw_cache_save(const struct usb_index_device *dev, struct fw_cache_entry *entry)
+{
+    char path[PATH_LENGTH];
+    char tmp_path[PATH_LENGTH + 16];
+    ssize_t len;
+    int fd;
+
+    memcpy(entry->magic, FW_CACHE_MAGIC, sizeof(entry->magic));
+    if (fw_cache_make_key(dev, &entry->key))
+        return -1;
+
+    if (mkdir(FW_CACHE_DIR, 0755) && errno != EEXIST)
+        return -1;
+
+    fw_cache_path(dev->port, path, sizeof(path));
+    fd = file_replace_open(path, tmp_path, sizeof(tmp_path));
+    if (fd < 0)
+        return -1;
+    len = write(fd, entry, sizeof(struct fw_cache_entry));
+    close(fd);
+
+    return file_replace_commit(tmp_path, path, len == sizeof(struct fw_cache_entry));
+}
+
+/* Drop the entry of the modem on port, or of every modem if port is NULL */
+void fw_cache_invalidate(const char *port)
+{
+    char path[PATH_LENGTH];
+    struct dirent *ent;
+    DIR *pDir;
+
+    if (port)
+    {
+        fw_cache_path(port, path, sizeof(path));
+        unlink(path);
+        return;
+    }
+
+    pDir = opendir(FW_CACHE_DIR);
+    if (!pDir)
+        return;
+    while ((ent = readdir(pDir)) != NULL)
+    {
+        if (strncmp(ent->d_name, FW_CACHE_PREFIX, strlen(FW_CACHE_PREFIX)))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", FW_CACHE_DIR, ent->d_name);
+        unlink(path);
+    }
+    closedir(pDir);
+}
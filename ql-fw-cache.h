@@ -0,0 +1,47 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_FW_CACHE_H_
+#define __QL_FW_CACHE_H_
+#include "ql-usb-index.h"
+
+#define FW_CACHE_DIR "/run/qmodemhelper"
+#define FW_CACHE_PREFIX "fw_info."
+#define FW_CACHE_MAGIC "QFWINFO1"
+
+/* The device the versions were read from, any change means a stale entry */
+struct fw_cache_key
+{
+    char port[32];
+    char dev_node[32]; /* changes every time the modem re-enumerates */
+    char serial[64];
+    char boot_id[40];
+};
+
+struct fw_cache_entry
+{
+    char magic[8];
+    struct fw_cache_key key;
+    char main_version[128];
+    char carrier_uuid[128];
+    char carrier_version[128];
+    char oem_version[128];
+};
+
+int fw_cache_load(const struct usb_index_device *dev, struct fw_cache_entry *entry);
+int fw_cache_save(const struct usb_index_device *dev, struct fw_cache_entry *entry);
+void fw_cache_invalidate(const char *port);
+
+#endif
@@ -27,14 +27,35 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <time.h>
 
 const char kGpioSysFsPath[]  = "/sys/class/gpio";
 const char kGpioExportPath[] = "/sys/class/gpio/export";
 const char kGpioPathPrefix[] = "/sys/class/gpio/gpio";
 
+const char kGpioDevPath[]     = "/dev";
+const char kGpioBusPath[]     = "/sys/bus/gpio/devices";
+const char kGpioConsumer[]    = "qmodemhelper";
+
 const useconds_t kUdevWait   = 500 ;
 const useconds_t kToggleWait = 1000;
 
+unsigned long gpio_pulse_usec = GPIO_DEFAULT_PULSE_USEC;
+
+/* usleep() may reject a second or more, the pulse is slept with nanosleep() */
+static void gpio_pulse_sleep(unsigned long pulse_usec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = pulse_usec / 1000000;
+    ts.tv_nsec = (pulse_usec % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
 
 static int check_gpio_device(char* gpio_chip_name, char* gpio_chip_path)
 {
@@ -52,7 +73,110 @@ static int check_gpio_device(char* gpio_chip_name, char* gpio_chip_path)
 }
 
 
-int gpio_reboot_modem(char* gpio_chip,int reset_line)
+#ifdef GPIO_V2_GET_LINE_IOCTL
+/*
+ * The chip may be given by its label, its gpiochipN name, or, as with the
+ * sysfs backend, the name of its parent device.
+ */
+static int gpio_cdev_match(const char* gpio_chip, const struct gpiochip_info* info)
+{
+    char path[PATH_MAX];
+    char real_path[PATH_MAX];
+
+    if (!strcmp(gpio_chip, info->label) || !strcmp(gpio_chip, info->name))
+        return 1;
+
+    snprintf(path, sizeof(path), "%s/%s", kGpioBusPath, info->name);
+    if (!realpath(path, real_path))
+        return 0;
+    return !strcmp(gpio_chip, basename(dirname(real_path)));
+}
+
+static int gpio_cdev_open_chip(const char* gpio_chip, struct gpiochip_info* info)
+{
+    char chip_path[MAX_FILE_NAME_LEN];
+    struct dirent *dirp;
+    DIR *dp;
+    int fd = -1;
+
+    if ((dp = opendir(kGpioDevPath)) == NULL)
+        return -1;
+
+    while ((dirp = readdir(dp)) != NULL) {
+        if (strncmp(dirp->d_name, "gpiochip", strlen("gpiochip")))
+            continue;
+
+        snprintf(chip_path, sizeof(chip_path), "%s/%s", kGpioDevPath, dirp->d_name);
+        fd = open(chip_path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        memset(info, 0, sizeof(*info));
+        if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, info) == 0 && gpio_cdev_match(gpio_chip, info)) {
+            printf("Found a chip at : %s (%s, %u lines)\n", chip_path, info->label, info->lines);
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    closedir(dp);
+
+    return fd;
+}
+
+/*
+ * Pulse the line low for pulse_usec through the GPIO character device.
+ * Returns -ENODEV when the chip or line can't be had this way, so the caller
+ * can fall back to sysfs (e.g. the line is still exported from an older run).
+ */
+static int gpio_cdev_reboot_modem(const char* gpio_chip, int reset_line, unsigned long pulse_usec)
+{
+    struct gpiochip_info info;
+    struct gpio_v2_line_request req;
+    struct gpio_v2_line_values values;
+    int chip_fd;
+    int ret = EXIT_SUCCESS;
+
+    chip_fd = gpio_cdev_open_chip(gpio_chip, &info);
+    if (chip_fd < 0)
+        return -ENODEV;
+    if (reset_line < 0 || (unsigned)reset_line >= info.lines) {
+        syslog(LOG_ERR, "Reset line %d is out of range for %s", reset_line, info.name);
+        close(chip_fd);
+        return EXIT_FAILURE;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = reset_line;
+    req.num_lines = 1;
+    snprintf(req.consumer, sizeof(req.consumer), "%s", kGpioConsumer);
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = 0;
+    req.config.attrs[0].mask = 1;
+
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        syslog(LOG_ERR, "Can't request line %d of %s: %s", reset_line, info.name, strerror(errno));
+        close(chip_fd);
+        return -ENODEV;
+    }
+    close(chip_fd);
+
+    // The line is driven low from the request on
+    gpio_pulse_sleep(pulse_usec);
+    values.bits = 1;
+    values.mask = 1;
+    if (ioctl(req.fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+        syslog(LOG_ERR, "Error releasing the reset line: %s", strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+    close(req.fd);
+
+    return ret;
+}
+#endif
+
+static int gpio_sysfs_reboot_modem(char* gpio_chip,int reset_line, unsigned long pulse_usec)
 {
     DIR *dp;
     FILE * base_fp;
@@ -203,7 +327,7 @@ int gpio_reboot_modem(char* gpio_chip,int reset_line)
     fprintf(value_fp, "0");
     fclose(value_fp);
 
-    sleep(1);
+    gpio_pulse_sleep(pulse_usec);
     value_fp = fopen(gpio_line_value,"w+");
     if (!value_fp) {
         syslog(LOG_ERR, "Error opening GPIO line value file: %s", strerror(errno));
@@ -214,3 +338,29 @@ int gpio_reboot_modem(char* gpio_chip,int reset_line)
 
    return EXIT_SUCCESS;
 }
+
+/* Hold reset_line of gpio_chip low for pulse_usec */
+int gpio_reset_modem(char* gpio_chip, int reset_line, unsigned long pulse_usec)
+{
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    int ret;
+#endif
+
+    if (pulse_usec < GPIO_MIN_PULSE_USEC || pulse_usec > GPIO_MAX_PULSE_USEC) {
+        syslog(LOG_ERR, "Reset pulse of %lu us is out of range", pulse_usec);
+        return -EINVAL;
+    }
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    printf(" %s Reseting line: %d of %s, pulse %lu us\n", __FUNCTION__, reset_line, gpio_chip, pulse_usec);
+    ret = gpio_cdev_reboot_modem(gpio_chip, reset_line, pulse_usec);
+    if (ret != -ENODEV)
+        return ret;
+    syslog(0, "GPIO character device not usable, falling back to sysfs\n");
+#endif
+    return gpio_sysfs_reboot_modem(gpio_chip, reset_line, pulse_usec);
+}
+
+int gpio_reboot_modem(char* gpio_chip,int reset_line)
+{
+    return gpio_reset_modem(gpio_chip, reset_line, gpio_pulse_usec);
+}
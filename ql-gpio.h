@@ -17,5 +17,12 @@
 #ifndef QL_GPIO_H
 #define QL_GPIO_H
 #define MAX_FILE_NAME_LEN 1024
+#define GPIO_DEFAULT_PULSE_USEC 1000000
+#define GPIO_MIN_PULSE_USEC 1
+#define GPIO_MAX_PULSE_USEC 60000000
+
+extern unsigned long gpio_pulse_usec;
+
 int gpio_reboot_modem(char* gpio_chip,int reset_line);
+int gpio_reset_modem(char* gpio_chip, int reset_line, unsigned long pulse_usec);
 #endif
@@ -0,0 +1,229 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-image-verify.h"
+#include "ql-crc32.h"
+#include "ql-bundle.h"
+
+/*
+ * Preflight check of the CRCs a single image header carries, so that a
+ * corrupt file is caught before the modem rejects it in SBL mode:
+ *
+ *   header_crc  the rest of the header, from body_crc to its end
+ *   body_crc    the image_size bytes following the header
+ *   crc         of each image_list[] segment, file_offset/file_len in the file
+ *   bundle      the whole image, for an image read from a bundle
+ *
+ * A CRC of 0 is taken as not set. Checks are shared out between worker
+ * threads, largest first, while the caller waits for the mode switch.
+ *
+ * What the first three cover is read from single_image_hdr alone: no
+ * vendor definition or reference image confirms it. A mismatch of those
+ * kinds therefore only fails the check once another CRC of the same kind
+ * matched in the same run, which shows the range and the polynomial are
+ * right. If none of a kind matches, that kind is reported and ignored.
+ * The bundle CRC is ours and always enforced.
+ */
+
+static const char *const image_check_names[IMAGE_CHECK_KINDS] = {
+    [IMAGE_CHECK_HEADER] = "header",
+    [IMAGE_CHECK_BODY] = "body",
+    [IMAGE_CHECK_SEGMENT] = "segment",
+    [IMAGE_CHECK_BUNDLE] = "bundle",
+};
+
+static void *image_verify_worker(void *arg)
+{
+    struct image_verify *verify = (struct image_verify *)arg;
+
+    for (;;)
+    {
+        const struct image_check *check;
+        uint32_t crc;
+
+        pthread_mutex_lock(&verify->lock);
+        check = verify->next_check < verify->check_count ? &verify->checks[verify->next_check++] : NULL;
+        pthread_mutex_unlock(&verify->lock);
+        if (!check)
+            break;
+
+        if (!check->data && sahara_image_wait(check->image, check->offset, check->length))
+        {
+            pthread_mutex_lock(&verify->lock);
+            verify->result = -EBADMSG;
+            pthread_mutex_unlock(&verify->lock);
+            continue;
+        }
+        crc = crc32_update(0, (check->data ? check->data : check->image->base) + check->offset, check->length);
+        if (crc != check->expected)
+        {
+            syslog(LOG_ERR, "%s: %s %u CRC is %08x, expected %08x\n", check->image->path,
+                   image_check_names[check->kind], check->segment, crc, check->expected);
+            dbg("%s: %s %u CRC is %08x, expected %08x", check->image->path,
+                image_check_names[check->kind], check->segment, crc, check->expected);
+        }
+        pthread_mutex_lock(&verify->lock);
+        if (crc != check->expected)
+            verify->failed[check->kind]++;
+        else
+            verify->matched[check->kind]++;
+        pthread_mutex_unlock(&verify->lock);
+    }
+
+    return NULL;
+}
+
+static int image_verify_add(struct image_verify *verify, const struct sahara_image *image, const uint8_t *data,
+                            int kind, unsigned segment, uint64_t offset, uint64_t length, uint32_t expected)
+{
+    struct image_check *check;
+
+    if (!expected)
+        return 0;
+    if (!data && offset + length > image->size)
+    {
+        dbg("%s: %s %u ends past the end of the file", image->path, image_check_names[kind], segment);
+        return -EBADMSG;
+    }
+
+    check = &verify->checks[verify->check_count++];
+    check->image = image;
+    check->data = data;
+    check->kind = kind;
+    check->segment = segment;
+    check->offset = offset;
+    check->length = length;
+    check->expected = expected;
+    return 0;
+}
+
+static int image_verify_compare(const void *a, const void *b)
+{
+    const struct image_check *x = (const struct image_check *)a;
+    const struct image_check *y = (const struct image_check *)b;
+
+    return x->length < y->length ? 1 : x->length > y->length ? -1 : 0;
+}
+
+static int image_verify_plan(struct image_verify *verify, const struct sahara_image *image)
+{
+    const struct single_image_hdr *hdr = (const struct single_image_hdr *)image->base;
+    uint32_t i, image_num;
+    int ret;
+
+    if (sahara_image_wait(image, 0, SINGLE_IMAGE_HDR_SIZE))
+        return -EBADMSG;
+    image_num = le_uint32(hdr->image_num);
+    if (memcmp(hdr->magic, "Quec", sizeof(hdr->magic)))
+    {
+        dbg("%s is not a single image", image->path);
+        return -EBADMSG;
+    }
+    if (image_num > IMAGE_VERIFY_MAX_SEGMENTS)
+    {
+        dbg("%s: %u segments", image->path, image_num);
+        return -EBADMSG;
+    }
+
+    ret = image_verify_add(verify, image, NULL, IMAGE_CHECK_HEADER, 0, offsetof(struct single_image_hdr, body_crc),
+                           SINGLE_IMAGE_HDR_SIZE - offsetof(struct single_image_hdr, body_crc),
+                           le_uint32(hdr->header_crc));
+    if (!ret)
+        ret = image_verify_add(verify, image, NULL, IMAGE_CHECK_BODY, 0, SINGLE_IMAGE_HDR_SIZE,
+                               le_uint32(hdr->image_size), le_uint32(hdr->body_crc));
+    for (i = 0; !ret && i < image_num; i++)
+        ret = image_verify_add(verify, image, NULL, IMAGE_CHECK_SEGMENT, i, le_uint32(hdr->image_list[i].file_offset),
+                               le_uint32(hdr->image_list[i].file_len), le_uint32(hdr->image_list[i].crc));
+    /* the bundle CRC is of the stored bytes, which are compressed for a zstd image */
+    if (!ret && image->entry)
+        ret = image_verify_add(verify, image, image->bundle->base + bundle_entry_offset(image->entry), IMAGE_CHECK_BUNDLE,
+                               0, 0, bundle_entry_length(image->entry), le_uint32(image->entry->crc));
+
+    return ret;
+}
+
+/*
+ * Map files and start checking their CRCs in the background. Whatever this
+ * returns, image_verify_finish() must be called.
+ */
+int image_verify_start(struct image_verify *verify, const char *files[], unsigned count)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned i, threads;
+
+    memset(verify, 0, sizeof(struct image_verify));
+    pthread_mutex_init(&verify->lock, NULL);
+
+    for (i = 0; i < count && i < IMAGE_VERIFY_MAX_FILES; i++)
+    {
+        struct sahara_image *image = &verify->images[verify->image_count];
+
+        if (sahara_image_map(image, files[i]))
+        {
+            verify->result = -ENOENT;
+            return verify->result;
+        }
+        verify->image_count++;
+        verify->result = image_verify_plan(verify, image);
+        if (verify->result)
+            return verify->result;
+    }
+    qsort(verify->checks, verify->check_count, sizeof(struct image_check), image_verify_compare);
+
+    threads = cpus > 0 ? (unsigned)cpus : 1;
+    if (threads > IMAGE_VERIFY_MAX_THREADS)
+        threads = IMAGE_VERIFY_MAX_THREADS;
+    if (threads > verify->check_count)
+        threads = verify->check_count;
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&verify->threads[verify->thread_count], NULL, image_verify_worker, verify))
+            break;
+        verify->thread_count++;
+    }
+
+    return 0;
+}
+
+/* Wait for the checks, 0 if no CRC whose layout is confirmed mismatched */
+int image_verify_finish(struct image_verify *verify)
+{
+    unsigned i;
+
+    /* the caller takes its share, or all of it if no thread started */
+    if (!verify->result)
+        image_verify_worker(verify);
+    for (i = 0; i < verify->thread_count; i++)
+        pthread_join(verify->threads[i], NULL);
+
+    for (i = 0; i < IMAGE_CHECK_KINDS; i++)
+    {
+        if (!verify->failed[i])
+            continue;
+        if (i == IMAGE_CHECK_BUNDLE || verify->matched[i])
+        {
+            verify->result = -EBADMSG;
+            continue;
+        }
+        syslog(LOG_WARNING, "no %s CRC matched, their layout is unconfirmed: not enforced\n", image_check_names[i]);
+        dbg("no %s CRC matched, their layout is unconfirmed: not enforced", image_check_names[i]);
+    }
+    for (i = 0; i < verify->image_count; i++)
+        sahara_image_unmap(&verify->images[i]);
+    pthread_mutex_destroy(&verify->lock);
+
+    return verify->result;
+}
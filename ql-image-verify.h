@@ -0,0 +1,66 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_IMAGE_VERIFY_H_
+#define __QL_IMAGE_VERIFY_H_
+#include "ql-sahara-core.h"
+#include <pthread.h>
+
+#define IMAGE_VERIFY_MAX_FILES 3
+#define IMAGE_VERIFY_MAX_SEGMENTS 36 /* image_list[] of single_image_hdr */
+#define IMAGE_VERIFY_MAX_CHECKS (IMAGE_VERIFY_MAX_FILES * (3 + IMAGE_VERIFY_MAX_SEGMENTS))
+#define IMAGE_VERIFY_MAX_THREADS 8
+
+enum image_check_kind
+{
+    IMAGE_CHECK_HEADER,
+    IMAGE_CHECK_BODY,
+    IMAGE_CHECK_SEGMENT,
+    IMAGE_CHECK_BUNDLE,
+    IMAGE_CHECK_KINDS,
+};
+
+/* One CRC of the header to compare with the data it covers */
+struct image_check
+{
+    const struct sahara_image *image;
+    const uint8_t *data; /* what is checked, NULL for the image content */
+    int kind;
+    unsigned segment;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t expected;
+};
+
+/* The CRCs of a set of single images, checked in the background */
+struct image_verify
+{
+    struct sahara_image images[IMAGE_VERIFY_MAX_FILES];
+    unsigned image_count;
+    struct image_check checks[IMAGE_VERIFY_MAX_CHECKS];
+    unsigned check_count;
+    unsigned next_check;
+    pthread_mutex_t lock;
+    pthread_t threads[IMAGE_VERIFY_MAX_THREADS];
+    unsigned thread_count;
+    unsigned matched[IMAGE_CHECK_KINDS];
+    unsigned failed[IMAGE_CHECK_KINDS];
+    int result;
+};
+
+int image_verify_start(struct image_verify *verify, const char *files[], unsigned count);
+int image_verify_finish(struct image_verify *verify);
+
+#endif
@@ -16,12 +16,16 @@
 
 #include "ql-mbim-core.h"
 #include "ql-sahara-core.h"
+#include "ql-usb-index.h"
+#include "ql-fw-cache.h"
 
 #define VALIDATE_UNKNOWN(str) (str ? str : "unknown")
 
 struct FwUpdaterData s_ctx;
+/* the helper's USB index, clock and firmware cache, see mbim_load() */
+static const struct mbim_host_ops *s_host;
 
-static int find_quectel_mbim_device(struct FwUpdaterData *ctx);
+static int find_quectel_mbim_device(struct FwUpdaterData *ctx, struct usb_index_device *found);
 static int log_printf(int lvl, const char *log_msg);
 static int log_printf(int lvl, const char *log_msg)
 {
@@ -46,94 +50,6 @@ static int log_printf(int lvl, const char *log_msg)
         log_printf(0, log_buff);                          \
     } while (0)
 
-static int file_get_value(const char *fpath, int base);
-int flash_mode_check(void);
-
-int flash_mode_check(void)
-{
-    struct dirent *ent = NULL;
-    DIR *pDir;
-    const char *rootdir = "/sys/bus/usb/devices";
-    int find = NORMAL_OPERATION;
-    int idVendor;
-    int numInterfaces;
-
-    pDir = opendir(rootdir);
-    if (!pDir)
-    {
-        info_printf("could not open [/sys/bus/usb/devices] dir");
-        return -1;
-    }
-
-    while ((ent = readdir(pDir)) != NULL)
-    {
-        int mbim_intf = 0; /* mbim fixed 0 interface*/
-        char path[512] = {'\0'};
-
-        snprintf(path, sizeof(path), "%s/%s/idVendor", rootdir, ent->d_name);
-        idVendor = file_get_value(path, 16);
-        if (idVendor == 0x05c6) {
-          find = SWITCHED_TO_EDL;
-          break;
-        }
-
-        if (idVendor != 0x2c7c && idVendor!= MBIM_NP_VID )
-            continue;
-
-        snprintf(path, sizeof(path), "%s/%s/bNumInterfaces", rootdir, ent->d_name);
-        numInterfaces = file_get_value(path, 10);
-
-        if (numInterfaces == 4)
-        {
-            int bInterfaceClass;
-            int bInterfaceProtocol;
-            int bInterfaceSubClass;
-            int bNumEndpoints;
-
-            snprintf(path, sizeof(path), "%s/%s:1.%d/bInterfaceClass", rootdir, ent->d_name, mbim_intf);
-            bInterfaceClass = file_get_value(path, 16);
-
-            snprintf(path, sizeof(path), "%s/%s:1.%d/bInterfaceProtocol", rootdir, ent->d_name, mbim_intf);
-            bInterfaceProtocol = file_get_value(path, 16);
-
-            snprintf(path, sizeof(path), "%s/%s:1.%d/bInterfaceSubClass", rootdir, ent->d_name, mbim_intf);
-            bInterfaceSubClass = file_get_value(path, 16);
-
-            snprintf(path, sizeof(path), "%s/%s:1.%d/bNumEndpoints", rootdir, ent->d_name, mbim_intf);
-            bNumEndpoints = file_get_value(path, 16);
-
-            if (bInterfaceClass == 0x02 && bInterfaceProtocol == 0x00 && bInterfaceSubClass == 0x0e) // mbim interface
-            {
-                if (bNumEndpoints == 0)
-                {
-                  find = SWITCHED_TO_SBL;
-                }
-            }
-        }
-    }
-    closedir(pDir);
-
-    return find;
-}
-
-
-
-static int file_get_value(const char *fpath, int base)
-{
-    int value = -1;
-    FILE *fp = fopen(fpath, "r");
-
-    if (fp)
-    {
-        if (fscanf(fp, base == 16 ? "%x" : "%d", &value))
-        {
-        };
-        fclose(fp);
-    }
-
-    return value;
-}
-
 void mbim_quec_firmware_update_modem_reboot_set_ready(MbimDevice *dev,
                                                   GAsyncResult *res,
                                                   gpointer user_data)
@@ -353,6 +269,7 @@ void mbim_exec_at_command_ready(MbimDevice *dev,
         at_resp = mbim_message_command_done_get_raw_information_buffer(response, &at_resp_len);
 
         printf("<\n%s", at_resp + 4);
+        ctx->result_code = 0;
     }
 
     mbim_exit(ctx);
@@ -422,20 +339,9 @@ void mbim_switch_sbl_ready(MbimDevice *dev,
 
 
 
-void mbim_device_open_ready(MbimDevice *dev,
-                            GAsyncResult *res,
-                            gpointer user_data)
+/* Send the command of every action set in ctx to the open ctx->mbim_device */
+static void mbim_run_actions(struct FwUpdaterData *ctx)
 {
-    g_autoptr(GError) error = NULL;
-    struct FwUpdaterData *ctx = (struct FwUpdaterData *)(user_data);
-
-    if (!mbim_device_open_finish(dev, res, &error))
-    {
-        error_printf("error: couldn't open the MbimDevice: %s\n",
-                     error->message);
-        g_main_loop_quit(ctx->mainloop);
-    }
-
     if (TEST_ACTION(ctx, SWITCH_SBL))
     {
         guint8 data[2] = {};
@@ -524,6 +430,27 @@ void mbim_device_open_ready(MbimDevice *dev,
 
 
 
+void mbim_device_open_ready(MbimDevice *dev,
+                            GAsyncResult *res,
+                            gpointer user_data)
+{
+    g_autoptr(GError) error = NULL;
+    struct FwUpdaterData *ctx = (struct FwUpdaterData *)(user_data);
+
+    if (!mbim_device_open_finish(dev, res, &error))
+    {
+        error_printf("error: couldn't open the MbimDevice: %s\n",
+                     error->message);
+        g_main_loop_quit(ctx->mainloop);
+        return;
+    }
+
+    ctx->open_usec = s_host->time_usec();
+    mbim_run_actions(ctx);
+}
+
+
+
 void mbim_device_new_ready(GObject *obj,
                            GAsyncResult *res,
                            gpointer user_data)
@@ -554,151 +481,300 @@ void mbim_device_new_ready(GObject *obj,
 
 
 
-static int find_quectel_mbim_device(struct FwUpdaterData *ctx)
+/* session, or the default one, which follows the helper's mbim_keep_device */
+static struct FwUpdaterData *mbim_session(struct FwUpdaterData *session)
 {
-    struct dirent *ent = NULL;
-    DIR *pDir;
-    const char *rootdir = "/sys/bus/usb/devices";
-    int find = 0;
+    if (session)
+        return session;
+    s_ctx.keep_device = *s_host->keep_device;
+    return &s_ctx;
+}
 
-    pDir = opendir(rootdir);
-    if (!pDir)
+/* The modem on ctx->port, or the first one with an MBIM control node */
+static int find_quectel_mbim_device(struct FwUpdaterData *ctx, struct usb_index_device *found)
+{
+    const struct usb_index_device *dev = NULL;
+    struct usb_index_device probe;
+
+    if (ctx->port[0])
     {
-        info_printf("could not open [/sys/bus/usb/devices] dir");
-        return 0;
+        if (s_host->usb_index_probe(ctx->port, &probe) == 0 && probe.cdc_wdm[0])
+            dev = &probe;
     }
-
-    while ((ent = readdir(pDir)) != NULL)
+    else
     {
-        char path[512] = {'\0'};
-        int mbim_intf = 0; /* mbim fixed 0 interface*/
-        int i = 0;
+        dev = s_host->usb_index_find_mbim();
+    }
+    if (!dev)
+        return 0;
 
-        snprintf(path, sizeof(path), "%s/%s/idVendor", rootdir, ent->d_name);
-        ctx->idVendor = file_get_value(path, 16);
-        if (ctx->idVendor != 0x2c7c && ctx->idVendor != 0x05c6 && ctx->idVendor != MBIM_NP_VID )
-            continue;
+    /* a device kept open on another node is gone */
+    if (strcmp(ctx->cdc_wdm, dev->cdc_wdm))
+        g_clear_object(&ctx->mbim_device);
 
-        snprintf(path, sizeof(path), "%s/%s/idProduct", rootdir, ent->d_name);
-        ctx->idProduct = file_get_value(path, 16);
-        snprintf(path, sizeof(path), "%s/%s/bNumInterfaces", rootdir, ent->d_name);
-        ctx->numInterfaces = file_get_value(path, 10);
+    ctx->idVendor = dev->idVendor;
+    ctx->idProduct = dev->idProduct;
+    ctx->numInterfaces = dev->num_interfaces;
+    snprintf(ctx->cdc_wdm, sizeof(ctx->cdc_wdm), "%s", dev->cdc_wdm);
+    if (found)
+        memcpy(found, dev, sizeof(*dev));
+    info_printf("%s %x, %x, %d, %s\n", __func__,
+                ctx->idVendor, ctx->idProduct, ctx->numInterfaces, ctx->cdc_wdm);
 
-        for (i = 0; i < 15; i++)
-        {
-            snprintf(path, sizeof(path), "%s/%s:1.%d/usbmisc/cdc-wdm%d", rootdir, ent->d_name, mbim_intf, i);
-            if (!access(path, R_OK))
-            {
-                snprintf(ctx->cdc_wdm, sizeof(ctx->cdc_wdm), "/dev/cdc-wdm%d", i);
-                find++;
-                break;
-            }
-        }
+    return 1;
+}
 
-        if (find)
-        {
-            info_printf("%s %x, %x, %d, %s\n", __func__,
-                        ctx->idVendor, ctx->idProduct, ctx->numInterfaces, ctx->cdc_wdm);
-            break;
-        }
+
+/*
+ * Run the actions set in ctx to completion. With keep_device the device
+ * opened by the first call serves all later ones.
+ */
+static void mbim_session_run(struct FwUpdaterData *ctx)
+{
+    g_autoptr(GFile) file = NULL;
+
+    /* the device dispatches its callbacks on the context it was created in */
+    g_main_context_push_thread_default(ctx->main_context);
+    ctx->mainloop = g_main_loop_new(ctx->main_context, FALSE);
+
+    if (ctx->keep_device && ctx->mbim_device && mbim_device_is_open(ctx->mbim_device))
+    {
+        mbim_run_actions(ctx);
     }
-    closedir(pDir);
+    else
+    {
+        g_clear_object(&ctx->mbim_device);
+        file = g_file_new_for_path(ctx->cdc_wdm);
 
-    return find;
+        info_printf(" %s %d mbim device initialization!\n",__FILE__,__LINE__);
+        mbim_device_new(file, NULL, (GAsyncReadyCallback)mbim_device_new_ready, ctx);
+    }
+
+    g_main_loop_run(ctx->mainloop);
+    g_main_loop_unref(ctx->mainloop);
+    g_main_context_pop_thread_default(ctx->main_context);
 }
 
 
-int mbim_reboot_modem(void)
+/*
+ * A session of its own for the modem on port (NULL: the first one found),
+ * with its own main context so that it can run in any thread. It keeps the
+ * device open between operations.
+ */
+struct FwUpdaterData *mbim_session_new(const char *port)
 {
-    struct FwUpdaterData *ctx = &s_ctx;
-    g_autoptr(GFile) file = NULL;
-    if (!find_quectel_mbim_device(ctx)) {
+    struct FwUpdaterData *ctx = calloc(1, sizeof(struct FwUpdaterData));
+
+    if (!ctx)
+        return NULL;
+    if (port)
+        snprintf(ctx->port, sizeof(ctx->port), "%s", port);
+    ctx->keep_device = 1;
+    ctx->main_context = g_main_context_new();
+
+    return ctx;
+}
+
+
+void mbim_session_free(struct FwUpdaterData *ctx)
+{
+    if (!ctx)
+        return;
+    g_clear_object(&ctx->mbim_device);
+    g_main_context_unref(ctx->main_context);
+    free(ctx);
+}
+
+
+int mbim_reboot_modem(struct FwUpdaterData *session)
+{
+    struct FwUpdaterData *ctx = mbim_session(session);
+
+    if (!find_quectel_mbim_device(ctx, NULL)) {
         info_printf("Could not find a modem available for commands!\n");
         return EXIT_FAILURE;
     }
 
+    CLEAR_ALL_ACTION(ctx);
     SET_ACTION(ctx, REBOOT);
-    ctx->mainloop = g_main_loop_new(NULL, FALSE);
-    file = g_file_new_for_path(ctx->cdc_wdm);
-    mbim_device_new(g_file_new_for_path(ctx->cdc_wdm), NULL, (GAsyncReadyCallback)mbim_device_new_ready, ctx);
-    g_main_loop_run(ctx->mainloop);
-    g_main_loop_unref(ctx->mainloop);
+    mbim_session_run(ctx);
+    /* the modem drops off the bus */
+    g_clear_object(&ctx->mbim_device);
     return 0;
 }
 
 
-int mbim_prepare_to_flash(void)
+/* Send the switch-to-download command to the modem behind cdc_wdm */
+int mbim_switch_to_download(struct FwUpdaterData *session, const char *cdc_wdm)
 {
-    int i;
-    int flash_mode;
-    struct FwUpdaterData *ctx = &s_ctx;
-    g_autoptr(GFile) file = NULL;
+    struct FwUpdaterData *ctx = mbim_session(session);
 
-    i = MAX_MODE_CHECKS;
+    if (strcmp(cdc_wdm, ctx->cdc_wdm))
+    {
+        g_clear_object(&ctx->mbim_device);
+        snprintf(ctx->cdc_wdm, sizeof(ctx->cdc_wdm), "%s", cdc_wdm);
+    }
 
-    while (i--) {
-        flash_mode = flash_mode_check();
-        if (flash_mode == NORMAL_OPERATION) {
-            break;
-        }
-        if (flash_mode == -1 ) {
-            usleep(500000);
-            continue; 
-        }
-        
+    info_printf("Switching %s into flashing mode\n", ctx->cdc_wdm);
+    CLEAR_ALL_ACTION(ctx);
+    SET_ACTION(ctx, SWITCH_SBL);
+    mbim_session_run(ctx);
+    g_clear_object(&ctx->mbim_device);
+    /* the modem re-enumerates in download mode, a session bound to a port re-probes it */
+    if (!ctx->port[0])
+        s_host->usb_index_invalidate();
+
+    return 0;
+}
+
+
+int mbim_prepare_to_flash(struct FwUpdaterData *session)
+{
+    struct FwUpdaterData *ctx = mbim_session(session);
+    const char *port = ctx->port[0] ? ctx->port : NULL;
+    struct usb_index_device dev;
+
+    /* the modem may still be re-enumerating after a reboot */
+    if (s_host->usb_index_wait(port, USB_INDEX_ANY, NULL, MODE_SWITCH_TIMEOUT_MS, &dev) == 0
+        && dev.mode != NORMAL_OPERATION)
+    {
         info_printf("Already in download mode\n");
         return 0;
     }
 
-    if (!find_quectel_mbim_device(ctx))
+    if (!find_quectel_mbim_device(ctx, NULL))
     {
         info_printf("quectel mbim device not found\n");
         return -1;
     }
 
-    info_printf("Switching the device into flashing mode\n");
-    SET_ACTION(ctx, SWITCH_SBL);
-    ctx->mainloop = g_main_loop_new(NULL, FALSE);
-    file = g_file_new_for_path(ctx->cdc_wdm);
+    mbim_switch_to_download(ctx, ctx->cdc_wdm);
+
+    return s_host->usb_index_wait(port, USB_INDEX_DOWNLOAD, NULL, MODE_SWITCH_TIMEOUT_MS, NULL) ? -1 : 0;
+}
 
-    info_printf("Mbim initialization\n");
-    mbim_device_new(g_file_new_for_path(ctx->cdc_wdm), NULL, (GAsyncReadyCallback)mbim_device_new_ready, ctx);
-    info_printf("Mbim initialization main loop\n");
-    g_main_loop_run(ctx->mainloop);
-    g_main_loop_unref(ctx->mainloop);
 
-    i = MAX_MODE_CHECKS;
-    //for (i = 0; i < 10; i++) // wait 5s
-    while (i--) {
-        usleep(500000); // 0.5S
+/*
+ * Block until the modem is back after a reset or flash and answers
+ * GET_FW_INFO, filling in when each stage was reached. stale_node is the
+ * usbfs node the modem had before, if it may not have dropped off the bus
+ * yet. Returns 0, or -ETIMEDOUT with the stages reached so far.
+ */
+int mbim_wait_ready(struct FwUpdaterData *session, const char *stale_node, unsigned timeout_ms,
+                    struct mbim_ready_times *times)
+{
+    struct FwUpdaterData *ctx = mbim_session(session);
+    struct usb_index_device dev;
+    guint64 start = s_host->time_usec();
+    guint64 deadline = start + (guint64)timeout_ms * 1000;
+
+    memset(times, 0, sizeof(*times));
+
+    if (s_host->usb_index_wait(ctx->port[0] ? ctx->port : NULL, USB_INDEX_MODE(NORMAL_OPERATION), stale_node, timeout_ms, &dev))
+        return -ETIMEDOUT;
+    times->usb_usec = s_host->time_usec() - start;
+    info_printf("modem is back at %s\n", dev.dev_node);
+
+    /* udev may still be setting up the node's permissions */
+    while (access(dev.cdc_wdm, R_OK | W_OK))
+    {
+        if (s_host->time_usec() >= deadline)
+            return -ETIMEDOUT;
+        usleep(READY_RETRY_MS * 1000);
+    }
+    times->cdc_wdm_usec = s_host->time_usec() - start;
+    g_clear_object(&ctx->mbim_device);
+    snprintf(ctx->cdc_wdm, sizeof(ctx->cdc_wdm), "%s", dev.cdc_wdm);
 
-        if (flash_mode_check() != NORMAL_OPERATION)
+    /* the firmware takes a while after enumeration before it serves MBIM */
+    while (s_host->time_usec() < deadline)
+    {
+        CLEAR_ALL_ACTION(ctx);
+        SET_ACTION(ctx, GET_FW_INFO);
+        ctx->firmware_info_len = 0;
+        ctx->open_usec = 0;
+        mbim_session_run(ctx);
+        if (!ctx->keep_device)
+            g_clear_object(&ctx->mbim_device);
+
+        if (ctx->open_usec && !times->mbim_open_usec)
+            times->mbim_open_usec = ctx->open_usec - start;
+        if (ctx->firmware_info_len)
         {
+            times->fw_info_usec = s_host->time_usec() - start;
+            info_printf("modem ready: %s\n", ctx->firmware_info);
             return 0;
         }
+        usleep(READY_RETRY_MS * 1000);
+    }
+
+    return -ETIMEDOUT;
+}
+
+
+/* Send one AT command to the modem and print its answer */
+int mbim_exec_at(struct FwUpdaterData *session, const char *command)
+{
+    struct FwUpdaterData *ctx = mbim_session(session);
+
+    /* the command goes after a 4 byte header into a 128 byte request */
+    if (strlen(command) > sizeof(ctx->at_command) - 4)
+    {
+        info_printf("AT command too long: %s\n", command);
+        return -1;
+    }
+    if (!find_quectel_mbim_device(ctx, NULL))
+    {
+        info_printf("quectel mbim device not found\n");
+        return -1;
     }
 
-    return -1;
+    snprintf(ctx->at_command, sizeof(ctx->at_command), "%s", command);
+    ctx->at_command_len = strlen(ctx->at_command);
+    ctx->result_code = -1;
+    SET_ACTION(ctx, EXEC_AT);
+    mbim_session_run(ctx);
+
+    return ctx->result_code;
+}
+
+
+/* Drop the MbimDevice kept open, e.g. after a hotplug event */
+void mbim_release_device(struct FwUpdaterData *session)
+{
+    g_clear_object(&mbim_session(session)->mbim_device);
 }
 
 
-int mbim_get_version(char main_version[128],
+int mbim_get_version(struct FwUpdaterData *session,
+                     char main_version[128],
                      char carrier_uuid[128],
                      char carrier_version[128],
                      char oem_version[128])
 {
-    struct FwUpdaterData *ctx = &s_ctx;
-    g_autoptr(GFile) file = NULL;
+    struct FwUpdaterData *ctx = mbim_session(session);
+    struct usb_index_device dev;
+    struct fw_cache_entry entry;
 
     char *p;
     int m1, m2, o1, o2, c1, c2;
 
-    if (!find_quectel_mbim_device(ctx))
+    if (!find_quectel_mbim_device(ctx, &dev))
     {
         info_printf("quectel mbim device not found\n");
         return -1;
     }
 
+    if (s_host->fw_cache_load(&dev, &entry) == 0)
+    {
+        strcpy(main_version, entry.main_version);
+        strcpy(carrier_uuid, entry.carrier_uuid);
+        strcpy(carrier_version, entry.carrier_version);
+        strcpy(oem_version, entry.oem_version);
+        info_printf("firmware info of %s from cache\n", dev.port);
+        return 0;
+    }
+
     info_printf("Mbim device found!\n");
 
     strcpy(carrier_uuid, "generic");
@@ -706,17 +782,12 @@ int mbim_get_version(char main_version[128],
     oem_version[0] = 0;
     carrier_version[0] = 0;
 
+    /* the daemon queries again and again, don't report a previous answer */
+    ctx->firmware_info[0] = 0;
+    ctx->carrier_uuid_len = 0;
     SET_ACTION(ctx, GET_FW_INFO);
 
-    ctx->mainloop = g_main_loop_new(NULL, FALSE);
-
-    file = g_file_new_for_path(ctx->cdc_wdm);
-
-    info_printf(" %s %d mbim device initialization!\n",__FILE__,__LINE__);
-    mbim_device_new(file, NULL, (GAsyncReadyCallback)mbim_device_new_ready, ctx);
-
-    g_main_loop_run(ctx->mainloop);
-    g_main_loop_unref(ctx->mainloop);
+    mbim_session_run(ctx);
 
 
     if ( (g_strrstr(ctx->firmware_info, "EM060KGL") == NULL ) && (g_strrstr(ctx->firmware_info, "LCUK54WWDBL0102") == NULL ) )
@@ -750,5 +821,34 @@ int mbim_get_version(char main_version[128],
     info_printf("[debug]oem_version:%s\n", oem_version);
     info_printf("[debug]carrier_uuid:%s\n", carrier_uuid);
 
+    memset(&entry, 0, sizeof(entry));
+    snprintf(entry.main_version, sizeof(entry.main_version), "%s", main_version);
+    snprintf(entry.carrier_uuid, sizeof(entry.carrier_uuid), "%s", carrier_uuid);
+    snprintf(entry.carrier_version, sizeof(entry.carrier_version), "%s", carrier_version);
+    snprintf(entry.oem_version, sizeof(entry.oem_version), "%s", oem_version);
+    if (s_host->fw_cache_save(&dev, &entry))
+        info_printf("can not cache the firmware info in %s\n", FW_CACHE_DIR);
+
     return 0;
 }
+
+
+static const struct mbim_ops s_mbim_ops = {
+    .session_new = mbim_session_new,
+    .session_free = mbim_session_free,
+    .prepare_to_flash = mbim_prepare_to_flash,
+    .switch_to_download = mbim_switch_to_download,
+    .reboot_modem = mbim_reboot_modem,
+    .get_version = mbim_get_version,
+    .wait_ready = mbim_wait_ready,
+    .exec_at = mbim_exec_at,
+    .release_device = mbim_release_device,
+};
+
+/* The entry point looked up by mbim_load() */
+__attribute__((visibility("default")))
+const struct mbim_ops *qmodemhelper_mbim_init(const struct mbim_host_ops *host)
+{
+    s_host = host;
+    return &s_mbim_ops;
+}
@@ -28,8 +28,8 @@
 #include <libmm-glib.h>
 #include <libmbim-glib.h>
 #include <syslog.h>
+#include "ql-mbim.h"
 
-#define MAX_MODE_CHECKS 10
 #define MBIM_NP_VID 0x3731
 
 
@@ -112,11 +112,25 @@ struct FwUpdaterData
 
     int result_code;
     int result_code_set;
+
+    guint64 open_usec; /* when the last MBIM open succeeded, 0 if it failed */
+
+    char port[32];              /* sysfs port of the modem, empty: the first one found */
+    int keep_device;            /* keep the MbimDevice open between runs */
+    GMainContext *main_context; /* where the device's callbacks run, NULL: the global default */
 };
 
-int mbim_reboot_modem(void);
-int mbim_prepare_to_flash(void);
-int mbim_get_version(char main_version[128],
+struct FwUpdaterData *mbim_session_new(const char *port);
+void mbim_session_free(struct FwUpdaterData *ctx);
+int mbim_reboot_modem(struct FwUpdaterData *session);
+int mbim_prepare_to_flash(struct FwUpdaterData *session);
+int mbim_switch_to_download(struct FwUpdaterData *session, const char *cdc_wdm);
+int mbim_exec_at(struct FwUpdaterData *session, const char *command);
+void mbim_release_device(struct FwUpdaterData *session);
+int mbim_wait_ready(struct FwUpdaterData *session, const char *stale_node, unsigned timeout_ms,
+		struct mbim_ready_times *times);
+int mbim_get_version(struct FwUpdaterData *session,
+		char main_version[128],
 		char carrier_uuid[128],
 		char carrier_version[128],
 		char oem_version[128]);
@@ -150,4 +164,6 @@ void mbim_quec_firmware_update_modem_reboot_set_ready(MbimDevice *dev,
 
 void mbim_exit(struct FwUpdaterData *ctx);
 
+extern const struct mbim_ops qmodemhelper_mbim_ops;
+
 #endif
@@ -0,0 +1,97 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-sahara-core.h"
+#include "ql-mbim.h"
+#include "ql-usb-index.h"
+#include "ql-fw-cache.h"
+#include <dlfcn.h>
+#include <pthread.h>
+
+int mbim_keep_device;
+
+static const struct mbim_ops *s_mbim_ops;
+static pthread_mutex_t s_mbim_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct mbim_host_ops s_mbim_host = {
+    .keep_device = &mbim_keep_device,
+    .time_usec = qdl_time_usec,
+    .usb_index_probe = usb_index_probe,
+    .usb_index_find_mbim = usb_index_find_mbim,
+    .usb_index_invalidate = usb_index_invalidate,
+    .usb_index_wait = usb_index_wait,
+    .fw_cache_load = fw_cache_load,
+    .fw_cache_save = fw_cache_save,
+};
+
+/*
+ * Load the MBIM module on first use and hand it the USB index and the
+ * other helpers it needs. The module is never unloaded: glib does not
+ * support it. Safe to call from any thread.
+ */
+const struct mbim_ops *mbim_load(void)
+{
+    char module_path[PATH_LENGTH];
+    const char *path = getenv(MBIM_MODULE_ENV);
+    const struct mbim_ops *ops;
+    mbim_init_fn init;
+    void *handle;
+
+    pthread_mutex_lock(&s_mbim_load_lock);
+    if (s_mbim_ops)
+        goto EXIT;
+
+    if (!path)
+    {
+        snprintf(module_path, sizeof(module_path), "%s/%s", MBIM_MODULE_DIR, MBIM_MODULE_NAME);
+        path = module_path;
+    }
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        const char *error = dlerror();
+
+        fprintf(stderr, "can't load the MBIM module: %s\n", error);
+        syslog(LOG_ERR, "can't load the MBIM module: %s", error);
+        goto EXIT;
+    }
+
+    init = (mbim_init_fn)dlsym(handle, MBIM_INIT_SYMBOL);
+    if (!init)
+    {
+        fprintf(stderr, "%s: no %s\n", path, MBIM_INIT_SYMBOL);
+        dlclose(handle);
+        goto EXIT;
+    }
+    s_mbim_ops = init(&s_mbim_host);
+
+EXIT:
+    ops = s_mbim_ops;
+    pthread_mutex_unlock(&s_mbim_load_lock);
+    return ops;
+}
+
+/* The module if something already loaded it, NULL otherwise */
+const struct mbim_ops *mbim_loaded(void)
+{
+    const struct mbim_ops *ops;
+
+    pthread_mutex_lock(&s_mbim_load_lock);
+    ops = s_mbim_ops;
+    pthread_mutex_unlock(&s_mbim_load_lock);
+    return ops;
+}
@@ -0,0 +1,103 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_MBIM_H_
+#define __QL_MBIM_H_
+#include <stdint.h>
+
+/*
+ * The MBIM layer (ql-mbim-core.c) pulls in glib, GIO, mbim-glib and
+ * mm-glib, so it is built as a module and only loaded by the commands
+ * that talk to the modem. This header is all the rest of the helper sees
+ * of it and must not include any glib header.
+ */
+
+#define MODE_SWITCH_TIMEOUT_MS 5000
+#define MODEM_REBOOT_TIMEOUT_MS 30000
+#define READY_DEFAULT_TIMEOUT_MS 120000
+#define READY_RETRY_MS 200
+
+#ifndef MBIM_MODULE_DIR
+#define MBIM_MODULE_DIR "/usr/lib/qmodemhelper"
+#endif
+#define MBIM_MODULE_NAME "qmodemhelper-mbim.so"
+#define MBIM_MODULE_ENV "QMODEMHELPER_MBIM_MODULE" /* overrides the module path */
+#define MBIM_INIT_SYMBOL "qmodemhelper_mbim_init"
+
+/* When each readiness stage was reached, in usec since the wait started; 0 if not reached */
+struct mbim_ready_times
+{
+    uint64_t usb_usec;      /* back on the bus in normal mode, MBIM function bound */
+    uint64_t cdc_wdm_usec;  /* control node accessible */
+    uint64_t mbim_open_usec;
+    uint64_t fw_info_usec;  /* GET_FW_INFO answered */
+};
+
+/*
+ * One MBIM conversation with one modem. Every operation takes the session
+ * to use; NULL is the module's default session, which talks to the first
+ * modem found and follows mbim_keep_device. Sessions of their own can be
+ * used from different threads at the same time.
+ */
+struct FwUpdaterData;
+
+struct mbim_ops
+{
+    struct FwUpdaterData *(*session_new)(const char *port);
+    void (*session_free)(struct FwUpdaterData *session);
+    int (*prepare_to_flash)(struct FwUpdaterData *session);
+    int (*switch_to_download)(struct FwUpdaterData *session, const char *cdc_wdm);
+    int (*reboot_modem)(struct FwUpdaterData *session);
+    int (*get_version)(struct FwUpdaterData *session,
+                       char main_version[128],
+                       char carrier_uuid[128],
+                       char carrier_version[128],
+                       char oem_version[128]);
+    int (*wait_ready)(struct FwUpdaterData *session, const char *stale_node, unsigned timeout_ms,
+                      struct mbim_ready_times *times);
+    int (*exec_at)(struct FwUpdaterData *session, const char *command);
+    void (*release_device)(struct FwUpdaterData *session);
+};
+
+struct usb_index_device;
+struct fw_cache_entry;
+
+/*
+ * What the module uses of the helper, handed to it once loaded. The helper
+ * exports nothing but the qmh_* API, so the module can't look these up.
+ */
+struct mbim_host_ops
+{
+    const int *keep_device; /* mbim_keep_device */
+    uint64_t (*time_usec)(void);
+    int (*usb_index_probe)(const char *port, struct usb_index_device *dev);
+    const struct usb_index_device *(*usb_index_find_mbim)(void);
+    void (*usb_index_invalidate)(void);
+    int (*usb_index_wait)(const char *port, int mode_mask, const char *stale_node, unsigned timeout_ms,
+                          struct usb_index_device *dev);
+    int (*fw_cache_load)(const struct usb_index_device *dev, struct fw_cache_entry *entry);
+    int (*fw_cache_save)(const struct usb_index_device *dev, struct fw_cache_entry *entry);
+};
+
+/* The module's only exported symbol, MBIM_INIT_SYMBOL */
+typedef const struct mbim_ops *(*mbim_init_fn)(const struct mbim_host_ops *host);
+
+/* Owned by the helper, read by the module: keep the MbimDevice open between queries */
+extern int mbim_keep_device;
+
+const struct mbim_ops *mbim_load(void);
+const struct mbim_ops *mbim_loaded(void);
+
+#endif
@@ -14,10 +14,17 @@
     limitations under the License.
 */
 
-#include "ql-mbim-core.h"
+#include "ql-mbim.h"
 #include "ql-sahara-core.h"
 #include "ql-gpio.h"
 #include "ql-qdl-sahara.h"
+#include "ql-qdl-firehose.h"
+#include "ql-fleet.h"
+#include "ql-daemon.h"
+#include "ql-fw-cache.h"
+#include "ql-image-verify.h"
+#include "ql-prefetch.h"
+#include "ql-bundle.h"
 #include <errno.h>
 #include <stdint.h>
 #include <linux/usbdevice_fs.h>
@@ -30,7 +37,6 @@
 #include <err.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <libudev.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -56,11 +62,26 @@ const char kReboot[] = "reboot";
 const char kClearAttachAPN[] = "clear_attach_apn";
 const char kFwVersion[] = "fw_version";
 const char kHeartbeatConfig[] = "get_heartbeat_config";
+const char kPacketTransfer[] = "packet_xfer";
+const char kSkipUnchanged[] = "skip_unchanged";
+const char kMaxPayload[] = "max_payload";
+const char kFlashFleet[] = "flash_fleet";
+const char kFleetPerHub[] = "fleet_per_hub";
+const char kGpioPulse[] = "gpio_pulse_us";
+const char kWaitReady[] = "wait_ready";
+const char kDaemon[] = "daemon";
+const char kDaemonSocket[] = "daemon_socket";
+const char kExecAt[] = "exec_at";
+const char kSkipInstalled[] = "skip_installed";
+const char kVerifyImages[] = "verify_images";
+const char kPrefetchLock[] = "prefetch_lock";
+const char kMakeBundle[] = "make_bundle";
 
 // Keys used for the kFlashFirmware/kFwVersion/kGetFirmwareInfo switches
 const char kFwMain[] = "main";
 const char kFwCarrier[] = "carrier";
 const char kFwOem[] = "oem";
+const char kFwBundle[] = "bundle";
 const char kFwAp[] = "ap";
 const char kFwDev[] = "dev";
 const char kFwCarrierUuid[] = "carrier_uuid";
@@ -71,6 +92,16 @@ const char kHeartbeatMaxFailures[] = "max_failures";
 const char kHeartbeatInterval[] = "interval";
 const char kHeartbeatModemIdleInterval[] = "modem_idle_interval";
 
+// 0: return as soon as the command is done, otherwise how long to wait for the modem
+static unsigned wait_ready_ms;
+static const char *daemon_socket = DAEMON_DEFAULT_SOCKET;
+// leave out the components of --flash_fw the modem already runs
+static int skip_installed;
+// check the CRCs of the --flash_fw images while the modem switches to download mode
+static int verify_images;
+// pack the --flash_fw images into this bundle instead of flashing them
+static const char *make_bundle;
+
 static int print_help(int);
 static int parse_flash_fw_parameters(char *arg, char *main_fw, char *oem_fw, char *carrier_fw);
 static int power_lock( const char* path, const char* filename);
@@ -137,6 +168,25 @@ static int print_help(int argc)
 	  fprintf(stderr,"   --%s\n", kFlashModeCheck);
     fprintf(stderr,"   --%s\n", kHeartbeatConfig);
     fprintf(stderr,"   --%s\n", kReboot);
+    fprintf(stderr,"   --%s (before --%s: one ioctl per USB packet, for throughput comparison)\n", kPacketTransfer, kFlashFirmware);
+    fprintf(stderr,"   --%s (before --%s: EDL flashing skips images whose SHA-256 matches the target)\n", kSkipUnchanged, kFlashFirmware);
+    fprintf(stderr,"   --%s=<bytes> (before --%s: largest Firehose payload offered to the target)\n", kMaxPayload, kFlashFirmware);
+    fprintf(stderr,"   --%s (before --%s: leave out components whose version the modem already runs)\n", kSkipInstalled, kFlashFirmware);
+    fprintf(stderr,"   --%s (before --%s: check the image CRCs while the modem switches to download mode)\n", kVerifyImages, kFlashFirmware);
+    fprintf(stderr,"   --%s (before --%s: keep the prefetched images locked in memory until flashed)\n", kPrefetchLock, kFlashFirmware);
+    fprintf(stderr,"   --%s=<file> (before --%s: pack its images into one bundle instead of flashing them)\n", kMakeBundle, kFlashFirmware);
+    fprintf(stderr,"   (--%s also takes %s:<file>, the images of a bundle made with --%s)\n", kFlashFirmware, kFwBundle, kMakeBundle);
+    fprintf(stderr,"   --%s (same arguments as --%s, flashes every attached modem in parallel)\n", kFlashFleet, kFlashFirmware);
+    fprintf(stderr,"   --%s=<n> (before --%s: modems flashed at once per root hub, 0 for no limit)\n", kFleetPerHub, kFlashFleet);
+    fprintf(stderr,"   --%s=<usec> (with --%s: how long the reset line is held low)\n", kGpioPulse, kReboot);
+    fprintf(stderr,"   --%s[=<seconds>] (alone, or before --%s/--%s: block until the modem answers again)\n", kWaitReady, kFlashFirmware, kReboot);
+    fprintf(stderr,"   --%s=<command> (send an AT command through MBIM)\n", kExecAt);
+    fprintf(stderr,"   (--%s, --%s, --%s and --%s can be combined, they run in order over one MBIM session)\n",
+            kGetFirmwareInfo, kFlashModeCheck, kHeartbeatConfig, kExecAt);
+    fprintf(stderr,"   (once one of them is given, later --%s, --%s, --%s, --%s and --%s are ignored)\n",
+            kPrepareToFlash, kFlashFirmware, kFlashFleet, kReboot, kDaemon);
+    fprintf(stderr,"   --%s (answer --%s, --%s and --%s over a Unix socket)\n", kDaemon, kGetFirmwareInfo, kFlashModeCheck, kHeartbeatConfig);
+    fprintf(stderr,"   --%s=<path> (before --%s or the commands it answers, default %s)\n", kDaemonSocket, kDaemon, DAEMON_DEFAULT_SOCKET);
     fprintf(stderr,"   --help\n");
     return 0;
 }
@@ -197,34 +247,218 @@ static int parse_flash_fw_parameters(char *arg, char *main_fw, char *oem_fw, cha
 	    strcat(carrier_fw,"/carrier.bin");
             syslog(0, "%s : carrier section found: %s\n",__FUNCTION__, path);
         }
+
+        // a bundle stands in for the directory of each image it holds
+        if (strcmp(type, kFwBundle) == 0)
+        {
+            char *fw[3] = {main_fw, oem_fw, carrier_fw};
+            const char *names[3] = {BUNDLE_MAIN_FILE, BUNDLE_OEM_FILE, BUNDLE_CARRIER_FILE};
+            const struct bundle_entry *entry;
+            struct bundle *bundle;
+            unsigned i;
+
+            for (i = 0; i < 3; i++)
+            {
+                char bundle_path[MAX_FILE_NAME_LEN];
+
+                snprintf(bundle_path, sizeof(bundle_path), "%s/%s", path, names[i]);
+                if (!fw[i])
+                    continue;
+                if (bundle_resolve(bundle_path, &bundle, &entry) > 0)
+                    strcpy(fw[i], bundle_path);
+                bundle_put(bundle);
+            }
+            syslog(0, "%s : bundle found: %s\n",__FUNCTION__, path);
+        }
     }
     return 0;
 }
 
-void get_version()
+static int print_fw_info(FILE *out)
 {
+	const struct mbim_ops *mbim = mbim_load();
 	int ret;
 	char main_version[128] = {};
 	char carrier_uuid[128] = {};
 	char carrier_version[128] = {};
 	char oem_version[128] = {};
-	ret = mbim_get_version(main_version, carrier_uuid, carrier_version, oem_version);
+	if (!mbim)
+		return EXIT_FAILURE;
+	ret = mbim->get_version(NULL, main_version, carrier_uuid, carrier_version, oem_version);
 	if (ret == 0)
 	{
-		printf("%s:%s\n", kFwMain, main_version);
-		printf("%s:%s\n", kFwCarrierUuid, carrier_uuid);
-		printf("%s:%s\n", kFwCarrier, carrier_version);
+		fprintf(out, "%s:%s\n", kFwMain, main_version);
+		fprintf(out, "%s:%s\n", kFwCarrierUuid, carrier_uuid);
+		fprintf(out, "%s:%s\n", kFwCarrier, carrier_version);
 		if (strlen(oem_version)) {
-                        printf("%s:%s\n", kFwOem, oem_version);
+                        fprintf(out, "%s:%s\n", kFwOem, oem_version);
 		} else {
-			printf("%s:%s\n", kFwOem, kUnknownRevision);
+			fprintf(out, "%s:%s\n", kFwOem, kUnknownRevision);
 		}
 	}
-	closelog();
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int print_flash_mode(FILE *out)
+{
+	fprintf(out, "%s\n", flash_mode_check() != NORMAL_OPERATION ? "true" : "false");
+	return 0;
+}
+
+static int print_heartbeat_config(FILE *out)
+{
+	fprintf(out, "%s:3\n", kHeartbeatMaxFailures);
+	fprintf(out, "%s:20\n", kHeartbeatInterval);
+	fprintf(out, "%s:120\n", kHeartbeatModemIdleInterval);
+	return 0;
+}
+
+static const struct daemon_command daemon_commands[] = {
+	{kGetFirmwareInfo, print_fw_info, 1},
+	{kFlashModeCheck, print_flash_mode, 0},
+	{kHeartbeatConfig, print_heartbeat_config, 1},
+	{},
+};
+
+/* Answer a query through the daemon if one is running, else in this process */
+static int run_query(const char *name, int (*handler)(FILE *out))
+{
+	int ret = daemon_request(daemon_socket, name, stdout);
+
+	if (ret < 0)
+		ret = handler(stdout);
+	return ret;
+}
+
+// A query given on the command line, run in order once all options are parsed
+struct query_op
+{
+	int opt;
+	const char *arg;
+};
+
+static int run_queries(const struct query_op *ops, int count)
+{
+	int ret = 0;
+	int i;
+
+	// share the discovery and the MBIM session between the queries
+	mbim_keep_device = 1;
+	for (i = 0; i < count; i++) {
+		switch (ops[i].opt) {
+		case 'G':
+			if (run_query(kGetFirmwareInfo, print_fw_info))
+				ret = EXIT_FAILURE;
+			break;
+		case 'M':
+			run_query(kFlashModeCheck, print_flash_mode);
+			break;
+		case 'O':
+			// a constant, not worth a round trip to the daemon
+			print_heartbeat_config(stdout);
+			break;
+		case 'E':
+			if (!mbim_load() || mbim_load()->exec_at(NULL, ops[i].arg))
+				ret = EXIT_FAILURE;
+			break;
+		}
+		fflush(stdout);
+	}
+	if (mbim_loaded())
+		mbim_loaded()->release_device(NULL);
+
+	// a lone --get_fw_info always succeeded, keep it that way
+	if (count == 1 && ops[0].opt != 'E')
+		ret = 0;
+	return ret;
+}
+
+/* Usbfs node of the modem in normal mode, to tell it apart once it re-enumerates */
+static void ready_snapshot(char *node, size_t size)
+{
+	const struct usb_index_device *dev = usb_index_find(USB_INDEX_MODE(NORMAL_OPERATION));
+
+	snprintf(node, size, "%s", dev ? dev->dev_node : "");
+}
+
+static int wait_ready(const char *stale_node)
+{
+	const struct mbim_ops *mbim = mbim_load();
+	struct mbim_ready_times times;
+	int ret;
+
+	if (!mbim)
+		return EXIT_FAILURE;
+	ret = mbim->wait_ready(NULL, stale_node && stale_node[0] ? stale_node : NULL, wait_ready_ms, &times);
+	printf("ready:%s\n", ret ? "false" : "true");
+	if (times.usb_usec)
+		printf("usb_ms:%llu\n", (unsigned long long)times.usb_usec / 1000);
+	if (times.cdc_wdm_usec)
+		printf("cdc_wdm_ms:%llu\n", (unsigned long long)times.cdc_wdm_usec / 1000);
+	if (times.mbim_open_usec)
+		printf("mbim_open_ms:%llu\n", (unsigned long long)times.mbim_open_usec / 1000);
+	if (times.fw_info_usec)
+		printf("fw_info_ms:%llu\n", (unsigned long long)times.fw_info_usec / 1000);
+	syslog(0, "modem %s after %llu ms\n", ret ? "not ready" : "ready",
+	       (unsigned long long)(ret ? wait_ready_ms : times.fw_info_usec / 1000));
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Blank the path of every component whose image carries the version the
+ * modem already runs, so that sahara_flash_all() leaves it out. Anything
+ * that can't be compared is flashed. Returns how many components are left.
+ */
+static int drop_installed_components(char *main_fw, char *oem_fw, char *carrier_fw)
+{
+	const struct mbim_ops *mbim = mbim_load();
+	char main_version[128] = {};
+	char carrier_uuid[128] = {};
+	char carrier_version[128] = {};
+	char oem_version[128] = {};
+	struct {
+		const char *name;
+		char *path;
+		const char *installed;
+		int which; /* the version of the image header to compare */
+	} components[] = {
+		{kFwMain, main_fw, main_version, 0},
+		{kFwOem, oem_fw, oem_version, 1},
+		{kFwCarrier, carrier_fw, carrier_version, 2},
+	};
+	int left = 0;
+	unsigned i;
+
+	if (!mbim || mbim->get_version(NULL, main_version, carrier_uuid, carrier_version, oem_version))
+		main_version[0] = oem_version[0] = carrier_version[0] = 0;
+
+	for (i = 0; i < sizeof(components) / sizeof(components[0]); i++) {
+		char versions[3][16]; /* main, oem, carrier */
+		const char *image = versions[components[i].which];
+
+		if (!components[i].path[0])
+			continue;
+		if (!components[i].installed[0]
+		    || sahara_image_versions(components[i].path, versions[0], versions[1], versions[2])
+		    || strcmp(image, components[i].installed)) {
+			left++;
+			continue;
+		}
+		syslog(0, "%s %s is already installed, skipping %s\n",
+		       components[i].name, image, components[i].path);
+		printf("%s:%s already installed\n", components[i].name, image);
+		components[i].path[0] = 0;
+	}
+
+	return left;
 }
 
 int flash_firmware(char *arg)
 {
+	struct image_verify verify;
+	struct prefetch prefetch;
+	int switched;
 	int ret;
 	char oem_file_path[MAX_FILE_NAME_LEN];
 	char carrier_file_path[MAX_FILE_NAME_LEN];
@@ -238,27 +472,110 @@ int flash_firmware(char *arg)
                             oem_file_path,
                             carrier_file_path);
 
+	// only a modem in normal mode can tell what it runs
+	if (skip_installed && flash_mode_check() == NORMAL_OPERATION
+	    && drop_installed_components(main_file_path, oem_file_path, carrier_file_path) == 0) {
+		syslog(0, "every component is already installed, not switching to download mode\n");
+		closelog();
+		return 0;
+	}
+
+	// whatever the outcome, the cached versions are stale from here on
+	fw_cache_invalidate(NULL);
 
+	// warm up the images while the modem re-enumerates
+	prefetch_start(&prefetch, main_file_path, oem_file_path, carrier_file_path,
+	               flash_mode_check() == SWITCHED_TO_EDL);
+
+	ret = EXIT_FAILURE;
 	if (qdl_mode_check() == SWITCHED_TO_EDL) {
 	    // Modem is in qdl mode. sahara_flash_all will handle it.
 	    syslog(0, "The device is switched to EDL mode. \n");
-	    ret = qdl_flash_all(strdup(main_file_path), strdup(oem_file_path), strdup(carrier_file_path));
-    if (ret) {
-	      return EXIT_FAILURE;
+	    if (qdl_flash_all(strdup(main_file_path), strdup(oem_file_path), strdup(carrier_file_path))) {
+	      goto EXIT;
+	    }
+	    // modem is rebooting, wait until it is back in normal mode
+	    if (usb_index_wait(NULL, USB_INDEX_MODE(NORMAL_OPERATION), NULL, MODEM_REBOOT_TIMEOUT_MS, NULL)) {
+	      syslog(0, "The modem did not come back after the EDL flash\n");
+	      goto EXIT;
 	    }
 	  }
-	sleep(3); // modem is rebooting
-	if (mbim_prepare_to_flash()) {
-	    return EXIT_FAILURE;
+	if (verify_images) {
+		const char *files[3];
+		unsigned count = 0;
+
+		if (main_file_path[0])
+			files[count++] = main_file_path;
+		if (carrier_file_path[0])
+			files[count++] = carrier_file_path;
+		if (oem_file_path[0])
+			files[count++] = oem_file_path;
+		image_verify_start(&verify, files, count);
 	}
-	ret = sahara_flash_all(main_file_path, oem_file_path, carrier_file_path);
-	if (ret != 0)
-		return EXIT_FAILURE;
+	switched = mbim_load() && mbim_load()->prepare_to_flash(NULL) == 0;
+	if (verify_images && image_verify_finish(&verify)) {
+		syslog(0, "The firmware images are corrupt, not flashing\n");
+		printf("firmware images failed the CRC check\n");
+		goto EXIT;
+	}
+	if (!switched) {
+	    goto EXIT;
+	}
+	if (sahara_flash_all(main_file_path, oem_file_path, carrier_file_path) != 0)
+		goto EXIT;
+	prefetch_stop(&prefetch);
+	if (wait_ready_ms && wait_ready(NULL))
+		goto EXIT;
+	ret = 0;
+
+EXIT:
+	prefetch_stop(&prefetch);
 	closelog();
-	return 0;
+	return ret;
 }
 
-int main(int argc, char *argv[])
+// --make_bundle: the images of a --flash_fw argument into one file, no modem involved
+static int pack_bundle(char *arg)
+{
+	int ret;
+	char oem_file_path[MAX_FILE_NAME_LEN];
+	char carrier_file_path[MAX_FILE_NAME_LEN];
+	char main_file_path[MAX_FILE_NAME_LEN];
+	memset(oem_file_path , 0 , MAX_FILE_NAME_LEN);
+	memset(carrier_file_path , 0 , MAX_FILE_NAME_LEN);
+	memset(main_file_path , 0 , MAX_FILE_NAME_LEN);
+
+	parse_flash_fw_parameters(arg,
+                            main_file_path,
+                            oem_file_path,
+                            carrier_file_path);
+
+	ret = bundle_create(make_bundle, main_file_path, oem_file_path, carrier_file_path);
+	closelog();
+	return ret ? EXIT_FAILURE : 0;
+}
+
+int flash_fleet(char *arg)
+{
+	int ret;
+	char oem_file_path[MAX_FILE_NAME_LEN];
+	char carrier_file_path[MAX_FILE_NAME_LEN];
+	char main_file_path[MAX_FILE_NAME_LEN];
+	memset(oem_file_path , 0 , MAX_FILE_NAME_LEN);
+	memset(carrier_file_path , 0 , MAX_FILE_NAME_LEN);
+	memset(main_file_path , 0 , MAX_FILE_NAME_LEN);
+
+	parse_flash_fw_parameters(arg,
+                            main_file_path,
+                            oem_file_path,
+                            carrier_file_path);
+
+	ret = fleet_flash_all(main_file_path, oem_file_path, carrier_file_path);
+	closelog();
+	return ret;
+}
+
+static int run_options(int argc, char *argv[], struct query_op *queries)
 {
     struct option longopts[] = {
         {kGetFirmwareInfo, 0, NULL, 'G'},
@@ -268,6 +585,20 @@ int main(int argc, char *argv[])
 		    {kResetGpioLine, 2, NULL, 'N'},
         {kHeartbeatConfig, 0, NULL, 'O'},
         {kReboot, 0, NULL, 'R'},
+        {kPacketTransfer, 0, NULL, 'X'},
+        {kSkipUnchanged, 0, NULL, 'U'},
+        {kMaxPayload, 1, NULL, 'Y'},
+        {kFlashFleet, 1, NULL, 'F'},
+        {kFleetPerHub, 1, NULL, 'Z'},
+        {kGpioPulse, 1, NULL, 'W'},
+        {kWaitReady, 2, NULL, 'T'},
+        {kDaemon, 0, NULL, 'D'},
+        {kDaemonSocket, 1, NULL, 'S'},
+        {kExecAt, 1, NULL, 'E'},
+        {kSkipInstalled, 0, NULL, 'I'},
+        {kVerifyImages, 0, NULL, 'C'},
+        {kPrefetchLock, 0, NULL, 'L'},
+        {kMakeBundle, 1, NULL, 'B'},
         {"help", 0, NULL, 'H'},
         {},
     };
@@ -276,6 +607,8 @@ int main(int argc, char *argv[])
     int ret;
     int reset_flag = 0;
     char gpio_chip[MAX_FILE_NAME_LEN]; 
+    char stale_node[32];
+    int query_count = 0;
 
     openlog ("qmodemhelper", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
 
@@ -288,15 +621,27 @@ int main(int argc, char *argv[])
         switch (opt)
         {
             case 'G':
-				get_version();
-                return 0;
+            case 'M':
+            case 'O':
+            case 'E':
+                queries[query_count].opt = opt;
+                queries[query_count].arg = optarg;
+                query_count++;
+                break;
             case 'P':
-				if (mbim_prepare_to_flash()) {
+				// a query used to exit right away, what follows it never ran
+				if (query_count)
+					goto QUERIES;
+				if (!mbim_load() || mbim_load()->prepare_to_flash(NULL)) {
 		       		return EXIT_FAILURE;
 				}
                 syslog(0, "Swithing the modem into firmware download mode %d\n", ret);
 				return 0;
             case 'A':
+				if (query_count)
+					goto QUERIES;
+				if (make_bundle)
+					return pack_bundle(optarg);
 				if (power_lock(kPowerOverrideLockDirectoryPath, kPowerOverrideLockFileName) !=0) {
 					printf("Cannot aquire file lock\n");
 					return EXIT_FAILURE;
@@ -304,24 +649,65 @@ int main(int argc, char *argv[])
 				ret = flash_firmware(optarg);
 				power_unlock(kPowerOverrideLockDirectoryPath, kPowerOverrideLockFileName);
 				return ret;
+            case 'F':
+				if (query_count)
+					goto QUERIES;
+				if (power_lock(kPowerOverrideLockDirectoryPath, kPowerOverrideLockFileName) !=0) {
+					printf("Cannot aquire file lock\n");
+					return EXIT_FAILURE;
+				}
+				ret = flash_fleet(optarg);
+				power_unlock(kPowerOverrideLockDirectoryPath, kPowerOverrideLockFileName);
+				return ret;
+            case 'Z':
+                fleet_per_hub = strtoul(optarg, NULL, 0);
+                break;
+            case 'W':
+                gpio_pulse_usec = strtoul(optarg, NULL, 0);
+                if (gpio_pulse_usec < GPIO_MIN_PULSE_USEC || gpio_pulse_usec > GPIO_MAX_PULSE_USEC) {
+                    printf("--%s must be between %d and %d\n", kGpioPulse, GPIO_MIN_PULSE_USEC, GPIO_MAX_PULSE_USEC);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                wait_ready_ms = optarg ? strtoul(optarg, NULL, 0) * 1000 : READY_DEFAULT_TIMEOUT_MS;
+                break;
             case 'R':
 							  reset_flag = 1;
                 break;
-            case 'M':
-              if (flash_mode_check() != NORMAL_OPERATION) {
-                printf("true\n");
-              } else {
-                printf("false\n");
-              }
-              return 0;
+            case 'X':
+                qdl_xfer_mode = QDL_XFER_PACKET;
+                break;
+            case 'U':
+                fh_skip_unchanged = 1;
+                break;
+            case 'I':
+                skip_installed = 1;
+                break;
+            case 'C':
+                verify_images = 1;
+                break;
+            case 'L':
+                prefetch_lock = 1;
+                break;
+            case 'B':
+                make_bundle = optarg;
+                break;
+            case 'Y':
+                fh_max_payload = strtoul(optarg, NULL, 0);
+                break;
         case 'N':
           reset_line = parse_reboot_parameter(optarg, gpio_chip);
           break;
-        case 'O':
-          printf("%s:3\n", kHeartbeatMaxFailures);
-          printf("%s:20\n", kHeartbeatInterval);
-          printf("%s:120\n", kHeartbeatModemIdleInterval);
-          return 0;
+        case 'D':
+          if (query_count)
+            goto QUERIES;
+          ret = daemon_run(daemon_socket, daemon_commands);
+          closelog();
+          return ret;
+        case 'S':
+          daemon_socket = optarg;
+          break;
         case 'H':
           print_help(argc);
           return 0;
@@ -333,24 +719,52 @@ int main(int argc, char *argv[])
             }
         }
 
-		if ((reset_flag) && (reset_line)) {
+		if ((reset_flag) && (reset_line) && !query_count) {
       //ret = power_lock(kPowerOverrideLockDirectoryPath, kPowerOverrideLockFileName);
       ret = 0;
 			if (ret !=0) {
 				printf("Cannot aquire file lock\n");
 				return EXIT_FAILURE;
 			}
+			ready_snapshot(stale_node, sizeof(stale_node));
 			ret = gpio_reboot_modem(gpio_chip, reset_line);
 			if (ret) {
 				printf("Failed to reset line: %d\n", reset_line );
 			} else {
 				printf("Modem is rebooting\n");
+				if (wait_ready_ms)
+					return wait_ready(stale_node);
 			}
 			//ret = power_unlock(kPowerOverrideLockDirectoryPath,
       //                   kPowerOverrideLockFileName);
       ret = 0;
 			return ret;
     }
+QUERIES:
+    if (wait_ready_ms) {
+        ret = wait_ready(NULL);
+        if (ret || !query_count) {
+            closelog();
+            return ret;
+        }
+    }
+    if (query_count) {
+        ret = run_queries(queries, query_count);
+        closelog();
+        return ret;
+    }
     closelog();
     return EXIT_FAILURE;
 }
+
+int main(int argc, char *argv[])
+{
+    struct query_op *queries = calloc(argc, sizeof(struct query_op));
+    int ret;
+
+    if (!queries)
+        return EXIT_FAILURE;
+    ret = run_options(argc, argv, queries);
+    free(queries);
+    return ret;
+}
@@ -0,0 +1,223 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-prefetch.h"
+#include "ql-qdl-firehose.h"
+#include "ql-qdl-sahara.h"
+#include "ql-bundle.h"
+#include <libgen.h>
+
+/*
+ * Read the flash inputs into the page cache while the modem re-enumerates,
+ * so that the first READ_DATA is not served from cold storage. Files are
+ * read in the order the modem asks for them: the EDL programmer and the
+ * rawprogram files in XML order, then each single image header followed
+ * by its segments in image_layout sequence order. Files inside a bundle are
+ * read from the bundle, at their offset.
+ */
+
+int prefetch_lock;
+
+static void prefetch_range(struct prefetch *pf, int fd, uint64_t offset, uint64_t length)
+{
+    if (pf->stop || !length)
+        return;
+    /* readahead() only returns once the pages are queued, which is what the thread is for */
+    if (readahead(fd, offset, length))
+        posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+}
+
+static int prefetch_compare_segments(const void *a, const void *b)
+{
+    const struct image_layout *x = (const struct image_layout *)a;
+    const struct image_layout *y = (const struct image_layout *)b;
+    uint32_t sx = le_uint32(x->sequeue), sy = le_uint32(y->sequeue);
+
+    return sx < sy ? -1 : sx > sy;
+}
+
+/* A single image at base in fd */
+static void prefetch_segments(struct prefetch *pf, int fd, uint64_t base, uint64_t size)
+{
+    struct single_image_hdr hdr;
+    uint32_t i, image_num;
+
+    if (pread(fd, &hdr, sizeof(hdr), base) != (ssize_t)sizeof(hdr) || memcmp(hdr.magic, "Quec", sizeof(hdr.magic)))
+        return;
+    image_num = le_uint32(hdr.image_num);
+    if (image_num > sizeof(hdr.image_list) / sizeof(hdr.image_list[0]))
+        return;
+
+    qsort(hdr.image_list, image_num, sizeof(struct image_layout), prefetch_compare_segments);
+    for (i = 0; i < image_num; i++)
+    {
+        uint64_t offset = le_uint32(hdr.image_list[i].file_offset);
+        uint64_t length = le_uint32(hdr.image_list[i].file_len);
+
+        if (offset < size)
+            prefetch_range(pf, fd, base + offset, MIN(length, size - offset));
+    }
+}
+
+static void prefetch_image(struct prefetch *pf, int fd, uint64_t base, uint64_t size)
+{
+    if (size >= SINGLE_IMAGE_HDR_SIZE)
+    {
+        prefetch_range(pf, fd, base, SINGLE_IMAGE_HDR_SIZE);
+        prefetch_segments(pf, fd, base, size);
+    }
+    /* whatever the segments left out, already cached pages cost nothing */
+    prefetch_range(pf, fd, base, size);
+    pf->bytes += size;
+}
+
+static void prefetch_file(struct prefetch *pf, const char *path)
+{
+    const struct bundle_entry *entry;
+    struct bundle *bundle;
+    struct stat st;
+    int fd;
+
+    if (pf->stop || !path[0])
+        return;
+    /* read ahead only, prefetch_lock does not extend to bundles */
+    if (bundle_resolve(path, &bundle, &entry) > 0)
+    {
+        prefetch_image(pf, bundle->fd, bundle_entry_offset(entry), bundle_entry_length(entry));
+        bundle_put(bundle);
+        return;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return;
+    }
+
+    prefetch_image(pf, fd, 0, st.st_size);
+
+    if (pf->lock && st.st_size && pf->map_count < PREFETCH_MAX_LOCKED)
+    {
+        void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (base != MAP_FAILED && mlock(base, st.st_size) == 0)
+        {
+            pf->maps[pf->map_count].base = base;
+            pf->maps[pf->map_count].size = st.st_size;
+            pf->map_count++;
+        }
+        else if (base != MAP_FAILED)
+        {
+            syslog(0, "can't lock %s in memory: %s\n", path, strerror(errno));
+            munmap(base, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+struct prefetch_firehose_dir
+{
+    struct prefetch *pf;
+    const char *dir;
+};
+
+static int prefetch_program_file(void *user, const char *name)
+{
+    struct prefetch_firehose_dir *walk = (struct prefetch_firehose_dir *)user;
+    char path[PATH_LENGTH + 256];
+
+    snprintf(path, sizeof(path), "%s/%s", walk->dir, name);
+    prefetch_file(walk->pf, path);
+    return walk->pf->stop;
+}
+
+/* The programmer, the rawprogram XML and every file it programs, in XML order */
+static void prefetch_firehose(struct prefetch *pf)
+{
+    struct prefetch_firehose_dir walk;
+    char dir[PATH_LENGTH];
+    char path[PATH_LENGTH + 256];
+
+    snprintf(dir, sizeof(dir), "%s", pf->oem_file_path);
+    walk.pf = pf;
+    walk.dir = dirname(dir);
+
+    snprintf(path, sizeof(path), "%s/%s", walk.dir, QDL_PROGRAMMER_FILE);
+    prefetch_file(pf, path);
+    snprintf(path, sizeof(path), "%s/%s", walk.dir, RAW_PROGRAM_FILE);
+    prefetch_file(pf, path);
+    fh_xml_program_files(path, prefetch_program_file, &walk);
+}
+
+static void *prefetch_thread(void *arg)
+{
+    struct prefetch *pf = (struct prefetch *)arg;
+    uint64_t start = qdl_time_usec();
+
+    if (pf->firehose && pf->oem_file_path[0])
+        prefetch_firehose(pf);
+    /* the order of files[] in sahara_flash_target() */
+    prefetch_file(pf, pf->main_file_path);
+    prefetch_file(pf, pf->carrier_file_path);
+    prefetch_file(pf, pf->oem_file_path);
+
+    syslog(0, "prefetched %llu KB in %llu ms\n", (unsigned long long)(pf->bytes / 1024),
+           (unsigned long long)((qdl_time_usec() - start) / 1000));
+    return NULL;
+}
+
+/*
+ * Start prefetching a flash session's images. firehose adds what an EDL
+ * recovery reads. prefetch_stop() must be called once flashing is over, it
+ * also releases the memory locked with prefetch_lock.
+ */
+int prefetch_start(struct prefetch *pf, const char *main_file_path, const char *oem_file_path,
+                   const char *carrier_file_path, int firehose)
+{
+    int ret;
+
+    memset(pf, 0, sizeof(struct prefetch));
+    snprintf(pf->main_file_path, sizeof(pf->main_file_path), "%s", main_file_path);
+    snprintf(pf->oem_file_path, sizeof(pf->oem_file_path), "%s", oem_file_path);
+    snprintf(pf->carrier_file_path, sizeof(pf->carrier_file_path), "%s", carrier_file_path);
+    pf->firehose = firehose;
+    pf->lock = prefetch_lock;
+
+    ret = pthread_create(&pf->thread, NULL, prefetch_thread, pf);
+    if (ret)
+        return -ret;
+    pf->running = 1;
+    return 0;
+}
+
+void prefetch_stop(struct prefetch *pf)
+{
+    unsigned i;
+
+    pf->stop = 1;
+    if (pf->running)
+        pthread_join(pf->thread, NULL);
+    pf->running = 0;
+
+    for (i = 0; i < pf->map_count; i++)
+    {
+        munlock(pf->maps[i].base, pf->maps[i].size);
+        munmap(pf->maps[i].base, pf->maps[i].size);
+    }
+    pf->map_count = 0;
+}
@@ -0,0 +1,52 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_PREFETCH_H_
+#define __QL_PREFETCH_H_
+#include "ql-sahara-core.h"
+#include <pthread.h>
+
+#define PREFETCH_MAX_LOCKED 64
+
+/* A file kept mapped and locked in memory until prefetch_stop() */
+struct prefetch_map
+{
+    void *base;
+    size_t size;
+};
+
+/* Warms the page cache with a flash session's inputs from a background thread */
+struct prefetch
+{
+    char main_file_path[PATH_LENGTH];
+    char carrier_file_path[PATH_LENGTH];
+    char oem_file_path[PATH_LENGTH];
+    int firehose; /* also the programmer and rawprogram files of an EDL recovery */
+    int lock;     /* mlock() everything read */
+    struct prefetch_map maps[PREFETCH_MAX_LOCKED];
+    unsigned map_count;
+    uint64_t bytes;
+    volatile int stop;
+    pthread_t thread;
+    int running;
+};
+
+extern int prefetch_lock;
+
+int prefetch_start(struct prefetch *pf, const char *main_file_path, const char *oem_file_path,
+                   const char *carrier_file_path, int firehose);
+void prefetch_stop(struct prefetch *pf);
+
+#endif
@@ -16,10 +16,17 @@
 
 #include "ql-sahara-core.h"
 #include "ql-qdl-firehose.h"
+#include "ql-zimage.h"
+#include "ql-bundle.h"
 
 
 char *q_device_type = "nand";
-SparseImgParam SparseImgData;
+int fh_skip_unchanged;
+unsigned fh_max_payload = FH_MAX_PAYLOAD_TO_TARGET;
+
+#ifndef USBDEVFS_URB_ZERO_PACKET
+#define USBDEVFS_URB_ZERO_PACKET    0x40
+#endif
 
 static int usbfs_bulk_write(struct qdl_device *qdl, const void *data, int len, int timeout_msec, int need_zlp) {
     struct usbdevfs_urb bulk;
@@ -37,9 +44,6 @@ static int usbfs_bulk_write(struct qdl_device *qdl, const void *data, int len, i
 
     if (need_zlp && (len%qdl->out_maxpktsize) == 0) {
         //dbg_time("USBDEVFS_URB_ZERO_PACKET\n");
-#ifndef USBDEVFS_URB_ZERO_PACKET
-#define USBDEVFS_URB_ZERO_PACKET    0x40
-#endif
       urb->flags = USBDEVFS_URB_ZERO_PACKET;
     } else {
         urb->flags = 0;
@@ -73,18 +77,258 @@ static int usbfs_bulk_write(struct qdl_device *qdl, const void *data, int len, i
 
 
 
+/*
+ * Pipelined bulk writer: keeps up to pipe->depth URBs queued on the OUT
+ * endpoint so the host controller always has the next payload ready, while
+ * a reader thread refills the buffers that have already completed.
+ */
+static void fh_urb_pipe_free(struct fh_urb_pipe *pipe);
+
+static int fh_urb_pipe_init(struct fh_urb_pipe *pipe, struct qdl_device *qdl, unsigned depth, size_t buf_size)
+{
+  unsigned i;
+
+  memset(pipe, 0, sizeof(struct fh_urb_pipe));
+  if (depth == 0)
+    depth = 1;
+  if (depth > FH_MAX_URB_QUEUE_DEPTH)
+    depth = FH_MAX_URB_QUEUE_DEPTH;
+  /* large payloads must not exhaust the usbfs memory limit */
+  if (depth > 1 && depth * buf_size > FH_URB_MEMORY_BUDGET)
+    depth = MAX(FH_URB_MEMORY_BUDGET / buf_size, 1);
+
+  pipe->qdl = qdl;
+  pipe->depth = depth;
+  pipe->buf_size = buf_size;
+  pthread_mutex_init(&pipe->lock, NULL);
+  pthread_cond_init(&pipe->cond, NULL);
+
+  pipe->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pipe->event_fd < 0) {
+    fh_urb_pipe_free(pipe);
+    return -1;
+  }
+
+  for (i = 0; i < depth; i++) {
+    if (posix_memalign(&pipe->slots[i].buf, sysconf(_SC_PAGESIZE), buf_size)) {
+      pipe->slots[i].buf = NULL;
+      fh_urb_pipe_free(pipe);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void fh_urb_pipe_notify(struct fh_urb_pipe *pipe)
+{
+  uint64_t one = 1;
+
+  if (write(pipe->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    printf("%s: eventfd errno = %d (%s)\n", __func__, errno, strerror(errno));
+}
+
+/* Reap one completed URB and give its buffer back to the reader thread */
+static int fh_urb_pipe_reap(struct fh_urb_pipe *pipe, int nonblock)
+{
+  struct usbdevfs_urb *urb = NULL;
+  struct fh_urb_slot *slot;
+  int n;
+
+  do {
+    n = ioctl(pipe->qdl->fd, nonblock ? USBDEVFS_REAPURBNDELAY : USBDEVFS_REAPURB, &urb);
+  } while ((n < 0) && (errno == EINTR));
+
+  if (n != 0 || !urb) {
+    if (nonblock && errno == EAGAIN)
+      return 1;
+    printf("%s: USBDEVFS_REAPURB errno = %d (%s)\n", __func__, errno, strerror(errno));
+    pipe->error = -1;
+    return -1;
+  }
+
+  slot = (struct fh_urb_slot *)urb->usercontext;
+
+  pthread_mutex_lock(&pipe->lock);
+  slot->state = FH_SLOT_FREE;
+  pipe->in_flight--;
+  pthread_cond_broadcast(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+
+  if (urb->status != 0 || urb->actual_length != urb->buffer_length) {
+    printf("%s: urb status = %d, actual = %d/%d\n", __func__, urb->status, urb->actual_length, urb->buffer_length);
+    pipe->error = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int fh_urb_pipe_submit(struct fh_urb_pipe *pipe, struct fh_urb_slot *slot, size_t len, int need_zlp)
+{
+  struct usbdevfs_urb *urb = &slot->urb;
+  int n;
+
+  memset(urb, 0, sizeof(struct usbdevfs_urb));
+  urb->type = USBDEVFS_URB_TYPE_BULK;
+  urb->endpoint = pipe->qdl->out_ep;
+  urb->status = -1;
+  urb->buffer = slot->buf;
+  urb->buffer_length = len;
+  urb->usercontext = slot;
+  if (need_zlp && (len % pipe->qdl->out_maxpktsize) == 0)
+    urb->flags = USBDEVFS_URB_ZERO_PACKET;
+
+  pthread_mutex_lock(&pipe->lock);
+  slot->state = FH_SLOT_IN_FLIGHT;
+  pipe->in_flight++;
+  pthread_mutex_unlock(&pipe->lock);
+
+  do {
+    n = ioctl(pipe->qdl->fd, USBDEVFS_SUBMITURB, urb);
+  } while ((n < 0) && (errno == EINTR));
+
+  if (n != 0) {
+    printf(" USBDEVFS_SUBMITURB %d/%d, errno = %d (%s)\n", n, urb->buffer_length, errno, strerror(errno));
+    pthread_mutex_lock(&pipe->lock);
+    slot->state = FH_SLOT_FREE;
+    pipe->in_flight--;
+    pthread_mutex_unlock(&pipe->lock);
+    pipe->error = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void fh_urb_pipe_stop_reader(struct fh_urb_pipe *pipe)
+{
+  pthread_mutex_lock(&pipe->lock);
+  pipe->abort = 1;
+  pthread_cond_broadcast(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+/*
+ * Reader thread: fills the ring in order, pads the tail of the image to a
+ * whole sector in place and wakes the USB thread through the eventfd.
+ */
+static void *fh_urb_pipe_reader(void *arg)
+{
+  struct fh_urb_pipe *pipe = (struct fh_urb_pipe *)arg;
+  struct fh_raw_source *src = pipe->src;
+  uint32_t sector_size = pipe->sector_size;
+  size_t produced = 0;
+  unsigned r = 0;
+
+  while (produced < src->size) {
+    struct fh_urb_slot *slot = &pipe->slots[r];
+    size_t reads;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (slot->state != FH_SLOT_FREE && !pipe->abort)
+      pthread_cond_wait(&pipe->cond, &pipe->lock);
+    if (pipe->abort) {
+      pthread_mutex_unlock(&pipe->lock);
+      break;
+    }
+    slot->state = FH_SLOT_FILLING;
+    pthread_mutex_unlock(&pipe->lock);
+
+    reads = src->read(src, slot->buf, MIN(src->size - produced, pipe->buf_size));
+    if (reads == 0) {
+      printf("%s: short read at %zu/%zu\n", __func__, produced, src->size);
+      pthread_mutex_lock(&pipe->lock);
+      slot->state = FH_SLOT_FREE;
+      pipe->reader_error = -1;
+      pthread_mutex_unlock(&pipe->lock);
+      break;
+    }
+    produced += reads;
+    if (reads % sector_size) {
+      memset((uint8_t *)slot->buf + reads, 0, sector_size - (reads % sector_size));
+      reads +=  sector_size - (reads % sector_size);
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    slot->len = reads;
+    slot->state = FH_SLOT_FILLED;
+    pipe->filled++;
+    pthread_mutex_unlock(&pipe->lock);
+    fh_urb_pipe_notify(pipe);
+
+    r = (r + 1) % pipe->depth;
+  }
+
+  pthread_mutex_lock(&pipe->lock);
+  pipe->reader_done = 1;
+  pthread_mutex_unlock(&pipe->lock);
+  fh_urb_pipe_notify(pipe);
+
+  return NULL;
+}
+
+static int fh_urb_pipe_drain(struct fh_urb_pipe *pipe, unsigned timeout)
+{
+  struct pollfd pfd;
+  int n;
+
+  while (pipe->in_flight) {
+    pfd.fd = pipe->qdl->fd;
+    pfd.events = POLLOUT;
+    do {
+      n = poll(&pfd, 1, timeout ? (int)timeout : -1);
+    } while ((n < 0) && (errno == EINTR));
+    if (n <= 0 || fh_urb_pipe_reap(pipe, 1) < 0)
+      break;
+  }
+
+  return pipe->error || pipe->in_flight ? -1 : 0;
+}
+
+static void fh_urb_pipe_free(struct fh_urb_pipe *pipe)
+{
+  unsigned i;
+
+  for (i = 0; i < pipe->depth; i++) {
+    if (pipe->slots[i].state == FH_SLOT_IN_FLIGHT)
+      ioctl(pipe->qdl->fd, USBDEVFS_DISCARDURB, &pipe->slots[i].urb);
+  }
+  /* discarded URBs still have to be reaped before their buffers can be released */
+  while (pipe->in_flight) {
+    unsigned pending = pipe->in_flight;
+    fh_urb_pipe_reap(pipe, 0);
+    if (pipe->in_flight == pending)
+      break;
+  }
+
+  for (i = 0; i < pipe->depth; i++) {
+    free(pipe->slots[i].buf);
+    pipe->slots[i].buf = NULL;
+  }
+  if (pipe->event_fd >= 0)
+    close(pipe->event_fd);
+  pthread_mutex_destroy(&pipe->lock);
+  pthread_cond_destroy(&pipe->cond);
+}
+
+
 static const char * fh_xml_find_value(const char *xml_line, const char *key, char **ppend)
 {
   char *pchar = strstr(xml_line, key);
   char *pend;
 
+  /* skip longer attribute names sharing the prefix, e.g. ...InBytesSupported */
+  while (pchar && pchar[strlen(key)] != '=')
+    pchar = strstr(pchar + 1, key);
+
   if (!pchar) {
     printf("%s: no key %s in %s\n", __func__, key, xml_line);
     return NULL;
   }
 
   pchar += strlen(key);
-  if (pchar[0] != '=' && pchar[1] != '"') {
+  if (pchar[0] != '=' || pchar[1] != '"') {
     printf("%s: no start %s in %s\n", __func__, "=\"", xml_line);
     return NULL;
   }
@@ -100,19 +344,18 @@ static const char * fh_xml_find_value(const char *xml_line, const char *key, cha
   return pchar;
 }
 
-static void fh_xml_set_value(char *xml_line, const char *key, unsigned value) {
+static void fh_xml_set_string(char *xml_line, const char *key, const char *value_str) {
   char *pend;
   const char *pchar = fh_xml_find_value(xml_line, key, &pend);
-  char value_str[32];
-  char *tmp_line = malloc(strlen(xml_line) + 1 + sizeof(value_str));
+  char *tmp_line = malloc(strlen(xml_line) + 1 + strlen(value_str));
 
   if (!pchar || !tmp_line) {
+    free(tmp_line);
     return;
   }
 
   strcpy(tmp_line, xml_line);
 
-  snprintf(value_str, sizeof(value_str), "%u", value);
   tmp_line[pchar - xml_line] = '\0';
   strcat(tmp_line, value_str);
   strcat(tmp_line, pend);
@@ -120,10 +363,17 @@ static void fh_xml_set_value(char *xml_line, const char *key, unsigned value) {
   free(tmp_line);
 }
 
+static void fh_xml_set_value(char *xml_line, const char *key, unsigned value) {
+  char value_str[32];
+
+  snprintf(value_str, sizeof(value_str), "%u", value);
+  fh_xml_set_string(xml_line, key, value_str);
+}
+
 
 static const char * fh_xml_get_value(const char *xml_line, const char *key)
 {
-  static char value[64];
+  static __thread char value[64];
   char *pend;
   const char *pchar = fh_xml_find_value(xml_line, key, &pend);
   if (!pchar) {
@@ -222,9 +472,17 @@ static int fh_parse_xml_line(const char *xml_line, struct fh_cmd *fh_cmd) {
       }
     }
     else if (strstr(xml_line, "MaxPayloadSizeToTargetInBytes")) {
-      pchar = fh_xml_get_value(xml_line, "MaxPayloadSizeToTargetInBytes");
-      if (pchar) {
-        fh_cmd->response.MaxPayloadSizeToTargetInBytes = atoi(pchar);
+      if (strstr(xml_line, "MaxPayloadSizeToTargetInBytes=")) {
+        pchar = fh_xml_get_value(xml_line, "MaxPayloadSizeToTargetInBytes");
+        if (pchar) {
+          fh_cmd->response.MaxPayloadSizeToTargetInBytes = atoi(pchar);
+        }
+      }
+      if (strstr(xml_line, "MaxPayloadSizeToTargetInBytesSupported=")) {
+        pchar = fh_xml_get_value(xml_line, "MaxPayloadSizeToTargetInBytesSupported");
+        if (pchar) {
+          fh_cmd->response.MaxPayloadSizeToTargetInBytesSupported = atoi(pchar);
+        }
       }
     }
     return 0;
@@ -238,6 +496,193 @@ static int fh_parse_xml_line(const char *xml_line, struct fh_cmd *fh_cmd) {
 }
 
 
+static int fh_program_is_sparse(const struct fh_cmd *fh_cmd)
+{
+  return fh_cmd->program.sparse != NULL && !strncasecmp(fh_cmd->program.sparse, "true", 4);
+}
+
+/*
+ * Walk the chunk headers of an Android sparse image and group them into
+ * sp runs. Only chunk headers are read, chunk data is skipped.
+ */
+static int fh_sparse_scan(SparseImgParam *sp, FILE *fp, const struct fh_cmd *fh_cmd, sparse_header_t *hdr)
+{
+  uint32_t sector_size = fh_cmd->program.SECTOR_SIZE_IN_BYTES;
+  long base = (long)fh_cmd->program.file_sector_offset * sector_size;
+  long offset;
+  chunk_header_t chunk;
+  chunk_polymerization_param *entry;
+  int in_run = 0;
+  uint32_t i;
+
+  memset(sp, 0, sizeof(SparseImgParam));
+  sp->file_first_sector_offset = fh_cmd->program.file_sector_offset;
+
+  if (fseek(fp, base, SEEK_SET) || fread(hdr, sizeof(sparse_header_t), 1, fp) != 1) {
+    printf("%s: cannot read sparse header of %s\n", __func__, fh_cmd->program.filename);
+    return -1;
+  }
+
+  if (hdr->magic != SPARSE_HEADER_MAGIC || hdr->major_version != 1
+      || hdr->file_hdr_sz < sizeof(sparse_header_t) || hdr->chunk_hdr_sz < sizeof(chunk_header_t)
+      || hdr->blk_sz == 0 || sector_size == 0 || hdr->blk_sz % sector_size) {
+    printf("%s: %s is not a supported sparse image\n", __func__, fh_cmd->program.filename);
+    return -1;
+  }
+
+  /* gap 0 sits in front of the first run */
+  sp->total_cac3_count = 1;
+  offset = base + hdr->file_hdr_sz;
+
+  for (i = 0; i < hdr->total_chunks; i++) {
+    if (fseek(fp, offset, SEEK_SET) || fread(&chunk, sizeof(chunk_header_t), 1, fp) != 1) {
+      printf("%s: truncated chunk %u\n", __func__, i);
+      return -1;
+    }
+
+    switch (chunk.chunk_type) {
+    case CHUNK_TYPE_RAW:
+    case CHUNK_TYPE_FILL:
+      if (chunk.total_sz != hdr->chunk_hdr_sz + (chunk.chunk_type == CHUNK_TYPE_RAW ? chunk.chunk_sz * hdr->blk_sz : 4)) {
+        printf("%s: bad size for chunk %u\n", __func__, i);
+        return -1;
+      }
+      if (!in_run) {
+        sp->total_count++;
+        in_run = 1;
+      }
+      break;
+    case CHUNK_TYPE_DONT_CARE:
+      /* once the run table is full, further holes are sent as zeros */
+      if (in_run && sp->total_count < SPARSE_MAX_RUNS) {
+        in_run = 0;
+        sp->total_cac3_count = sp->total_count + 1;
+      }
+      break;
+    case CHUNK_TYPE_CRC32:
+      chunk.chunk_sz = 0;
+      break;
+    default:
+      printf("%s: unknown chunk type 0x%04x\n", __func__, chunk.chunk_type);
+      return -1;
+    }
+
+    entry = in_run ? &sp->chunk_polymerization_data[sp->total_count - 1]
+                   : &sp->chunk_polymerization_cac3[sp->total_cac3_count - 1];
+    entry->total_chunk_sz += chunk.chunk_sz;
+    entry->total_sz += chunk.total_sz;
+    entry->total_chunk_count++;
+
+    offset += chunk.total_sz;
+  }
+
+  return 0;
+}
+
+static size_t fh_sparse_read(struct fh_raw_source *src, void *buf, size_t len)
+{
+  const sparse_header_t *hdr = src->sparse_hdr;
+  uint8_t *out = (uint8_t *)buf;
+  size_t produced = 0;
+
+  while (produced < len) {
+    size_t n;
+
+    if (src->chunk_left == 0) {
+      if (src->chunks_left == 0)
+        break;
+      if (fread(&src->chunk, sizeof(chunk_header_t), 1, src->fp) != 1)
+        break;
+      fseek(src->fp, hdr->chunk_hdr_sz - sizeof(chunk_header_t), SEEK_CUR);
+      src->chunks_left--;
+
+      if (src->chunk.chunk_type == CHUNK_TYPE_CRC32) {
+        fseek(src->fp, src->chunk.total_sz - hdr->chunk_hdr_sz, SEEK_CUR);
+        continue;
+      }
+      if (src->chunk.chunk_type == CHUNK_TYPE_FILL
+          && fread(&src->fill_value, sizeof(src->fill_value), 1, src->fp) != 1)
+        break;
+      src->chunk_left = src->chunk.chunk_sz * hdr->blk_sz;
+      src->chunk_pos = 0;
+      continue;
+    }
+
+    n = MIN(len - produced, src->chunk_left);
+    if (src->chunk.chunk_type == CHUNK_TYPE_RAW) {
+      if (fread(out + produced, 1, n, src->fp) != n)
+        break;
+    } else if (src->chunk.chunk_type == CHUNK_TYPE_FILL) {
+      const uint8_t *pattern = (const uint8_t *)&src->fill_value;
+      size_t k;
+      for (k = 0; k < n; k++)
+        out[produced + k] = pattern[(src->chunk_pos + k) & 3];
+    } else {
+      memset(out + produced, 0, n);
+    }
+
+    src->chunk_left -= n;
+    src->chunk_pos += n;
+    produced += n;
+  }
+
+  return produced;
+}
+
+static size_t fh_file_read(struct fh_raw_source *src, void *buf, size_t len)
+{
+  return fread(buf, 1, len, src->fp);
+}
+
+static size_t fh_zimage_read(struct fh_raw_source *src, void *buf, size_t len)
+{
+  len = MIN((uint64_t)len, src->size - src->pos);
+  if (zimage_wait(src->z, src->pos, len))
+    return 0;
+  memcpy(buf, src->z->base + src->pos, len);
+  src->pos += len;
+  /* programs are sent once, front to back */
+  zimage_release(src->z, src->pos);
+  return len;
+}
+
+
+/* rawprogram XML files use DOS paths relative to the firmware directory */
+static void fh_program_path(const struct fh_data *fh_data, const struct fh_cmd *fh_cmd, char *full_path, size_t size)
+{
+    char *ptmp;
+
+    snprintf(full_path, size, "%.255s/%.240s", fh_data->firehose_dir, fh_cmd->program.filename);
+    ptmp = full_path + strlen(fh_data->firehose_dir);
+    while((ptmp = strchr(ptmp, '\\'))) {
+        *ptmp = '/';
+    }
+}
+
+/*
+ * zimage_probe() of a program file and, if z is given and it is compressed,
+ * zimage_open(). A bundle entry is a stream without a descriptor, its bytes
+ * are found in the bundle file instead.
+ */
+static int fh_zimage_probe(const char *path, struct zimage *z, uint64_t *content_size)
+{
+    struct bundle *bundle;
+    uint64_t offset, length;
+    int fd, ret;
+
+    ret = bundle_open_range(path, &fd, &offset, &length, &bundle);
+    if (ret)
+        return ret;
+    ret = zimage_probe(fd, offset, length, content_size);
+    if (ret > 0 && z && zimage_open(z, fd, offset, length, path))
+        ret = -EINVAL;
+    if (bundle)
+        bundle_put(bundle);
+    else
+        close(fd);
+    return ret;
+}
+
 static int fh_validate_program_cmd(struct fh_data *fh_data, struct fh_cmd *fh_cmd)
 {
     char full_path[512];
@@ -245,37 +690,65 @@ static int fh_validate_program_cmd(struct fh_data *fh_data, struct fh_cmd *fh_cm
     char *ptmp;
     FILE *fp;
     long filesize = 0;
+    uint64_t content_size;
     uint32_t num_partition_sectors = fh_cmd->program.num_partition_sectors;
+    int ret;
 
     while((ptmp = strchr(unix_filename, '\\'))) {
         *ptmp = '/';
     }
 
-    snprintf(full_path, sizeof(full_path), "%.255s/%.240s", fh_data->firehose_dir, unix_filename);
-    if (access(full_path, R_OK)) {
-        fh_cmd->program.num_partition_sectors = 0;
-        printf("failed to access %s, errno: %d (%s)\n", full_path, errno, strerror(errno));
-        return -1;
-    }
-
-    fp = fopen(full_path, "rb");
+    fh_program_path(fh_data, fh_cmd, full_path, sizeof(full_path));
+    free(fh_cmd->program.path);
+    fh_cmd->program.path = strdup(full_path);
+    fp = bundle_fopen(full_path);
     if (!fp) {
         fh_cmd->program.num_partition_sectors = 0;
         printf("failed to fopen %s, errno: %d (%s)\n", full_path, errno, strerror(errno));
-        return -2;
+        ret = -2;
+        goto EXIT;
     }
 
     fseek(fp, 0, SEEK_END);
     filesize = ftell(fp);
     fclose(fp);
+    ret = fh_zimage_probe(full_path, NULL, &content_size);
+
+    if (ret < 0 || (ret > 0 && fh_program_is_sparse(fh_cmd))) {
+        /* sparse images are scanned in place and must stay uncompressed */
+        printf("%s: %s\n", full_path, ret < 0 ? "broken seek table" : "sparse images cannot be compressed");
+        fh_cmd->program.num_partition_sectors = 0;
+        ret = -3;
+        goto EXIT;
+    }
+    if (ret > 0)
+        filesize = content_size;
 
     if (filesize <= 0) {
         printf("failed to ftell %s, errno: %d (%s)\n", full_path, errno, strerror(errno));
         fh_cmd->program.num_partition_sectors = 0;
         fh_cmd->program.filesz = 0;
-        return -3;
+        ret = -3;
+        goto EXIT;
     }
     fh_cmd->program.filesz = filesize;
+    if (fh_program_is_sparse(fh_cmd)) {
+        sparse_header_t sparse_hdr;
+
+        fp = bundle_fopen(full_path);
+        if (!fp || fh_sparse_scan(&fh_data->sparse, fp, fh_cmd, &sparse_hdr)) {
+            if (fp)
+                fclose(fp);
+            fh_cmd->program.num_partition_sectors = 0;
+            ret = -4;
+            goto EXIT;
+        }
+        fclose(fp);
+        fh_cmd->program.UNSPARSE_FILE_SIZE = sparse_hdr.total_blks * sparse_hdr.blk_sz;
+        fh_cmd->program.num_partition_sectors = fh_cmd->program.UNSPARSE_FILE_SIZE / fh_cmd->program.SECTOR_SIZE_IN_BYTES;
+        ret = 0;
+        goto EXIT;
+    }
     fh_cmd->program.num_partition_sectors = filesize/fh_cmd->program.SECTOR_SIZE_IN_BYTES;
     if (filesize%fh_cmd->program.SECTOR_SIZE_IN_BYTES)
         fh_cmd->program.num_partition_sectors += 1;
@@ -289,96 +762,177 @@ static int fh_validate_program_cmd(struct fh_data *fh_data, struct fh_cmd *fh_cm
         fh_xml_set_value(fh_cmd->xml_original_data, "num_partition_sectors",
             fh_cmd->program.num_partition_sectors);
     }
+    ret = 0;
 
+EXIT:
     free(unix_filename);
-
-    return 0;
+    return ret;
 }
 
 
 
 
 
-static int fh_recv_cmd(struct fh_data *fh_data, struct fh_cmd *fh_cmd,
-                       unsigned timeout)
+static int fh_hex_value(char c)
 {
-  size_t bytes_read = 0;
-  char *xml_line;
-  char *pend;
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
 
-  memset(fh_cmd, 0, sizeof(struct fh_cmd));
-  fh_data->xml_rx_buf[bytes_read] = '\0';
+/* getsha256digest reports its result as <log value="Digest 0123...ef" /> */
+static void fh_parse_log_digest(struct fh_data *fh_data, const char *log_line, const char *pend)
+{
+  const char *p = strstr(log_line, "Digest");
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  int i;
 
-  bytes_read = qdl_read(fh_data->usb_handle,
-                        fh_data->xml_rx_buf,
-                        fh_data->xml_rx_size, timeout);
+  if (!p || p >= pend)
+    return;
 
-  if ( bytes_read <= 0) {
-    return -1;
+  p += strlen("Digest");
+  while (*p == ' ' || *p == ':' || *p == '=')
+    p++;
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    p += 2;
+
+  if (p + SHA256_DIGEST_SIZE * 2 > pend)
+    return;
+
+  for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+    int hi = fh_hex_value(p[i * 2]);
+    int lo = fh_hex_value(p[i * 2 + 1]);
+    if (hi < 0 || lo < 0)
+      return;
+    digest[i] = (uint8_t)(hi << 4 | lo);
   }
 
+  memcpy(fh_data->target_digest, digest, SHA256_DIGEST_SIZE);
+  fh_data->target_digest_valid = 1;
+}
 
-  xml_line = fh_data->xml_rx_buf;
+/* Print one element on a single line, as the target may embed newlines in log values */
+static void fh_print_element(const char *elem, size_t len)
+{
+  size_t i;
 
-  while (*xml_line) {
-    xml_line = strstr(xml_line, "<?xml version=");
-    if (xml_line == NULL) {
-      if (fh_cmd->cmd.type == 0) {
-        printf("{{{%s}}}", fh_data->xml_rx_buf);
-        return -1;
-      } else {
-        break;
-      }
-    }
-    xml_line += strlen("<?xml version=");
+  for (i = 0; i < len; i++)
+    putchar((elem[i] == '\r' || elem[i] == '\n') ? '.' : elem[i]);
+  putchar('\n');
+}
 
-    xml_line = strstr(xml_line, "<data>");
-    if (xml_line == NULL) {
-      printf("{{{%s}}}", fh_data->xml_rx_buf);
-      return -2;
+/*
+ * Parse the elements of one <data> document. Log lines are printed as they
+ * are found, the returned event is the response if there is one, otherwise
+ * the last log.
+ */
+static int fh_parse_rx_document(struct fh_data *fh_data, char *doc, char *doc_end, struct fh_cmd *fh_cmd)
+{
+  char line[sizeof(fh_cmd->xml_original_data)];
+  struct fh_cmd elem_cmd;
+  char *xml_line, *pend;
+  int have_response = 0;
+
+  xml_line = memmem(doc, doc_end - doc, "<data>", strlen("<data>"));
+  if (xml_line == NULL) {
+    printf("{{{%.*s}}}", (int)(doc_end - doc), doc);
+    return -2;
+  }
+  xml_line += strlen("<data>");
+
+  for (;;) {
+    size_t len;
+    char saved;
+
+    xml_line = memchr(xml_line, '<', doc_end - xml_line);
+    if (xml_line == NULL || !strncmp(xml_line, "</data>", strlen("</data>")))
+      break;
+    pend = memmem(xml_line, doc_end - xml_line, "/>", 2);
+    if (pend == NULL) {
+      printf("unknown %.*s", (int)(doc_end - xml_line), xml_line);
+      return -3;
     }
-    xml_line += strlen("<data>");
-    if (xml_line[0] == '\n')
-      xml_line++;
+    pend += 2;
+    len = pend - xml_line;
 
+    saved = *pend;
+    *pend = '\0';
+    snprintf(line, sizeof(line), "%s", xml_line);
     if (!strncmp(xml_line, "<response ", strlen("<response "))) {
-      fh_parse_xml_line(xml_line, fh_cmd);
-      pend = strstr(xml_line, "/>");
-      pend += 2;
-      printf("%.*s\n", (int)(pend -xml_line),  xml_line);
-      xml_line = pend + 1;
-    }
-    else if (!strncmp(xml_line, "<log ", strlen("<log "))) {
-      if (fh_cmd->cmd.type && strcmp(fh_cmd->cmd.type, "log")) {
-        printf("{{{%s}}}", fh_data->xml_rx_buf);
-        break;
-      }
-      fh_parse_xml_line(xml_line, fh_cmd);
-      pend = strstr(xml_line, "/>");
-      pend += 2;
-      {
-        char *prn = xml_line;
-        while (prn < pend) {
-          if (*prn == '\r' || *prn == '\n')
-            *prn = '.';
-          prn++;
-        }
+      fh_parse_xml_line(line, fh_cmd);
+      have_response = 1;
+      fh_print_element(xml_line, len);
+    } else if (!strncmp(xml_line, "<log ", strlen("<log "))) {
+      fh_parse_log_digest(fh_data, xml_line, pend);
+      fh_print_element(xml_line, len);
+      if (!have_response) {
+        fh_parse_xml_line(line, &elem_cmd);
+        memcpy(fh_cmd, &elem_cmd, sizeof(struct fh_cmd));
       }
-      printf("%.*s\n", (int)(pend -xml_line),  xml_line);
-      xml_line = pend + 1;
     } else {
-      printf("unknown %s", xml_line);
-      return -3;
+      printf("unknown %s\n", xml_line);
     }
+    *pend = saved;
+    xml_line = pend;
   }
 
-  if (fh_cmd->cmd.type) {
+  return fh_cmd->cmd.type ? 0 : -3;
+}
 
-    return 0;
-  }
+/*
+ * Return the next Firehose message, reading from the target only when the
+ * buffer does not already hold a complete one. Partial documents are kept
+ * across calls and the search for the terminator resumes where it stopped.
+ */
+static int fh_recv_cmd(struct fh_data *fh_data, struct fh_cmd *fh_cmd,
+                       unsigned timeout)
+{
+  static const char terminator[] = "</data>";
+  const size_t term_len = strlen(terminator);
+  char *buf = fh_data->xml_rx_buf;
+  int bytes_read;
+
+  memset(fh_cmd, 0, sizeof(struct fh_cmd));
+
+  for (;;) {
+    char *doc, *doc_end;
+
+    doc_end = memmem(buf + fh_data->rx_scan, fh_data->rx_end - fh_data->rx_scan, terminator, term_len);
+    if (doc_end) {
+      doc_end += term_len;
+      doc = memmem(buf + fh_data->rx_start, doc_end - buf - fh_data->rx_start, "<?xml version=", strlen("<?xml version="));
+      fh_data->rx_start = fh_data->rx_scan = doc_end - buf;
+      if (doc == NULL) {
+        printf("{{{%.*s}}}", (int)(doc_end - buf), buf);
+        return -2;
+      }
+      return fh_parse_rx_document(fh_data, doc, doc_end, fh_cmd);
+    }
 
+    /* nothing complete yet, make room at the end of the buffer and read more */
+    if (fh_data->rx_start) {
+      memmove(buf, buf + fh_data->rx_start, fh_data->rx_end - fh_data->rx_start);
+      fh_data->rx_end -= fh_data->rx_start;
+      fh_data->rx_start = 0;
+    }
+    fh_data->rx_scan = fh_data->rx_end >= term_len ? fh_data->rx_end - term_len + 1 : 0;
+    if (fh_data->xml_rx_size - fh_data->rx_end < FH_RX_READ_SIZE) {
+      printf("%s: dropping %zu bytes without </data>\n", __func__, fh_data->rx_end);
+      fh_data->rx_end = fh_data->rx_scan = 0;
+    }
 
-  return bytes_read;
+    bytes_read = qdl_read(fh_data->usb_handle,
+                          buf + fh_data->rx_end,
+                          fh_data->xml_rx_size - fh_data->rx_end, timeout);
+    if (bytes_read <= 0) {
+      return -1;
+    }
+    fh_data->rx_end += bytes_read;
+  }
 }
 
 static int fh_wait_response_cmd(struct fh_data *fh_data, struct fh_cmd *fh_cmd, unsigned timeout)
@@ -426,6 +980,8 @@ static int fh_send_cmd(struct fh_data *fh_data, const struct fh_cmd *fh_cmd)
         } else {
           snprintf(xml_buf + strlen(xml_buf), xml_size, "%s", fh_cmd->xml_original_data);
         }
+    } else if (!strcmp(fh_cmd->cmd.type, "getsha256digest")) {
+        snprintf(xml_buf + strlen(xml_buf), xml_size, "%s", fh_cmd->xml_original_data);
     } else if (!strcmp(fh_cmd->cmd.type, "patch")) {
         snprintf(xml_buf + strlen(xml_buf), xml_size, "%s", fh_cmd->xml_original_data);
     } else if (!strcmp(fh_cmd->cmd.type, "configure")) {
@@ -465,9 +1021,16 @@ static int fh_send_cmd(struct fh_data *fh_data, const struct fh_cmd *fh_cmd)
     return -2;
 }
 
+/*
+ * Offer the largest payload first and walk down to whatever the programmer
+ * accepts: a NAK usually carries MaxPayloadSizeToTargetInBytesSupported,
+ * otherwise keep halving until FH_MIN_PAYLOAD_TO_TARGET.
+ */
 static int fh_send_cfg_cmd(struct fh_data *fh_data) {
   struct fh_cmd fh_cfg_cmd;
   struct fh_cmd fh_rx_cmd;
+  uint32_t payload = fh_max_payload;
+  uint32_t supported;
 
   int ret = 0;
   memset(&fh_cfg_cmd, 0x00, sizeof(fh_cfg_cmd));
@@ -479,37 +1042,53 @@ static int fh_send_cfg_cmd(struct fh_data *fh_data) {
   fh_cfg_cmd.cfg.ZlpAwareHost = fh_data->ZlpAwareHost; 
 
   fh_cfg_cmd.cfg.MaxDigestTableSizeInBytes = 2048;
-  fh_cfg_cmd.cfg.MaxPayloadSizeToTargetInBytes = 8192;
   fh_cfg_cmd.cfg.MaxPayloadSizeFromTargetInBytes = 2048;
-  fh_cfg_cmd.cfg.MaxPayloadSizeToTargetInByteSupported = 8192;
 
+  if (payload < FH_MIN_PAYLOAD_TO_TARGET)
+    payload = FH_MIN_PAYLOAD_TO_TARGET;
 
-  ret = fh_send_cmd(fh_data, &fh_cfg_cmd);
-  if (ret) {
-    printf("FIREHOSE: %s, %d  send configuration command\n", __FUNCTION__, __LINE__);
-    return -1;
-  }
+  for (;;) {
+    fh_cfg_cmd.cfg.MaxPayloadSizeToTargetInBytes = payload;
+    fh_cfg_cmd.cfg.MaxPayloadSizeToTargetInByteSupported = payload;
 
-  if (fh_wait_response_cmd(fh_data, &fh_rx_cmd, 5000) != 0) {
-    printf("FIREHOSE: %s, %d did not get a response", __FUNCTION__, __LINE__);
-    return -2;
-  }
-    
+    ret = fh_send_cmd(fh_data, &fh_cfg_cmd);
+    if (ret) {
+      printf("FIREHOSE: %s, %d  send configuration command\n", __FUNCTION__, __LINE__);
+      return -1;
+    }
 
-  if (!strcmp(fh_rx_cmd.response.value, "NAK") && fh_rx_cmd.response.MaxPayloadSizeToTargetInBytes) {
-    fh_cfg_cmd.cfg.MaxPayloadSizeToTargetInBytes = fh_rx_cmd.response.MaxPayloadSizeToTargetInBytes;
-    fh_cfg_cmd.cfg.MaxPayloadSizeToTargetInByteSupported = fh_rx_cmd.response.MaxPayloadSizeToTargetInBytes;
-    
-    fh_send_cmd(fh_data, &fh_cfg_cmd);
     if (fh_wait_response_cmd(fh_data, &fh_rx_cmd, 5000) != 0) {
-      return -3;
+      printf("FIREHOSE: %s, %d did not get a response", __FUNCTION__, __LINE__);
+      return -2;
     }
-  }
-  if (strcmp(fh_rx_cmd.response.value, "ACK") != 0) {
-    return -4;
+
+    if (fh_rx_cmd.response.value && !strcmp(fh_rx_cmd.response.value, "ACK")) {
+      /* the ACK may still trim the payload to what the programmer will use */
+      if (fh_rx_cmd.response.MaxPayloadSizeToTargetInBytes
+          && fh_rx_cmd.response.MaxPayloadSizeToTargetInBytes < payload)
+        payload = fh_rx_cmd.response.MaxPayloadSizeToTargetInBytes;
+      break;
+    }
+
+    if (!fh_rx_cmd.response.value || strcmp(fh_rx_cmd.response.value, "NAK")) {
+      return -4;
+    }
+
+    supported = fh_rx_cmd.response.MaxPayloadSizeToTargetInBytesSupported;
+    if (!supported)
+      supported = fh_rx_cmd.response.MaxPayloadSizeToTargetInBytes;
+
+    if (supported && supported < payload)
+      payload = supported;
+    else if (payload > FH_MIN_PAYLOAD_TO_TARGET)
+      payload = MAX(payload / 2, FH_MIN_PAYLOAD_TO_TARGET);
+    else
+      return -3;
   }
 
-  fh_data->MaxPayloadSizeToTargetInBytes = fh_cfg_cmd.cfg.MaxPayloadSizeToTargetInBytes;
+  fh_data->MaxPayloadSizeToTargetInBytes = payload;
+  fh_data->stats.MaxPayloadSizeToTargetInBytes = payload;
+  printf("FIREHOSE: MaxPayloadSizeToTargetInBytes negotiated to %u\n", payload);
 
   return 0;
 }
@@ -528,63 +1107,156 @@ static int fh_process_erase(struct fh_data *fh_data, const struct fh_cmd *fh_cmd
   return 0;
 }
 
-static int fh_send_rawmode_image(struct fh_data *fh_data, const struct fh_cmd *fh_cmd, unsigned timeout)
+static void fh_program_file_path(const struct fh_data *fh_data, const struct fh_cmd *fh_cmd, char *full_path, size_t size)
+{
+    if (fh_cmd->program.path)
+        snprintf(full_path, size, "%s", fh_cmd->program.path);
+    else
+        fh_program_path(fh_data, fh_cmd, full_path, size);
+}
+
+static FILE *fh_open_program_file(struct fh_data *fh_data, const struct fh_cmd *fh_cmd)
 {
     char full_path[512];
-    char *unix_filename = strdup(fh_cmd->program.filename);
-    char *ptmp;
     FILE *fp;
-    size_t filesize, filesend;
-    void *pbuf = malloc(fh_data->MaxPayloadSizeToTargetInBytes);
 
-    if (pbuf == NULL)
+    fh_program_file_path(fh_data, fh_cmd, full_path, sizeof(full_path));
+    fp = bundle_fopen(full_path);
+    if (!fp) {
+        printf("fail to fopen %s, errno: %d (%s)\n", full_path, errno, strerror(errno));
+    }
+
+    return fp;
+}
+
+/* The bytes a non-sparse program writes, decompressed when the file is a zstd seekable image */
+static int fh_open_raw_source(struct fh_data *fh_data, const struct fh_cmd *fh_cmd, struct fh_raw_source *src)
+{
+    uint64_t content_size;
+    char full_path[512];
+    int ret;
+
+    memset(src, 0, sizeof(*src));
+    src->fp = fh_open_program_file(fh_data, fh_cmd);
+    if (!src->fp)
         return -1;
 
-    while((ptmp = strchr(unix_filename, '\\'))) {
-        *ptmp = '/';
+    fh_program_file_path(fh_data, fh_cmd, full_path, sizeof(full_path));
+    src->z = malloc(sizeof(struct zimage));
+    ret = src->z ? fh_zimage_probe(full_path, src->z, &content_size) : -ENOMEM;
+    if (ret > 0) {
+        src->read = fh_zimage_read;
+        src->size = src->z->size;
+        return 0;
     }
-
-    snprintf(full_path, sizeof(full_path), "%.255s/%.240s", fh_data->firehose_dir, unix_filename);
-    fp = fopen(full_path, "rb");
-    if (!fp) {
-        printf("fail to fopen %s, errno: %d (%s)\n", full_path, errno, strerror(errno));
+    free(src->z);
+    src->z = NULL;
+    if (ret < 0) {
+        printf("fail to decompress %s\n", fh_cmd->program.filename);
+        fclose(src->fp);
+        src->fp = NULL;
         return -1;
     }
 
-    fseek(fp, 0, SEEK_END);
-    filesize = ftell(fp);
-    filesend = 0;
-    fseek(fp, 0, SEEK_SET);
-
-    while (filesend < filesize) {
-      size_t reads;
-      if (filesize < (filesend + fh_data->MaxPayloadSizeToTargetInBytes)) {
-        reads = fread(pbuf, 1, filesize - filesend, fp);
-      } else {
-        reads = fread(pbuf, 1, fh_data->MaxPayloadSizeToTargetInBytes, fp);
-      }
+    src->read = fh_file_read;
+    fseek(src->fp, 0, SEEK_END);
+    src->size = ftell(src->fp);
+    fseek(src->fp, 0, SEEK_SET);
+    return 0;
+}
+
+static void fh_close_raw_source(struct fh_raw_source *src)
+{
+    if (src->z) {
+        zimage_close(src->z);
+        free(src->z);
+        src->z = NULL;
+    }
+    if (src->fp)
+        fclose(src->fp);
+    src->fp = NULL;
+}
+
+static int fh_send_rawmode_image(struct fh_data *fh_data, struct fh_raw_source *src, uint32_t sector_size, unsigned timeout)
+{
+    size_t filesize = src->size, filesend = 0;
+    struct fh_urb_pipe pipe;
+    pthread_t reader;
+    unsigned u = 0;
+    int ret = 0;
+
+    if (fh_urb_pipe_init(&pipe, fh_data->usb_handle, fh_data->urb_queue_depth, fh_data->MaxPayloadSizeToTargetInBytes)) {
+        return -1;
+    }
+
+    pipe.src = src;
+    pipe.sector_size = sector_size;
+    if (pthread_create(&reader, NULL, fh_urb_pipe_reader, &pipe)) {
+        fh_urb_pipe_free(&pipe);
+        return -1;
+    }
+
+    for (;;) {
+      struct fh_urb_slot *slot = &pipe.slots[u];
+      struct pollfd pfd[2];
+      uint64_t events;
+      int filled, done, n;
 
-      if (reads <= 0) {
+      /* hand completed buffers back to the reader first */
+      while (pipe.in_flight && fh_urb_pipe_reap(&pipe, 1) == 0)
+        ;
+      if (pipe.error)
         break;
+
+      pthread_mutex_lock(&pipe.lock);
+      filled = slot->state == FH_SLOT_FILLED;
+      done = pipe.reader_done && pipe.submitted == pipe.filled;
+      ret = pipe.reader_error;
+      pthread_mutex_unlock(&pipe.lock);
+
+      if (filled) {
+        if (fh_urb_pipe_submit(&pipe, slot, slot->len, 1)) {
+          printf("%s send fail filesend=%zd, filesize=%zd\n", __func__, filesend, filesize);
+          break;
+        }
+        pipe.submitted++;
+        filesend += slot->len;
+        u = (u + 1) % pipe.depth;
+        printf(".");
+        continue;
       }
-      if (reads % fh_cmd->program.SECTOR_SIZE_IN_BYTES) {
-        memset((uint8_t *)pbuf + reads, 0, fh_cmd->program.SECTOR_SIZE_IN_BYTES - (reads % fh_cmd->program.SECTOR_SIZE_IN_BYTES));
-        reads +=  fh_cmd->program.SECTOR_SIZE_IN_BYTES - (reads % fh_cmd->program.SECTOR_SIZE_IN_BYTES);
-      }
-      size_t writes = usbfs_bulk_write(fh_data->usb_handle , pbuf , reads, timeout, 1);
-      if (reads != writes) {
-        printf("%s send fail reads=%zd, writes=%zd\n", __func__, reads, writes);
-        printf("%s send fail filesend=%zd, filesize=%zd\n", __func__, filesend, filesize);
+      if (done || ret)
+        break;
+
+      /* sleep until the reader fills a buffer or the controller completes one */
+      pfd[0].fd = pipe.event_fd;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = pipe.qdl->fd;
+      pfd[1].events = POLLOUT;
+      do {
+        n = poll(pfd, pipe.in_flight ? 2 : 1, timeout ? (int)timeout : -1);
+      } while ((n < 0) && (errno == EINTR));
+      if (n <= 0) {
+        printf("%s: stalled for %u ms, filesend=%zd, filesize=%zd\n", __func__, timeout, filesend, filesize);
+        pipe.error = -1;
         break;
       }
-      filesend += reads;
-      printf(".");
+      if (pfd[0].revents & POLLIN) {
+        if (read(pipe.event_fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+          break;
+      }
+    }
 
+    fh_urb_pipe_stop_reader(&pipe);
+    pthread_join(reader, NULL);
+
+    if (pipe.error || ret || pipe.reader_error || fh_urb_pipe_drain(&pipe, timeout)) {
+      printf("%s: %u transfers did not complete\n", __func__, pipe.in_flight);
+      filesend = 0;
     }
+    fh_data->stats.bytes_sent += filesend;
 
-    fclose(fp);
-    free(unix_filename);
-    free(pbuf);
+    fh_urb_pipe_free(&pipe);
 
     printf("\n");
     if (filesend >= filesize) {
@@ -597,8 +1269,8 @@ static int fh_send_rawmode_image(struct fh_data *fh_data, const struct fh_cmd *f
 }
 
 
-
-static int fh_process_program(struct fh_data *fh_data, struct fh_cmd *fh_cmd)
+/* <program> handshake: rawmode ACK, the raw data, then the closing ACK */
+static int fh_program_raw(struct fh_data *fh_data, const struct fh_cmd *fh_cmd, struct fh_raw_source *src)
 {
   struct fh_cmd fh_rx_cmd;
 
@@ -617,7 +1289,7 @@ static int fh_process_program(struct fh_data *fh_data, struct fh_cmd *fh_cmd)
     return -1;
   }
 
-  if (fh_send_rawmode_image(fh_data, fh_cmd, 15000)) {
+  if (fh_send_rawmode_image(fh_data, src, fh_cmd->program.SECTOR_SIZE_IN_BYTES, 15000)) {
     printf("fh_send_rawmode_image fail\n");
     return -1;
   }
@@ -634,11 +1306,335 @@ static int fh_process_program(struct fh_data *fh_data, struct fh_cmd *fh_cmd)
     return -1;
   }
 
-  free(fh_cmd->program.filename);
+  return 0;
+}
 
+/*
+ * Unsparse on the host: every run of RAW/FILL chunks becomes a plain
+ * <program> of its own sector range, don't-care gaps are never sent.
+ */
+static int fh_process_sparse_program(struct fh_data *fh_data, const struct fh_cmd *fh_cmd, FILE *fp)
+{
+  SparseImgParam *sp = &fh_data->sparse;
+  uint32_t sector_size = fh_cmd->program.SECTOR_SIZE_IN_BYTES;
+  sparse_header_t sparse_hdr;
+  struct fh_raw_source src;
+  struct fh_cmd run_cmd;
+  long offset;
+  uint32_t out_blocks = 0;
+  uint64_t bytes_sent = 0;
+  unsigned k;
+
+  if (fh_sparse_scan(&fh_data->sparse, fp, fh_cmd, &sparse_hdr))
+    return -1;
+
+  offset = (long)fh_cmd->program.file_sector_offset * sector_size + sparse_hdr.file_hdr_sz;
+
+  for (k = 0; k < sp->total_count; k++) {
+    const chunk_polymerization_param *gap = &sp->chunk_polymerization_cac3[k];
+    const chunk_polymerization_param *run = &sp->chunk_polymerization_data[k];
+    uint32_t run_sectors = run->total_chunk_sz * (sparse_hdr.blk_sz / sector_size);
+
+    offset += gap->total_sz;
+    out_blocks += gap->total_chunk_sz;
+
+    memcpy(&run_cmd, fh_cmd, sizeof(struct fh_cmd));
+    run_cmd.program.sparse = NULL;
+    run_cmd.program.start_sector = fh_cmd->program.start_sector + out_blocks * (sparse_hdr.blk_sz / sector_size);
+    run_cmd.program.num_partition_sectors = run_sectors;
+    fh_xml_set_value(run_cmd.xml_original_data, "start_sector", run_cmd.program.start_sector);
+    fh_xml_set_value(run_cmd.xml_original_data, "num_partition_sectors", run_sectors);
+    fh_xml_set_string(run_cmd.xml_original_data, "sparse", "false");
+    if (strstr(run_cmd.xml_original_data, "file_sector_offset"))
+      fh_xml_set_value(run_cmd.xml_original_data, "file_sector_offset", 0);
+
+    memset(&src, 0, sizeof(src));
+    src.read = fh_sparse_read;
+    src.fp = fp;
+    src.size = (size_t)run->total_chunk_sz * sparse_hdr.blk_sz;
+    src.sparse_hdr = &sparse_hdr;
+    src.chunks_left = run->total_chunk_count;
+
+    if (src.size && (fseek(fp, offset, SEEK_SET) || fh_program_raw(fh_data, &run_cmd, &src))) {
+      printf("%s: run %u of %s failed\n", __func__, k, fh_cmd->program.filename);
+      return -1;
+    }
+
+    offset += run->total_sz;
+    out_blocks += run->total_chunk_sz;
+    bytes_sent += src.size;
+  }
+
+  printf("sparse %s: %u runs, sent %llu of %llu bytes\n", fh_cmd->program.filename, sp->total_count,
+         (unsigned long long)bytes_sent, (unsigned long long)sparse_hdr.total_blks * sparse_hdr.blk_sz);
   return 0;
 }
 
+static int fh_process_program(struct fh_data *fh_data, struct fh_cmd *fh_cmd)
+{
+  struct fh_raw_source src;
+  FILE *fp;
+  int ret;
+
+  if (fh_program_is_sparse(fh_cmd)) {
+    fp = fh_open_program_file(fh_data, fh_cmd);
+    if (!fp)
+      return -1;
+    ret = fh_process_sparse_program(fh_data, fh_cmd, fp);
+    fclose(fp);
+  } else {
+    if (fh_open_raw_source(fh_data, fh_cmd, &src))
+      return -1;
+    ret = fh_program_raw(fh_data, fh_cmd, &src);
+    fh_close_raw_source(&src);
+  }
+
+  if (ret)
+    return -1;
+
+  fh_data->stats.programs++;
+
+  return 0;
+}
+
+static int fh_hash_program_file(struct fh_data *fh_data, struct fh_hash_job *job)
+{
+  struct sha256_ctx ctx;
+  uint64_t hashed = 0;
+  size_t len = 64 * 1024;
+  uint8_t *buf = malloc(len);
+  struct fh_raw_source src;
+  int ret = 0;
+
+  if (!buf)
+    return -1;
+
+  if (fh_open_raw_source(fh_data, job->fh_cmd, &src)) {
+    free(buf);
+    return -1;
+  }
+
+  /* hash exactly what would be written: the file, zero padded to whole sectors */
+  sha256_init(&ctx);
+  while (hashed < job->length) {
+    size_t n = hashed < src.size ? src.read(&src, buf, MIN((uint64_t)len, MIN(job->length, src.size) - hashed)) : 0;
+    if (n == 0 && hashed < src.size) {
+      ret = -1;
+      break;
+    }
+    if (n == 0) {
+      n = MIN((uint64_t)len, job->length - hashed);
+      memset(buf, 0, n);
+    }
+    sha256_update(&ctx, buf, n);
+    hashed += n;
+  }
+  sha256_final(&ctx, job->digest);
+
+  fh_close_raw_source(&src);
+  free(buf);
+  return ret;
+}
+
+static void *fh_hash_worker(void *arg)
+{
+  struct fh_hash_pool *pool = (struct fh_hash_pool *)arg;
+
+  for (;;) {
+    struct fh_hash_job *job;
+    int state;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->next >= pool->njobs) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    job = &pool->jobs[pool->next++];
+    pthread_mutex_unlock(&pool->lock);
+
+    state = fh_hash_program_file(pool->fh_data, job) ? -1 : 1;
+
+    pthread_mutex_lock(&pool->lock);
+    job->state = state;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+}
+
+static int fh_hash_wait(struct fh_hash_pool *pool, struct fh_hash_job *job)
+{
+  int state;
+
+  pthread_mutex_lock(&pool->lock);
+  while (job->state == 0)
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  state = job->state;
+  pthread_mutex_unlock(&pool->lock);
+
+  return state;
+}
+
+static int fh_query_target_digest(struct fh_data *fh_data, const struct fh_cmd *fh_cmd)
+{
+  struct fh_cmd fh_digest_cmd;
+  struct fh_cmd fh_rx_cmd;
+
+  memset(&fh_digest_cmd, 0, sizeof(fh_digest_cmd));
+  fh_digest_cmd.cmd.type = "getsha256digest";
+  /* same attributes (label, sectors, partition) as the <program> line */
+  snprintf(fh_digest_cmd.xml_original_data, sizeof(fh_digest_cmd.xml_original_data),
+           "<getsha256digest %s", fh_cmd->xml_original_data + strlen("<program "));
+
+  fh_data->target_digest_valid = 0;
+  if (fh_send_cmd(fh_data, &fh_digest_cmd))
+    return -1;
+  if (fh_wait_response_cmd(fh_data, &fh_rx_cmd, 15000) != 0)
+    return -1;
+  if (strcmp(fh_rx_cmd.response.value, "ACK") || !fh_data->target_digest_valid)
+    return -1;
+
+  return 0;
+}
+
+static const char *fh_cmd_label(const struct fh_cmd *fh_cmd, char *label, size_t size)
+{
+  const char *pchar;
+
+  if (!strstr(fh_cmd->xml_original_data, " label="))
+    return NULL;
+  pchar = fh_xml_get_value(fh_cmd->xml_original_data, "label");
+  if (!pchar)
+    return NULL;
+  snprintf(label, size, "%s", pchar);
+  return label;
+}
+
+/* An erase is needed unless every program of its partition is unchanged */
+static int fh_erase_needed(struct fh_data *fh_data, const struct fh_cmd *erase_cmd)
+{
+  char erase_label[64];
+  char label[64];
+  int programs = 0;
+  unsigned x;
+
+  if (!fh_cmd_label(erase_cmd, erase_label, sizeof(erase_label)))
+    return 1;
+
+  for (x = 0; x < fh_data->fh_cmd_count; x++) {
+    const struct fh_cmd *fh_cmd = &fh_data->fh_cmd_table[x];
+    if (strcmp(fh_cmd->cmd.type, "program"))
+      continue;
+    if (!fh_cmd_label(fh_cmd, label, sizeof(label)) || strcmp(label, erase_label))
+      continue;
+    if (!fh_cmd->program.unchanged)
+      return 1;
+    programs++;
+  }
+
+  return programs == 0;
+}
+
+/*
+ * Compare the target's getsha256digest of every validated <program> range
+ * with a host side hash computed by worker threads while the USB link is
+ * busy with the earlier digest queries.
+ */
+static void fh_find_unchanged_programs(struct fh_data *fh_data)
+{
+  struct fh_hash_pool pool;
+  unsigned x, j, unchanged = 0;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.fh_data = fh_data;
+  pool.jobs = calloc(fh_data->fh_cmd_count, sizeof(struct fh_hash_job));
+  if (!pool.jobs)
+    return;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+
+  for (x = 0; x < fh_data->fh_cmd_count; x++) {
+    const struct fh_cmd *fh_cmd = &fh_data->fh_cmd_table[x];
+    if (strcmp(fh_cmd->cmd.type, "program") || !fh_cmd->program.validated || fh_program_is_sparse(fh_cmd))
+      continue;
+    pool.jobs[pool.njobs].fh_cmd = fh_cmd;
+    pool.jobs[pool.njobs].length = (uint64_t)fh_cmd->program.num_partition_sectors * fh_cmd->program.SECTOR_SIZE_IN_BYTES;
+    pool.njobs++;
+  }
+
+  for (j = 0; j < MIN(pool.njobs, FH_HASH_THREADS); j++) {
+    if (pthread_create(&pool.threads[j], NULL, fh_hash_worker, &pool))
+      break;
+    pool.nthreads++;
+  }
+  if (pool.nthreads == 0)
+    pool.njobs = 0;
+
+  for (j = 0; j < pool.njobs; j++) {
+    struct fh_hash_job *job = &pool.jobs[j];
+    struct fh_cmd *fh_cmd = (struct fh_cmd *)job->fh_cmd;
+
+    if (fh_query_target_digest(fh_data, fh_cmd)) {
+      printf("FIREHOSE: no digest for %s, it will be flashed\n", fh_cmd->program.filename);
+      continue;
+    }
+    if (fh_hash_wait(&pool, job) != 1)
+      continue;
+    if (!memcmp(job->digest, fh_data->target_digest, SHA256_DIGEST_SIZE)) {
+      fh_cmd->program.unchanged = 1;
+      unchanged++;
+    }
+  }
+
+  for (j = 0; j < pool.nthreads; j++)
+    pthread_join(pool.threads[j], NULL);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.cond);
+  free(pool.jobs);
+
+  /* a partition that still gets erased has to be programmed again */
+  for (x = 0; x < fh_data->fh_cmd_count; x++) {
+    const struct fh_cmd *erase_cmd = &fh_data->fh_cmd_table[x];
+    char erase_label[64];
+    char label[64];
+    unsigned y;
+
+    if (strcmp(erase_cmd->cmd.type, "erase") || erase_cmd->erase.SECTOR_SIZE_IN_BYTES == 0)
+      continue;
+    if (!fh_erase_needed(fh_data, erase_cmd))
+      continue;
+
+    for (y = 0; y < fh_data->fh_cmd_count; y++) {
+      struct fh_cmd *fh_cmd = &fh_data->fh_cmd_table[y];
+      if (strcmp(fh_cmd->cmd.type, "program") || !fh_cmd->program.unchanged)
+        continue;
+      if (fh_cmd_label(erase_cmd, erase_label, sizeof(erase_label))
+          && (!fh_cmd_label(fh_cmd, label, sizeof(label)) || strcmp(label, erase_label)))
+        continue;
+      fh_cmd->program.unchanged = 0;
+      unchanged--;
+    }
+  }
+
+  printf("FIREHOSE: %u of %u images already match the target\n", unchanged, pool.njobs);
+}
+
+static void fh_print_stats(const struct fh_data *fh_data)
+{
+  const struct fh_stats *stats = &fh_data->stats;
+  uint64_t elapsed = qdl_time_usec() - stats->start_usec;
+
+  if (elapsed == 0)
+    elapsed = 1;
+
+  printf("FIREHOSE: %u images programmed, %u skipped, %llu bytes in %llu.%03llu s (%llu KiB/s), MaxPayloadSizeToTargetInBytes %u\n",
+         stats->programs, stats->skipped, (unsigned long long)stats->bytes_sent,
+         (unsigned long long)(elapsed / 1000000), (unsigned long long)(elapsed % 1000000) / 1000,
+         (unsigned long long)(stats->bytes_sent * 1000000 / 1024 / elapsed),
+         stats->MaxPayloadSizeToTargetInBytes);
+}
+
 static int fh_send_reset_cmd(struct fh_data *fh_data)
 {
   struct fh_cmd fh_reset_cmd;
@@ -646,9 +1642,42 @@ static int fh_send_reset_cmd(struct fh_data *fh_data)
   return fh_send_cmd(fh_data, &fh_reset_cmd);
 }
 
+/*
+ * Call fn with the filename of every <program> of a rawprogram XML, in XML
+ * order and relative to the firmware directory, until it returns non-zero.
+ */
+int fh_xml_program_files(const char *xml_file, int (*fn)(void *user, const char *name), void *user)
+{
+  char line[1024];
+  int ret = 0;
+  FILE *fp;
+
+  fp = bundle_fopen(xml_file);
+  if (!fp)
+    return -1;
+  while (!ret && fgets(line, sizeof(line), fp)) {
+    char *name = strstr(line, "<program ");
+    char *end;
+
+    if (!name || strstr(line, "<!--") || !(name = strstr(name, "filename=\"")))
+      continue;
+    name += strlen("filename=\"");
+    end = strchr(name, '"');
+    if (!end || end == name)
+      continue;
+    *end = 0;
+    /* DOS paths, as fh_program_path() reads them */
+    for (end = name; (end = strchr(end, '\\')); )
+      *end = '/';
+    ret = fn(user, name);
+  }
+  fclose(fp);
+  return ret;
+}
+
 static int fh_parse_xml_file(struct fh_data *fh_data, const char *xml_file)
 {
-  FILE *fp = fopen(xml_file, "rb");
+  FILE *fp = bundle_fopen(xml_file);
   
   if (fp == NULL) {
     printf("%s fail to fopen(%s), errno: %d (%s)\n", __func__, xml_file, errno, strerror(errno));
@@ -725,6 +1754,291 @@ static int fh_parse_xml_file(struct fh_data *fh_data, const char *xml_file)
   return 0;
 }
 
+/*
+ * Flash plan cache: the commands of the rawprogram XML after parsing and
+ * validation, so a repeated flash of the same bundle neither parses the XML
+ * nor opens the images. It is keyed by the stat() of the XML and of every
+ * image, and rebuilt whenever one of them changes.
+ */
+#define FH_PLAN_ERASE   1
+#define FH_PLAN_PROGRAM 2
+#define FH_PLAN_PATCH   3
+
+static int fh_plan_stat(const char *path, struct fh_plan_key *key)
+{
+  struct stat st;
+
+  memset(key, 0, sizeof(struct fh_plan_key));
+  if (!path || stat(path, &st))
+    return -1;
+
+  key->size = st.st_size;
+  key->ino = st.st_ino;
+  key->mtime_sec = st.st_mtim.tv_sec;
+  key->mtime_nsec = st.st_mtim.tv_nsec;
+  return 0;
+}
+
+static char *fh_plan_read_string(FILE *fp, uint16_t len)
+{
+  char *str;
+
+  if (len == 0)
+    return NULL;
+  str = malloc(len);
+  if (!str)
+    return NULL;
+  if (fread(str, 1, len, fp) != len || str[len - 1] != '\0') {
+    free(str);
+    return NULL;
+  }
+  return str;
+}
+
+static void fh_release_cmd_table(struct fh_data *fh_data)
+{
+  unsigned x;
+
+  for (x = 0; x < fh_data->fh_cmd_count; x++) {
+    struct fh_cmd *fh_cmd = &fh_data->fh_cmd_table[x];
+    if (fh_cmd->program.type && !strcmp(fh_cmd->program.type, "program")) {
+      free(fh_cmd->program.filename);
+      free(fh_cmd->program.sparse);
+      free(fh_cmd->program.path);
+    }
+  }
+  memset(fh_data->fh_cmd_table, 0, sizeof(fh_data->fh_cmd_table));
+  fh_data->fh_cmd_count = 0;
+  fh_data->fh_patch_count = 0;
+}
+
+static int fh_plan_load_record(FILE *fp, struct fh_cmd *fh_cmd)
+{
+  struct fh_plan_record rec;
+  struct fh_plan_key key;
+  char *str[4];
+  int i, ret = -1;
+
+  if (fread(&rec, sizeof(rec), 1, fp) != 1)
+    return -1;
+  for (i = 0; i < 4; i++)
+    str[i] = fh_plan_read_string(fp, rec.str_len[i]);
+  if (!str[3] || rec.str_len[3] > sizeof(fh_cmd->xml_original_data))
+    goto EXIT;
+
+  memset(fh_cmd, 0, sizeof(struct fh_cmd));
+  strcpy(fh_cmd->xml_original_data, str[3]);
+  fh_cmd->part_upgrade = rec.part_upgrade;
+
+  switch (rec.kind) {
+  case FH_PLAN_ERASE:
+    fh_cmd->erase.type = "erase";
+    fh_cmd->erase.SECTOR_SIZE_IN_BYTES = rec.sector_size;
+    fh_cmd->erase.start_sector = rec.start_sector;
+    fh_cmd->erase.last_sector = rec.last_sector;
+    fh_cmd->erase.num_partition_sectors = rec.num_partition_sectors;
+    break;
+  case FH_PLAN_PROGRAM:
+    /* an image that changed since the plan was written invalidates the plan */
+    fh_plan_stat(str[2], &key);
+    if (!str[0] || memcmp(&key, &rec.image_key, sizeof(key)))
+      goto EXIT;
+    fh_cmd->program.type = "program";
+    fh_cmd->program.filename = str[0];
+    fh_cmd->program.sparse = str[1];
+    fh_cmd->program.path = str[2];
+    str[0] = str[1] = str[2] = NULL;
+    fh_cmd->program.validated = rec.validated;
+    fh_cmd->program.SECTOR_SIZE_IN_BYTES = rec.sector_size;
+    fh_cmd->program.start_sector = rec.start_sector;
+    fh_cmd->program.num_partition_sectors = rec.num_partition_sectors;
+    fh_cmd->program.physical_partition_number = rec.physical_partition_number;
+    fh_cmd->program.file_sector_offset = rec.file_sector_offset;
+    fh_cmd->program.filesz = rec.filesz;
+    fh_cmd->program.UNSPARSE_FILE_SIZE = rec.unsparse_size;
+    break;
+  case FH_PLAN_PATCH:
+    fh_cmd->patch.type = "patch";
+    break;
+  default:
+    goto EXIT;
+  }
+  ret = 0;
+
+EXIT:
+  for (i = 0; i < 4; i++)
+    free(str[i]);
+  return ret;
+}
+
+static int fh_plan_load(struct fh_data *fh_data, const char *xml_file, const char *plan_file)
+{
+  struct fh_plan_header hdr;
+  struct fh_plan_key key;
+  FILE *fp;
+  unsigned x;
+
+  if (fh_plan_stat(xml_file, &key))
+    return -1;
+
+  fp = fopen(plan_file, "rb");
+  if (!fp)
+    return -1;
+
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+      || memcmp(hdr.magic, FH_PLAN_MAGIC, sizeof(hdr.magic))
+      || hdr.record_size != sizeof(struct fh_plan_record)
+      || hdr.cmd_count > sizeof(fh_data->fh_cmd_table) / sizeof(fh_data->fh_cmd_table[0])
+      || memcmp(&hdr.xml_key, &key, sizeof(key))) {
+    fclose(fp);
+    return -1;
+  }
+
+  for (x = 0; x < hdr.cmd_count; x++) {
+    if (fh_plan_load_record(fp, &fh_data->fh_cmd_table[x])) {
+      fclose(fp);
+      fh_release_cmd_table(fh_data);
+      return -1;
+    }
+    fh_data->fh_cmd_count++;
+  }
+  fh_data->fh_patch_count = hdr.patch_count;
+
+  fclose(fp);
+  return 0;
+}
+
+static int fh_plan_write_string(FILE *fp, const char *str)
+{
+  if (!str)
+    return 0;
+  return fwrite(str, 1, strlen(str) + 1, fp) == strlen(str) + 1 ? 0 : -1;
+}
+
+static int fh_plan_save(struct fh_data *fh_data, const char *xml_file, const char *plan_file)
+{
+  char tmp_file[PATH_LENGTH + 32];
+  struct fh_plan_header hdr;
+  FILE *fp;
+  unsigned x;
+  int ret = -1;
+  int fd;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, FH_PLAN_MAGIC, sizeof(hdr.magic));
+  hdr.record_size = sizeof(struct fh_plan_record);
+  hdr.cmd_count = fh_data->fh_cmd_count;
+  hdr.patch_count = fh_data->fh_patch_count;
+  if (fh_plan_stat(xml_file, &hdr.xml_key))
+    return -1;
+
+  fd = file_replace_open(plan_file, tmp_file, sizeof(tmp_file));
+  fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!fp) {
+    printf("FIREHOSE: cannot cache flash plan in %s, errno: %d (%s)\n", plan_file, errno, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      file_replace_commit(tmp_file, plan_file, 0);
+    }
+    return -1;
+  }
+
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+    goto EXIT;
+
+  for (x = 0; x < fh_data->fh_cmd_count; x++) {
+    const struct fh_cmd *fh_cmd = &fh_data->fh_cmd_table[x];
+    struct fh_plan_record rec;
+    const char *str[4] = { NULL, NULL, NULL, fh_cmd->xml_original_data };
+    int i;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.part_upgrade = fh_cmd->part_upgrade;
+    if (!strcmp(fh_cmd->cmd.type, "erase")) {
+      rec.kind = FH_PLAN_ERASE;
+      rec.sector_size = fh_cmd->erase.SECTOR_SIZE_IN_BYTES;
+      rec.start_sector = fh_cmd->erase.start_sector;
+      rec.last_sector = fh_cmd->erase.last_sector;
+      rec.num_partition_sectors = fh_cmd->erase.num_partition_sectors;
+    } else if (!strcmp(fh_cmd->cmd.type, "program")) {
+      rec.kind = FH_PLAN_PROGRAM;
+      rec.validated = fh_cmd->program.validated;
+      rec.sector_size = fh_cmd->program.SECTOR_SIZE_IN_BYTES;
+      rec.start_sector = fh_cmd->program.start_sector;
+      rec.num_partition_sectors = fh_cmd->program.num_partition_sectors;
+      rec.physical_partition_number = fh_cmd->program.physical_partition_number;
+      rec.file_sector_offset = fh_cmd->program.file_sector_offset;
+      rec.filesz = fh_cmd->program.filesz;
+      rec.unsparse_size = fh_cmd->program.UNSPARSE_FILE_SIZE;
+      fh_plan_stat(fh_cmd->program.path, &rec.image_key);
+      str[0] = fh_cmd->program.filename;
+      str[1] = fh_cmd->program.sparse;
+      str[2] = fh_cmd->program.path;
+    } else {
+      rec.kind = FH_PLAN_PATCH;
+    }
+    for (i = 0; i < 4; i++)
+      rec.str_len[i] = str[i] ? strlen(str[i]) + 1 : 0;
+
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+      goto EXIT;
+    for (i = 0; i < 4; i++) {
+      if (fh_plan_write_string(fp, str[i]))
+        goto EXIT;
+    }
+  }
+  ret = 0;
+
+EXIT:
+  if (fclose(fp))
+    ret = -1;
+  ret = file_replace_commit(tmp_file, plan_file, ret == 0);
+  if (ret)
+    printf("FIREHOSE: cannot cache flash plan in %s, errno: %d (%s)\n", plan_file, errno, strerror(errno));
+  return ret;
+}
+
+/* Load the cached plan, or parse and validate the XML and cache the result */
+static int fh_prepare_plan(struct fh_data *fh_data, const char *xml_file)
+{
+  const struct bundle_entry *entry;
+  struct bundle *bundle;
+  char plan_file[PATH_LENGTH];
+  int in_bundle;
+
+  /* a bundle cannot hold the cache, nor does it need one: validating from its index is cheap */
+  in_bundle = bundle_resolve(xml_file, &bundle, &entry) > 0;
+  bundle_put(bundle);
+
+  snprintf(plan_file, sizeof(plan_file), "%s/%s", fh_data->firehose_dir, FH_PLAN_FILE);
+  if (!in_bundle && !fh_plan_load(fh_data, xml_file, plan_file)) {
+    printf("FIREHOSE: using cached flash plan %s (%u commands)\n", plan_file, fh_data->fh_cmd_count);
+    return 0;
+  }
+
+  if (fh_parse_xml_file(fh_data, xml_file))
+    return -1;
+
+  // Before doing anything the commands need repairs
+  // Sometimes the configuration does not match reality when is about file size
+  for (unsigned int x = 0; x < fh_data->fh_cmd_count; x++) {
+    struct fh_cmd *fh_cmd = &fh_data->fh_cmd_table[x];
+    if (strcmp(fh_cmd->cmd.type, "program"))
+      continue;
+    if (fh_cmd->program.start_sector != 0)
+      continue;
+    if (fh_validate_program_cmd(fh_data, fh_cmd)!= 0) {
+      printf("FIREHOSE: cannot flash this file\n");
+      continue;
+    }
+    fh_cmd->program.validated = 1;
+  }
+
+  if (!in_bundle)
+    fh_plan_save(fh_data, xml_file, plan_file);
+  return 0;
+}
+
 int firehose_main(const char *firehose_dir, struct qdl_device *qdl)
 {
 
@@ -732,6 +2046,7 @@ int firehose_main(const char *firehose_dir, struct qdl_device *qdl)
   struct fh_cmd fh_rx_cmd;
   struct fh_data *fh_data;
   int i = 0;
+  int ret = 0;
   memset(firehose_file, 0 , PATH_LENGTH);
 
   fh_data  = (struct fh_data *)malloc(sizeof(struct fh_data));
@@ -747,13 +2062,11 @@ int firehose_main(const char *firehose_dir, struct qdl_device *qdl)
   fh_data->xml_tx_size = sizeof(fh_data->xml_tx_buf);
   fh_data->xml_rx_size = sizeof(fh_data->xml_rx_buf);
   fh_data->ZlpAwareHost = 1;
+  fh_data->urb_queue_depth = FH_URB_QUEUE_DEPTH;
 
   snprintf(firehose_file, PATH_LENGTH, "%s/%s", firehose_dir, RAW_PROGRAM_FILE);
   printf("FIREHOSE: looking for the firehose file in : %s\n", firehose_file);
-  fh_parse_xml_file(fh_data, firehose_file);
-
-  // Before doing anything the commands need repairs
-  // Sometimes the configuration does not match reality when is about file size
+  fh_prepare_plan(fh_data, firehose_file);
 
    usleep(300000);
 
@@ -763,12 +2076,17 @@ int firehose_main(const char *firehose_dir, struct qdl_device *qdl)
   };
 
   printf("Start sending commands!\n");
+  fh_data->stats.start_usec = qdl_time_usec();
   // Send configuration data
   if (fh_send_cfg_cmd(fh_data)) {
     printf("FIREHOSE configuration failed. Bailing out now \n");
-    return -1;
+    ret = -1;
+    goto EXIT;
   }
 
+  if (fh_skip_unchanged)
+    fh_find_unchanged_programs(fh_data);
+
   //Apply all erase commands first
  
   for (unsigned int x = 0; x < fh_data->fh_cmd_count; x++) {
@@ -777,6 +2095,10 @@ int firehose_main(const char *firehose_dir, struct qdl_device *qdl)
       continue;
     if (fh_cmd->erase.SECTOR_SIZE_IN_BYTES == 0) 
       continue;
+    if (fh_skip_unchanged && !fh_erase_needed(fh_data, fh_cmd)) {
+      printf("FIREHOSE: partition unchanged, skipping erase\n");
+      continue;
+    }
     if (fh_process_erase(fh_data, fh_cmd)) {
       printf("FIREHOSE: cannot apply erase commands");
     } 
@@ -788,20 +2110,29 @@ int firehose_main(const char *firehose_dir, struct qdl_device *qdl)
     struct fh_cmd *fh_cmd = &fh_data->fh_cmd_table[x];
     if (!strstr(fh_cmd->cmd.type, "program"))
       continue;
-    if (fh_cmd->program.start_sector != 0)
+    if (!fh_cmd->program.validated)
       continue;
-    if (fh_validate_program_cmd(fh_data, fh_cmd)!= 0) {
-      printf("FIREHOSE: cannot flash this file\n");
+    qdl_target_report(qdl->target, NULL, x * 100 / fh_data->fh_cmd_count);
+    if (fh_cmd->program.unchanged) {
+      printf("FIREHOSE: %s unchanged, skipping\n", fh_cmd->program.filename);
+      fh_data->stats.skipped++;
       continue;
-    } 
+    }
     fh_process_program(fh_data, fh_cmd);
   }
+  qdl_target_report(qdl->target, NULL, 100);
+
+  fh_print_stats(fh_data);
 
   // Job done reset the target now
 
   fh_send_reset_cmd(fh_data);
   if (fh_wait_response_cmd(fh_data, &fh_rx_cmd, 3000) != 0) {
-    return -5;
+    ret = -5;
   }
-  return 0;
+
+EXIT:
+  fh_release_cmd_table(fh_data);
+  free(fh_data);
+  return ret;
 }
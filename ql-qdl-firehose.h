@@ -17,12 +17,38 @@
 #ifndef _QL_QDL_FIREHOSE_H_
 #define _QL_QDL_FIREHOSE_H_
 #include "ql-sahara-core.h"
+#include "ql-sha256.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #define RAW_PROGRAM_FILE "rawprogram_nand_p2K_b128K_recovery.xml"
 
 
 #define SPARSE_HEADER_MAGIC 0xed26ff3a
 
+/* Number of bulk URBs kept in flight while streaming raw-mode images */
+#ifndef FH_URB_QUEUE_DEPTH
+#define FH_URB_QUEUE_DEPTH 8
+#endif
+#define FH_MAX_URB_QUEUE_DEPTH 16
+
+/* Payload sizes tried when negotiating the configure command */
+#define FH_MAX_PAYLOAD_TO_TARGET (1024 * 1024)
+#define FH_MIN_PAYLOAD_TO_TARGET 8192
+/* usbfs memory (16 MiB by default) shared by all queued URBs */
+#define FH_URB_MEMORY_BUDGET (8 * 1024 * 1024)
+
+/* Response buffer, it must hold a complete <data> document */
+#define FH_RX_BUF_SIZE 8192
+#define FH_RX_READ_SIZE 1024
+
+/* Host side hashing threads used by the skip-unchanged mode */
+#define FH_HASH_THREADS 4
+
+/* Parsed and validated rawprogram XML, cached next to the firmware */
+#define FH_PLAN_FILE ".rawprogram.plan"
+#define FH_PLAN_MAGIC "QFHPLAN1"
+
 typedef struct sparse_header
 {
   uint32_t magic;         /* 0xed26ff3a */
@@ -47,6 +73,18 @@ typedef struct chunk_header {
   uint32_t total_sz; /* in bytes of chunk input file including chunk header and data */
 } chunk_header_t;
 
+#define CHUNK_TYPE_RAW       0xCAC1
+#define CHUNK_TYPE_FILL      0xCAC2
+#define CHUNK_TYPE_DONT_CARE 0xCAC3
+#define CHUNK_TYPE_CRC32     0xCAC4
+
+#define SPARSE_MAX_RUNS 100
+
+/*
+ * A sparse image is flashed as a list of runs of RAW/FILL chunks.
+ * chunk_polymerization_cac3[k] holds the don't-care gap in front of
+ * chunk_polymerization_data[k]; gaps are never sent to the target.
+ */
 typedef struct chunk_polymerization_params {
   uint32_t total_chunk_sz;
   uint32_t total_sz;
@@ -101,6 +139,9 @@ struct fh_program_cmd {
     uint32_t file_sector_offset;
     uint32_t UNSPARSE_FILE_SIZE;
     //char sparse[16];
+    char *path;
+    int validated;
+    int unchanged;
 };
 
 struct fh_response_cmd {
@@ -108,6 +149,7 @@ struct fh_response_cmd {
     const char *value;
     uint32_t rawmode;
     uint32_t MaxPayloadSizeToTargetInBytes;
+    uint32_t MaxPayloadSizeToTargetInBytesSupported;
 };
 
 struct fh_log_cmd {
@@ -145,6 +187,124 @@ struct fh_cmd {
     char xml_original_data[512];
 };
 
+#define FH_SLOT_FREE      0
+#define FH_SLOT_FILLING   1 /* owned by the reader thread */
+#define FH_SLOT_FILLED    2 /* waiting to be submitted */
+#define FH_SLOT_IN_FLIGHT 3 /* queued on the OUT endpoint */
+
+struct fh_urb_slot {
+    struct usbdevfs_urb urb;
+    void *buf;
+    size_t len;
+    int state;
+};
+
+struct fh_raw_source;
+
+/*
+ * Ring of aligned buffers shared by the reader thread, which fills them in
+ * order, and the USB thread, which submits them as URBs and hands them back
+ * once reaped.
+ */
+struct fh_urb_pipe {
+    struct qdl_device *qdl;
+    struct fh_urb_slot slots[FH_MAX_URB_QUEUE_DEPTH];
+    unsigned depth;
+    unsigned in_flight;
+    size_t buf_size;
+    int error;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int event_fd;
+    struct fh_raw_source *src;
+    uint32_t sector_size;
+    unsigned filled;
+    unsigned submitted;
+    int reader_done;
+    int reader_error;
+    int abort;
+};
+
+struct zimage;
+
+/* Producer of the bytes streamed to the target in raw mode */
+struct fh_raw_source {
+    size_t (*read)(struct fh_raw_source *src, void *buf, size_t len);
+    size_t size;
+    FILE *fp;
+    /* a zstd seekable file, read at pos */
+    struct zimage *z;
+    uint64_t pos;
+    /* sparse run state */
+    const sparse_header_t *sparse_hdr;
+    chunk_header_t chunk;
+    unsigned chunks_left;
+    uint32_t chunk_left;
+    uint32_t chunk_pos;
+    uint32_t fill_value;
+};
+
+struct fh_hash_job {
+    const struct fh_cmd *fh_cmd;
+    uint64_t length;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    int state; /* 0 pending, 1 done, -1 failed */
+};
+
+struct fh_hash_pool {
+    struct fh_data *fh_data;
+    pthread_t threads[FH_HASH_THREADS];
+    unsigned nthreads;
+    struct fh_hash_job *jobs;
+    unsigned njobs;
+    unsigned next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Identifies a file revision without reading it */
+struct fh_plan_key {
+    uint64_t size;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct fh_plan_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t cmd_count;
+    uint32_t patch_count;
+    uint32_t reserved;
+    struct fh_plan_key xml_key;
+};
+
+/* One command, followed by its filename, sparse, path and xml strings */
+struct fh_plan_record {
+    uint32_t kind;
+    uint32_t part_upgrade;
+    uint32_t validated;
+    uint32_t sector_size;
+    uint32_t start_sector;
+    uint32_t last_sector;
+    uint32_t num_partition_sectors;
+    uint32_t physical_partition_number;
+    uint32_t file_sector_offset;
+    uint32_t filesz;
+    uint32_t unsparse_size;
+    uint16_t str_len[4];
+    struct fh_plan_key image_key;
+};
+
+struct fh_stats {
+    uint64_t start_usec;
+    uint64_t bytes_sent;
+    unsigned programs;
+    unsigned skipped;
+    unsigned MaxPayloadSizeToTargetInBytes;
+};
+
 struct fh_data {
     const char *firehose_dir;
     struct qdl_device* usb_handle;
@@ -152,14 +312,27 @@ struct fh_data {
     unsigned fh_cmd_count;
     unsigned fh_patch_count;
     unsigned ZlpAwareHost;
+    unsigned urb_queue_depth;
     struct fh_cmd fh_cmd_table[256]; //AG525 have more than 64 partition
+    SparseImgParam sparse;
+    uint8_t target_digest[SHA256_DIGEST_SIZE];
+    int target_digest_valid;
+    struct fh_stats stats;
     unsigned xml_tx_size;
     unsigned xml_rx_size;
     char xml_tx_buf[1024];
-    char xml_rx_buf[1024];
+    /* responses accumulate here until a whole <?xml ... </data> has arrived */
+    size_t rx_start;
+    size_t rx_end;
+    size_t rx_scan;
+    char xml_rx_buf[FH_RX_BUF_SIZE];
 };
 
 
+extern int fh_skip_unchanged;
+extern unsigned fh_max_payload;
+
 int firehose_main(const char *firehose_dir, struct qdl_device *qdl);
+int fh_xml_program_files(const char *xml_file, int (*fn)(void *user, const char *name), void *user);
 
 #endif
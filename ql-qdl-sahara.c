@@ -16,6 +16,8 @@
 
 #include "ql-qdl-sahara.h"
 #include "ql-qdl-firehose.h"
+#include "ql-usb-index.h"
+#include "ql-bundle.h"
 #include <stdio.h>
 #include <libgen.h>
 
@@ -55,9 +57,17 @@ int start_program_transfer(struct qdl_device *qdl ,  struct sahara_pkt *pkt ,FIL
   uint32_t nBytesToRead;
   uint32_t readOffset = le_uint32(pkt->read_req.offset);
   uint32_t readLen = le_uint32(pkt->read_req.length);
-  void* tx_buffer = (void*)malloc(QBUFFER_SIZE);
+  uint32_t chunk_size = QBUFFER_SIZE;
+  void* tx_buffer;
 
-  memset(tx_buffer, 0, QBUFFER_SIZE);
+  if (qdl->xfer_mode == QDL_XFER_LARGE && readLen > QBUFFER_SIZE)
+    chunk_size = MIN(readLen, QDL_MAX_BULK_XFER);
+
+  tx_buffer = malloc(chunk_size);
+  if (!tx_buffer)
+    return -1;
+
+  memset(tx_buffer, 0, chunk_size);
   printf("%s: Image id: 0x%08x offset: 0x%08x length :0x%08x\n", __FUNCTION__ ,
          le_uint32(pkt->read_req.image),
          readOffset,
@@ -65,28 +75,37 @@ int start_program_transfer(struct qdl_device *qdl ,  struct sahara_pkt *pkt ,FIL
 
   if (fseek(file_handle, (long)readOffset, SEEK_SET)) {
     printf("%d errno: %d (%s)\n", __LINE__, errno, strerror(errno));
+    free(tx_buffer);
     return -1;
   }
 
   while(nBytesRead < readLen) {
-    nBytesToRead = MIN((uint32_t)readLen - nBytesRead, QBUFFER_SIZE);
+    nBytesToRead = MIN((uint32_t)readLen - nBytesRead, chunk_size);
     retval = fread(tx_buffer, 1, nBytesToRead, file_handle);
     if (retval < 0) {
       printf("file read failed: %s\n", strerror(errno));
+      free(tx_buffer);
       return -2;
     }
     // Transmit the data
-    if (0 == qdl_write(qdl, tx_buffer, nBytesToRead)) {
+    if (qdl_write(qdl, tx_buffer, nBytesToRead) <= 0) {
       dbg("Tx Sahara Image Failed\n");
+      free(tx_buffer);
       return 0;
     }
     nBytesRead += nBytesToRead;
 
   }
+  free(tx_buffer);
   return 0;
 }
 
 int qdl_flash_all(char * main_file_path,char*  oem_file_path,char* carrier_file_path)
+{
+  return qdl_flash_target(NULL, main_file_path, oem_file_path, carrier_file_path);
+}
+
+int qdl_flash_target(struct qdl_target *target, char *main_file_path, char *oem_file_path, char *carrier_file_path)
 {
   struct qdl_device qdl;
   int ret;
@@ -96,6 +115,7 @@ int qdl_flash_all(char * main_file_path,char*  oem_file_path,char* carrier_file_
   int done = 0;
   char full_programmer_path[PATH_LENGTH];
   FILE* file_handle = NULL;
+  uint64_t start_usec;
 
   memset(full_programmer_path, 0,PATH_LENGTH);
 
@@ -105,9 +125,9 @@ int qdl_flash_all(char * main_file_path,char*  oem_file_path,char* carrier_file_
   if (oem_file_path) {
     printf("oem: %s\n", oem_file_path);
     dirname(oem_file_path);
-    sprintf(full_programmer_path , "%s/%s", oem_file_path, "prog_nand_firehose_9x55.mbn" );
+    sprintf(full_programmer_path , "%s/%s", oem_file_path, QDL_PROGRAMMER_FILE);
     printf("programmer path : %s\n", full_programmer_path);
-    file_handle = fopen(full_programmer_path, "rb");
+    file_handle = bundle_fopen(full_programmer_path);
     if (file_handle == NULL) {
       printf("%s %d %s errno: %d (%s)", __func__, __LINE__, full_programmer_path, errno, strerror(errno));
       return ENOENT;
@@ -118,10 +138,15 @@ int qdl_flash_all(char * main_file_path,char*  oem_file_path,char* carrier_file_
     printf("oem: %s\n", carrier_file_path);
   }
 
-  ret = qdl_open(&qdl);
+  ret = qdl_open_target(&qdl, target);
 
   if (ret == SWITCHED_TO_EDL) {
     printf("%s : the device is EDL mode \n",__FUNCTION__);
+  } else if (ret != SWITCHED_TO_SBL) {
+    printf("%s : no device to flash\n", __FUNCTION__);
+    if (file_handle)
+      fclose(file_handle);
+    return -ENODEV;
   }
   
   memset(buffer, 0 , QBUFFER_SIZE );
@@ -131,10 +156,13 @@ int qdl_flash_all(char * main_file_path,char*  oem_file_path,char* carrier_file_
   if (le_uint32(pspkt->cmd) != 0x01) {
     printf("Received a different command: %x while waiting for hello packet \n Bytes received %d\n", pspkt->cmd, nBytes);
     qdl_close(&qdl);
+    if (file_handle)
+      fclose(file_handle);
     return -1;
   }
 
   sahara_hello(&qdl, pspkt);
+  start_usec = qdl_time_usec();
   while (!done) {
     memset(buffer, 0 , QBUFFER_SIZE );
     nBytes = sahara_rx_data(&qdl, buffer, 0);
@@ -165,8 +193,14 @@ int qdl_flash_all(char * main_file_path,char*  oem_file_path,char* carrier_file_
     }
   }
 
-  firehose_main(oem_file_path,&qdl);
+  qdl_print_tx_stats(&qdl, start_usec);
+  if (file_handle)
+    fclose(file_handle);
+  ret = firehose_main(oem_file_path,&qdl);
 
   qdl_close(&qdl);
-  return 0;
+  /* a modem flashed by port was never looked up in the shared index */
+  if (!target || !target->port)
+    usb_index_invalidate();
+  return ret;
 }
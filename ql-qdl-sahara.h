@@ -17,9 +17,13 @@
 #define __QL_QDL_SAHARA_H_
 #include "ql-sahara-core.h"
 
+/* Firehose programmer of an EDL recovery, next to the oem image */
+#define QDL_PROGRAMMER_FILE "prog_nand_firehose_9x55.mbn"
+
 void sahara_hello(struct qdl_device *qdl, struct sahara_pkt *pkt);
 int sahara_done(struct qdl_device *qdl);
 int qdl_flash_all(char * main_file_path,char*  oem_file_path,char* carrier_file_path);
+int qdl_flash_target(struct qdl_target *target, char *main_file_path, char *oem_file_path, char *carrier_file_path);
 int start_program_transfer(struct qdl_device *qdl ,  struct sahara_pkt *pkt ,FILE *file_handle);
 
 #endif
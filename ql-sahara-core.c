@@ -15,14 +15,17 @@
 */
 
 #include "ql-sahara-core.h"
+#include "ql-usb-index.h"
+#include "ql-zimage.h"
+#include "ql-bundle.h"
 
 
 #define dbg_time printf
 bool qdl_debug;
+int qdl_xfer_mode = QDL_XFER_LARGE;
 
 
-static FILE *create_reset_single_image(void);
-static int check_quec_usb_desc(int fd, struct qdl_device *qdl, int *intf);
+static int create_reset_single_image(struct sahara_image *img);
 
 const char *boot_sahara_cmd_id_str[QUEC_SAHARA_FW_UPDATE_END_ID+1] = {
         "SAHARA_NO_CMD_ID",               // = 0x00,
@@ -61,6 +64,73 @@ const char *boot_sahara_cmd_id_str[QUEC_SAHARA_FW_UPDATE_END_ID+1] = {
         "QUEC_SAHARA_FW_UPDATE_END_ID"
 };
 
+uint64_t qdl_time_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Files other processes read while we rewrite them are written aside and
+ * renamed over: readers see the old or the new file, never a partial one.
+ * The temporary name is unique per call, threads and contexts of one
+ * process included. Returns the fd of tmp_path, or -1.
+ */
+int file_replace_open(const char *path, char *tmp_path, size_t size)
+{
+    int fd;
+
+    if (snprintf(tmp_path, size, "%s.XXXXXX", path) >= (int)size)
+        return -1;
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    fchmod(fd, 0644);
+    return fd;
+}
+
+/* Rename tmp_path, already closed, over path if ok, else drop it */
+int file_replace_commit(const char *tmp_path, const char *path, int ok)
+{
+    if (ok && rename(tmp_path, path) == 0)
+        return 0;
+    unlink(tmp_path);
+    return -1;
+}
+
+/* Update where target has got, stage NULL or percent < 0 leave that part as is */
+void qdl_target_report(struct qdl_target *target, const char *stage, int percent)
+{
+    if (!target)
+        return;
+    if ((!stage || stage == target->stage) && (percent < 0 || percent == target->percent))
+        return;
+
+    if (stage)
+        target->stage = stage;
+    if (percent >= 0)
+        target->percent = percent;
+    if (target->progress)
+        target->progress(target);
+}
+
+void qdl_print_tx_stats(struct qdl_device *qdl, uint64_t start_usec)
+{
+    uint64_t elapsed = qdl_time_usec() - start_usec;
+
+    if (elapsed == 0)
+        elapsed = 1;
+
+    dbg("%s transfers: %zu bytes in %llu.%03llu s, %llu KiB/s, %lu write ioctls",
+        qdl->xfer_mode == QDL_XFER_LARGE ? "large" : "packet",
+        qdl->tx_bytes,
+        (unsigned long long)(elapsed / 1000000), (unsigned long long)(elapsed % 1000000) / 1000,
+        (unsigned long long)((uint64_t)qdl->tx_bytes * 1000000 / 1024 / elapsed),
+        qdl->tx_calls);
+}
+
 uint32_t le_uint32(uint32_t v32)
 {
     const uint32_t is_bigendian = 1;
@@ -129,135 +199,276 @@ void print_hex_dump(const char *prefix, const void *buf, size_t len)
 }
 
 
-FILE *create_reset_single_image(void)
+static int create_reset_single_image(struct sahara_image *img)
 {
-    int fd;
-    FILE *fp = NULL;
-
     struct single_image_hdr *img_hdr;
 
-    img_hdr = malloc(SINGLE_IMAGE_HDR_SIZE);
-    if (img_hdr == NULL)
-        return NULL;
-
-    memset(img_hdr, 0, SINGLE_IMAGE_HDR_SIZE);
+    img_hdr = mmap(NULL, SINGLE_IMAGE_HDR_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (img_hdr == MAP_FAILED)
+        return -1;
 
     img_hdr->magic[0] = 'R';
     img_hdr->magic[1] = 'S';
     img_hdr->magic[2] = 'T';
 
-    fd = open("/tmp", O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
-    if (fd < 0)
-        goto EXIT;
+    img->fd = -1;
+    img->base = (uint8_t *)img_hdr;
+    img->size = SINGLE_IMAGE_HDR_SIZE;
+    img->next_offset = 0;
+    return 0;
+}
 
-    fp = fdopen(fd, "w+");
 
-    if (fwrite(img_hdr, 1, SINGLE_IMAGE_HDR_SIZE, fp) != SINGLE_IMAGE_HDR_SIZE)
+/* The compressed bytes stay mapped by the zimage, fd can be closed */
+static int sahara_image_map_compressed(struct sahara_image *img, int fd, uint64_t offset, uint64_t length)
+{
+    img->z = (struct zimage *)malloc(sizeof(struct zimage));
+    if (!img->z || zimage_open(img->z, fd, offset, length, img->path))
     {
-        dbg("fail to write\n");
-        fclose(fp);
-        fp = NULL;
+        dbg("fail to decompress %s", img->path);
+        free(img->z);
+        img->z = NULL;
+        return -1;
     }
-    else 
+    img->base = img->z->base;
+    img->size = img->z->size;
+    if (img->size < SINGLE_IMAGE_HDR_SIZE)
     {
-        fseek(fp, 0, SEEK_SET);
+        dbg("%s is too small to be a single image", img->path);
+        return -1;
     }
+    return 0;
+}
 
-EXIT:
-    free(img_hdr);
-    return fp;
+static int sahara_image_map_bundle(struct sahara_image *img)
+{
+    uint64_t offset = bundle_entry_offset(img->entry);
+    uint64_t length = bundle_entry_length(img->entry);
+    const struct single_image_hdr *hdr;
+    uint64_t content_size;
+    int ret;
+
+    ret = zimage_probe(img->bundle->fd, offset, length, &content_size);
+    if (ret < 0)
+        dbg("%s has a broken seek table", img->path);
+    if (ret > 0)
+        ret = sahara_image_map_compressed(img, img->bundle->fd, offset, length);
+    if (ret)
+        return -1;
+    if (!img->z)
+    {
+        img->base = img->bundle->base + offset;
+        img->size = length;
+    }
+    if (img->size < SINGLE_IMAGE_HDR_SIZE)
+    {
+        dbg("%s is too small to be a single image", img->path);
+        return -1;
+    }
+    if (sahara_image_wait(img, 0, SINGLE_IMAGE_HDR_SIZE))
+        return -1;
+    hdr = (const struct single_image_hdr *)img->base;
+    /* every image of a bundle is for the modem named in its header */
+    if (img->bundle->hdr->module_id[0] && !memcmp(hdr->magic, "Quec", sizeof(hdr->magic))
+        && strncmp(hdr->module_id, img->bundle->hdr->module_id, sizeof(hdr->module_id)))
+    {
+        dbg("%s is for %.32s, the bundle for %.32s", img->path, hdr->module_id, img->bundle->hdr->module_id);
+        return -1;
+    }
+    return 0;
 }
 
+int sahara_image_map(struct sahara_image *img, const char *path)
+{
+    struct stat st;
+    uint64_t content_size;
+    void *base;
+    int ret;
+
+    memset(img, 0, sizeof(struct sahara_image));
+    img->path = path;
+    img->fd = -1;
 
-int interogate_usb_desc(int fd)
+    if (path == NULL)
+        return create_reset_single_image(img);
+
+    ret = bundle_resolve(path, &img->bundle, &img->entry);
+    if (ret > 0 && sahara_image_map_bundle(img))
+    {
+        sahara_image_unmap(img);
+        return -1;
+    }
+    if (ret < 0)
+        dbg("%s is not in the bundle", path);
+    if (ret)
+        return ret > 0 ? 0 : -1;
+
+    img->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (img->fd < 0)
+    {
+        dbg("fail to open %s, errno: %d (%s)", path, errno, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(img->fd, &st))
+    {
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    ret = zimage_probe(img->fd, 0, st.st_size, &content_size);
+    if (ret < 0)
+        dbg("%s has a broken seek table", path);
+    if (ret > 0)
+        ret = sahara_image_map_compressed(img, img->fd, 0, st.st_size);
+    if (ret)
+    {
+        sahara_image_unmap(img);
+        return -1;
+    }
+    if (img->z)
+    {
+        close(img->fd);
+        img->fd = -1;
+        return 0;
+    }
+
+    if (st.st_size < SINGLE_IMAGE_HDR_SIZE)
+    {
+        dbg("%s is too small to be a single image", path);
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, img->fd, 0);
+    if (base == MAP_FAILED)
+    {
+        dbg("fail to mmap %s, errno: %d (%s)", path, errno, strerror(errno));
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+
+    img->base = base;
+    img->size = st.st_size;
+    /* the target mostly walks the image front to back */
+    madvise(img->base, img->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+void sahara_image_unmap(struct sahara_image *img)
 {
-  const struct usb_device_descriptor *dev;
-  ssize_t nbytes;
-  void *baseline;
+    if (img->z)
+    {
+        zimage_close(img->z);
+        free(img->z);
+        img->z = NULL;
+    }
+    else if (img->base && !img->bundle)
+        munmap(img->base, img->size);
+    bundle_put(img->bundle);
+    img->bundle = NULL;
+    if (img->fd >= 0)
+        close(img->fd);
+    img->base = NULL;
+    img->fd = -1;
+}
 
-  char desc[1024];
+/* Wait until a range of a compressed image is decompressed, 0 at once for the others */
+int sahara_image_wait(const struct sahara_image *img, uint64_t offset, uint64_t length)
+{
+    return img->z ? zimage_wait(img->z, offset, length) : 0;
+}
 
-  nbytes = read(fd, desc, sizeof(desc));
-  if (nbytes < 0) {
-    return EINVAL;
-  }
+/*
+ * The main, oem and carrier versions ("MM.mmm") carried in the module_version
+ * of a single image header, in the same form as GET_FW_INFO reports them.
+ * -1 if the file has no header or the version is not in the usual format.
+ */
+int sahara_image_versions(const char *path, char main_version[16], char oem_version[16], char carrier_version[16])
+{
+    struct single_image_hdr hdr;
+    struct sahara_image img;
+    char module_version[sizeof(hdr.module_version) + 1];
+    int m1, m2, o1, o2, c1, c2;
+    char *p;
+
+    /* through sahara_image_map() so that compressed images are read too */
+    if (sahara_image_map(&img, path))
+        return -1;
+    if (sahara_image_wait(&img, 0, sizeof(hdr)))
+    {
+        sahara_image_unmap(&img);
+        return -1;
+    }
+    memcpy(&hdr, img.base, sizeof(hdr));
+    sahara_image_unmap(&img);
 
-  baseline = (void*)desc;
-  dev = baseline;
+    if (memcmp(hdr.magic, "Quec", sizeof(hdr.magic)))
+        return -1;
+    memcpy(module_version, hdr.module_version, sizeof(hdr.module_version));
+    module_version[sizeof(hdr.module_version)] = 0;
 
-  printf("Vendor 0x%x Product 0x%x\n", dev->idVendor, dev->idProduct);
-  /* Consider only devices with vid 0x2c7c (Quectel), 0x05c6 (Qualcom) or Netprisma */
-  if ((dev->idVendor != 0x2c7c) && (dev->idVendor != 0x05c6)  && (dev->idVendor != NP_VID ) ) {
-    return EINVAL;
-  }
- 
-  if (dev->idProduct == 0x9008) {
-    return SWITCHED_TO_EDL;
-  }
+    p = strrchr(module_version, '_');
+    if (!p || sscanf(p + 1, "%02d.%03d.%02d.%03d.%02d.%03d", &m1, &m2, &o1, &o2, &c1, &c2) != 6)
+        return -1;
 
-  return NORMAL_OPERATION;
+    snprintf(main_version, 16, "%02d.%03d", m1, m2);
+    snprintf(oem_version, 16, "%02d.%03d", o1, o2);
+    snprintf(carrier_version, 16, "%02d.%03d", c1, c2);
+    return 0;
+}
+
+static void sahara_image_advise(struct sahara_image *img, uint32_t offset, uint32_t length)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~((size_t)page_size - 1);
+    size_t end = (size_t)offset + length;
+
+    /*
+     * A request that continues the previous one means the target is streaming,
+     * so also fault in the next window of the same size ahead of its request.
+     */
+    if (offset == img->next_offset)
+        end += length;
+    if (end > img->size)
+        end = img->size;
+
+    madvise(img->base + start, end - start, MADV_WILLNEED);
+    img->next_offset = offset + length;
 }
 
 
+int flash_mode_check(void)
+{
+    if (!usb_index_get())
+    {
+        syslog(0, "could not open [/sys/bus/usb/devices] dir");
+        return -1;
+    }
+
+    if (usb_index_find(USB_INDEX_MODE(SWITCHED_TO_EDL)))
+        return SWITCHED_TO_EDL;
+    if (usb_index_find(USB_INDEX_MODE(SWITCHED_TO_SBL)))
+        return SWITCHED_TO_SBL;
+
+    return NORMAL_OPERATION;
+}
 
 int qdl_mode_check()
 {
-  struct udev *udev;
-  struct udev_monitor *mon;
-  struct udev_enumerate *enumerate;
+  const struct usb_index_device *dev = usb_index_find(USB_INDEX_ANY);
 
-  struct udev_list_entry *devices;
-  struct udev_list_entry *dev_list_entry;
+  if (dev == NULL)
+    return EINVAL;
 
-  struct udev_device *dev;
-  const char *dev_node;
+  printf("Vendor 0x%x Product 0x%x\n", dev->idVendor, dev->idProduct);
+  if (usb_index_find(USB_INDEX_MODE(SWITCHED_TO_EDL)))
+    return SWITCHED_TO_EDL;
 
-  const char *path;
-  int ret;
-  int fd;
-
-  udev = udev_new();
-  if (!udev) {
-    err(1, "failed to initialize udev");
-  }
-
-  mon = udev_monitor_new_from_netlink(udev, "udev");
-  udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", NULL);
-  udev_monitor_enable_receiving(mon);
-  enumerate = udev_enumerate_new(udev);
-  udev_enumerate_add_match_subsystem(enumerate, "usb");
-  udev_enumerate_scan_devices(enumerate);
-  devices = udev_enumerate_get_list_entry(enumerate);
-  udev_list_entry_foreach(dev_list_entry, devices)
-    {
-      path = udev_list_entry_get_name(dev_list_entry);
-      dev = udev_device_new_from_syspath(udev, path);
-      dev_node = udev_device_get_devnode(dev);
-
-      if (!dev_node)
-        {
-          continue;
-        }
-      fd = open(dev_node, O_RDWR);
-      if (fd < 0)
-        continue;
-      printf("D: %s \n", dev_node);
-      ret = interogate_usb_desc(fd);
-      close(fd);
-      if (ret!=EINVAL) {
-        udev_enumerate_unref(enumerate);
-        udev_monitor_unref(mon);
-        udev_unref(udev);
-        return ret;
-      }
-    }
-
-  udev_enumerate_unref(enumerate);
-  udev_monitor_unref(mon);
-  udev_unref(udev);
-  return ret;
-
-}  
+  return NORMAL_OPERATION;
+}
 
 int qdl_read(struct qdl_device *qdl, void *buf, size_t len, unsigned int timeout)
 {
@@ -279,18 +490,32 @@ int qdl_write(struct qdl_device *qdl, const void *buf, size_t len)
     struct usbdevfs_bulktransfer bulk = {};
     unsigned count = 0;
     size_t len_orig = len;
+    size_t max_xfer = qdl->out_maxpktsize;
     int n;
+
+    if (qdl->xfer_mode == QDL_XFER_LARGE)
+        max_xfer = qdl->max_xfer;
+
     while(len > 0)
     {
         int xfer;
-        xfer = (len > qdl->out_maxpktsize) ? qdl->out_maxpktsize : len;
+        xfer = (len > max_xfer) ? max_xfer : len;
 
         bulk.ep = qdl->out_ep;
         bulk.len = xfer;
         bulk.data = data;
-        bulk.timeout = 1000;
+        bulk.timeout = (qdl->xfer_mode == QDL_XFER_LARGE) ? 5000 : 1000;
 
         n = ioctl(qdl->fd, USBDEVFS_BULK, &bulk);
+        qdl->tx_calls++;
+        if (n < 0 && (errno == EINVAL || errno == ENOMEM) &&
+            qdl->xfer_mode == QDL_XFER_LARGE && max_xfer > QDL_LEGACY_BULK_XFER)
+        {
+            /* older kernels cap a single usbfs bulk transfer at 16 KiB */
+            syslog(0, "%s: %d byte transfers rejected, falling back to %d\n", __func__, xfer, QDL_LEGACY_BULK_XFER);
+            qdl->max_xfer = max_xfer = QDL_LEGACY_BULK_XFER;
+            continue;
+        }
         if(n != xfer)
         {
             fprintf(stderr, "ERROR: n = %d, errno = %d (%s)\n", n, errno, strerror(errno));
@@ -300,6 +525,7 @@ int qdl_write(struct qdl_device *qdl, const void *buf, size_t len)
         len -= xfer;
         data += xfer;
     }    
+    /* the ZLP terminates the whole buffer, not each USBDEVFS_BULK chunk */
     if (len_orig % qdl->out_maxpktsize == 0)
     {
         bulk.ep = qdl->out_ep;
@@ -308,9 +534,11 @@ int qdl_write(struct qdl_device *qdl, const void *buf, size_t len)
         bulk.timeout = 1000;
 
         n = ioctl(qdl->fd, USBDEVFS_BULK, &bulk);
+        qdl->tx_calls++;
         if (n < 0)
             return n;
     }
+    qdl->tx_bytes += count;
     return count;
 }
 
@@ -322,65 +550,10 @@ int qdl_close(struct qdl_device *qdl)
     return 0;
 }
 
-int qdl_open(struct qdl_device *qdl)
+static int qdl_claim(struct qdl_device *qdl, int intf)
 {
-    struct udev_enumerate *enumerate;
-    struct udev_list_entry *devices;
-    struct udev_list_entry *dev_list_entry;
-    struct udev_monitor *mon;
-    struct udev_device *dev;
-    const char *dev_node;
-    struct udev *udev;
-    const char *path;
     struct usbdevfs_ioctl cmd;
-    int intf = -1;
     int ret;
-    int fd;
-    int returnMode = -1;
-    udev = udev_new();
-    if (!udev)
-        err(1, "failed to initialize udev");
-
-    mon = udev_monitor_new_from_netlink(udev, "udev");
-    udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", NULL);
-    udev_monitor_enable_receiving(mon);
-
-    enumerate = udev_enumerate_new(udev);
-    udev_enumerate_add_match_subsystem(enumerate, "usb");
-    udev_enumerate_scan_devices(enumerate);
-    devices = udev_enumerate_get_list_entry(enumerate);
-
-    udev_list_entry_foreach(dev_list_entry, devices)
-    {
-        path = udev_list_entry_get_name(dev_list_entry);
-        dev = udev_device_new_from_syspath(udev, path);
-        dev_node = udev_device_get_devnode(dev);
-
-        if (!dev_node)
-        {
-            continue;
-        }
-        fd = open(dev_node, O_RDWR);
-        if (fd < 0)
-            continue;
-        dbg_time("D: %s \n", dev_node);
-        returnMode = check_quec_usb_desc(fd, qdl, &intf);
-        if ((returnMode == SWITCHED_TO_EDL) || (returnMode == SWITCHED_TO_SBL))
-        {
-            goto found;
-        }
-        close(fd);
-    }
-
-    udev_enumerate_unref(enumerate);
-    udev_monitor_unref(mon);
-    udev_unref(udev);
-    return -ENOENT;
-
-found:
-    udev_enumerate_unref(enumerate);
-    udev_monitor_unref(mon);
-    udev_unref(udev);
 
     cmd.ifno = intf;
     cmd.ioctl_code = USBDEVFS_DISCONNECT;
@@ -388,13 +561,91 @@ found:
 
     ret = ioctl(qdl->fd, USBDEVFS_IOCTL, &cmd);
     if (ret && errno != ENODATA)
-        err(1, "failed to disconnect kernel driver");
+    {
+        dbg("failed to disconnect kernel driver, errno: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
 
     ret = ioctl(qdl->fd, USBDEVFS_CLAIMINTERFACE, &intf);
     if (ret < 0)
-        err(1, "failed to claim USB interface");
+    {
+        dbg("failed to claim USB interface, errno: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+
+    qdl->xfer_mode = qdl_xfer_mode;
+    qdl->max_xfer = QDL_MAX_BULK_XFER;
 
     printf("%s : interface claimed\n", __FUNCTION__);
+    return 0;
+}
+
+/* Claim the download interface the index found, the only usbfs node opened */
+static int qdl_open_index_device(struct qdl_device *qdl, const struct usb_index_device *dev)
+{
+    if (dev->download_intf < 0)
+    {
+        dbg("%s: no download interface, is the modem in EDL/SBL mode?", dev->port);
+        return -ENOENT;
+    }
+
+    qdl->fd = open(dev->dev_node, O_RDWR);
+    if (qdl->fd < 0)
+    {
+        dbg("%s: fail to open %s, errno: %d (%s)", dev->port, dev->dev_node, errno, strerror(errno));
+        return -ENOENT;
+    }
+    dbg_time("D: %s %s\n", dev->port, dev->dev_node);
+
+    qdl->in_ep = dev->download_in;
+    qdl->out_ep = dev->download_out;
+    qdl->in_maxpktsize = dev->download_in_maxpktsize;
+    qdl->out_maxpktsize = dev->download_out_maxpktsize;
+
+    if (qdl_claim(qdl, dev->download_intf))
+    {
+        close(qdl->fd);
+        return -EBUSY;
+    }
+
+    return dev->mode == SWITCHED_TO_EDL ? SWITCHED_TO_EDL : SWITCHED_TO_SBL;
+}
+
+int qdl_open(struct qdl_device *qdl)
+{
+    return qdl_open_target(qdl, NULL);
+}
+
+/* Open the modem on target->port, or the first modem in download mode when there is no target */
+int qdl_open_target(struct qdl_device *qdl, struct qdl_target *target)
+{
+    const struct usb_index_device *dev;
+    struct usb_index_device probe;
+    int returnMode;
+
+    memset(qdl, 0, sizeof(struct qdl_device));
+
+    if (target && target->port)
+    {
+        if (usb_index_probe(target->port, &probe))
+        {
+            dbg("%s: no modem on this port", target->port);
+            return -ENOENT;
+        }
+        dev = &probe;
+    }
+    else
+    {
+        dev = usb_index_find(USB_INDEX_DOWNLOAD);
+        if (dev == NULL)
+            dev = usb_index_refresh() ? usb_index_find(USB_INDEX_DOWNLOAD) : NULL;
+        if (dev == NULL)
+            return -ENOENT;
+    }
+
+    returnMode = qdl_open_index_device(qdl, dev);
+    if (returnMode >= 0)
+        qdl->target = target;
     return returnMode;
 }
 
@@ -413,7 +664,11 @@ int sahara_rx_data(struct qdl_device *qdl, void *rx_buffer, size_t bytes_to_read
     return 0;
 }
 
-int check_quec_usb_desc(int fd, struct qdl_device *qdl, int *intf)
+/*
+ * Find the Sahara/Firehose interface in a raw descriptor blob, as read from
+ * usbfs or from the sysfs descriptors attribute, and fill in its endpoints.
+ */
+int check_quec_usb_desc(const void *desc, size_t n, struct qdl_device *qdl, int *intf)
 {
     const struct usb_interface_descriptor *ifc;
     const struct usb_endpoint_descriptor *ept;
@@ -425,18 +680,15 @@ int check_quec_usb_desc(int fd, struct qdl_device *qdl, int *intf)
     unsigned in;
     unsigned k;
     unsigned l;
-    ssize_t n;
     size_t out_size;
     size_t in_size;
     void *ptr;
     void *end;
-    char desc[1024];
     int returnStatus = EINVAL; 
 
-    n = read(fd, desc, sizeof(desc));
-    if (n < 0)
+    if (n < sizeof(struct usb_device_descriptor))
     {
-        return n;
+        return EINVAL;
     }
     ptr = (void*)desc;
     end = ptr + n;
@@ -565,7 +817,6 @@ int check_quec_usb_desc(int fd, struct qdl_device *qdl, int *intf)
             ifc->bInterfaceProtocol != 17)
             continue;
 
-        qdl->fd = fd;
         qdl->in_ep = in;
         qdl->out_ep = out;
         qdl->in_maxpktsize = in_size;
@@ -603,17 +854,12 @@ static void sahara_hello_multi(struct qdl_device *qdl, struct sahara_pkt *pkt)
 
 int start_image_transfer(struct qdl_device *qdl ,
             struct sahara_pkt* sahara_read_data,
-            char *file_name)
+            struct sahara_image *img)
 {
-    int retval = 0;
-    void* tx_buffer;
-    FILE* file_handle;
-    uint32_t file_offset = 0;
-    size_t file_read;
-    struct single_image_hdr *img_hdr = NULL;
-    uint32_t bytes_read = 0, bytes_to_read_next;
     uint32_t DataOffset = 0;
     uint32_t DataLength = 0;
+    uint32_t chunk_size = SAHARA_RAW_BUFFER_SIZE;
+    uint32_t bytes_sent = 0, bytes_to_send_next;
 
     if (qdl == NULL )
     {
@@ -625,106 +871,56 @@ int start_image_transfer(struct qdl_device *qdl ,
         return -3;
     }
 
-    DataOffset = le_uint32(sahara_read_data->read_req.offset);
-    DataLength = le_uint32(sahara_read_data->read_req.length);
-
-    img_hdr = (struct single_image_hdr *)malloc(SINGLE_IMAGE_HDR_SIZE);
-    if (!img_hdr)
-    {
-        return -4;
-    }
-
-    tx_buffer = malloc(SAHARA_RAW_BUFFER_SIZE);
-    if (!tx_buffer)
-    {
-        free(img_hdr);
-        return -4;
-    }
-
-    if ( file_name != NULL )
-    {
-        file_handle = fopen(file_name, "rb");
-    }
-    else
-    {
-        file_handle = create_reset_single_image();
-    }
-
-
-    if (!file_handle)
+    if (img == NULL || img->base == NULL)
     {
-        free(img_hdr);
-        free(tx_buffer);
         return -5;
     }
 
-
-    file_read = fread(img_hdr, 1, (SINGLE_IMAGE_HDR_SIZE), file_handle);
-    if (file_read != (SINGLE_IMAGE_HDR_SIZE))
-    {
-        free(img_hdr);
-        free(tx_buffer);
-        fclose(file_handle);
-        return -6;
-    }
-
-    /* Reset the file pointer to get it ready for delivery*/
-    fseek(file_handle, 0, SEEK_SET);
+    DataOffset = le_uint32(sahara_read_data->read_req.offset);
+    DataLength = le_uint32(sahara_read_data->read_req.length);
 
     dbg("%s:Img id: 0x%08x Offset: 0x%08x Len: 0x%08x", __FUNCTION__ ,le_uint32(sahara_read_data->read_req.image), DataOffset, DataLength);
 
-    if (fseek(file_handle, file_offset + (long)DataOffset, SEEK_SET))
+    if ((size_t)DataOffset + DataLength > img->size)
     {
-        dbg("%d errno: %d (%s)", __LINE__, errno, strerror(errno));
-        free(img_hdr);
-        free(tx_buffer);
-        fclose(file_handle);
+        dbg("Request beyond the end of %s (0x%zx bytes)", img->path ? img->path : "reset image", img->size);
         return 0;
     }
 
-    while (bytes_read < DataLength)
-    {
-        bytes_to_read_next = MIN((uint32_t)DataLength - bytes_read, SAHARA_RAW_BUFFER_SIZE);
-        retval = fread(tx_buffer, 1, bytes_to_read_next, file_handle);
+    if (!img->z)
+        sahara_image_advise(img, DataOffset, DataLength);
 
-        if (retval < 0)
-        {
-            dbg("file read failed: %s", strerror(errno));
-            free(img_hdr);
-            free(tx_buffer);
-            fclose(file_handle);
-            return 0;
-        }
+    if (qdl->xfer_mode == QDL_XFER_LARGE)
+        chunk_size = QDL_MAX_BULK_XFER;
+
+    /* the data goes to usbfs straight from the mapping */
+    while (bytes_sent < DataLength)
+    {
+        bytes_to_send_next = MIN(DataLength - bytes_sent, chunk_size);
 
-        if ((uint32_t)retval != bytes_to_read_next)
+        if (sahara_image_wait(img, DataOffset + bytes_sent, bytes_to_send_next))
         {
-            dbg("Read %d bytes, but was asked for 0x%08x bytes", retval, DataLength);
-            free(img_hdr);
-            free(tx_buffer);
-            fclose(file_handle);
+            dbg("fail to decompress %s", img->path);
             return 0;
         }
-
-        /*send the image data*/
-        if (0 == qdl_write(qdl, tx_buffer, bytes_to_read_next))
+        if (qdl_write(qdl, img->base + DataOffset + bytes_sent, bytes_to_send_next) <= 0)
         {
             dbg("Tx Sahara Image Failed");
-            free(img_hdr);
-            free(tx_buffer);
-            fclose(file_handle);
             return 0;
         }
 
-        bytes_read += bytes_to_read_next;
+        bytes_sent += bytes_to_send_next;
     }
-    free(tx_buffer);
-    free(img_hdr);
-    fclose(file_handle);
     return 1;
 }
 
 
 int sahara_flash_all(char *main_file_path, char *oem_file_path, char *carrier_file_path)
+{
+    return sahara_flash_target(NULL, main_file_path, oem_file_path, carrier_file_path);
+}
+
+int sahara_flash_target(struct qdl_target *target, char *main_file_path, char *oem_file_path, char *carrier_file_path)
 {
     int ret;
     int i, count;
@@ -734,21 +930,10 @@ int sahara_flash_all(char *main_file_path, char *oem_file_path, char *carrier_fi
     char buffer[QBUFFER_SIZE];
     int nBytes = 0;
     char * files[4];
+    struct sahara_image images[4];
     char * current_file_name;
     bool done = false;
-    ret = qdl_open(&qdl);
-
-    switch(ret) {
-    case SWITCHED_TO_SBL:
-      syslog(0, "Found a Quectel device ready to flash!\n");
-      break;
-    case SWITCHED_TO_EDL:
-      syslog(0, "Found a Qualcom device ready to flash!\n");
-      break;
-    default:
-      syslog(0, "Could not find a Quectel or Qualcom device ready to flash!\n");
-      return -1;
-    }
+    uint64_t start_usec;
 
     count = 0;
     if ( strlen(main_file_path) )
@@ -761,11 +946,36 @@ int sahara_flash_all(char *main_file_path, char *oem_file_path, char *carrier_fi
         files[count++] = oem_file_path;
 
     if (!count) {
-	    qdl_close(&qdl);
 	    return -1;
     }
     files[count++] = NULL; // for rest image
 
+    /* map every image once for the whole session */
+    for (i = 0; i < count; i++)
+    {
+        if (sahara_image_map(&images[i], files[i]))
+        {
+            while (i--)
+                sahara_image_unmap(&images[i]);
+            return -1;
+        }
+    }
+
+    ret = qdl_open_target(&qdl, target);
+
+    switch(ret) {
+    case SWITCHED_TO_SBL:
+      syslog(0, "Found a Quectel device ready to flash!\n");
+      break;
+    case SWITCHED_TO_EDL:
+      syslog(0, "Found a Qualcom device ready to flash!\n");
+      break;
+    default:
+      syslog(0, "Could not find a Quectel or Qualcom device ready to flash!\n");
+      ret = -1;
+      goto EXIT;
+    }
+
     memset(buffer, 0 , QBUFFER_SIZE );
     nBytes = sahara_rx_data(&qdl, buffer, 0);
     pspkt = (struct sahara_pkt *)buffer;
@@ -774,11 +984,14 @@ int sahara_flash_all(char *main_file_path, char *oem_file_path, char *carrier_fi
     {
         dbg("Received a different command: %x while waiting for hello packet \n Bytes received %d\n", pspkt->cmd, nBytes);
         qdl_close(&qdl);
-        return -1;
+        ret = -1;
+        goto EXIT;
     }
 
 
     sahara_hello_multi(&qdl, pspkt);
+    start_usec = qdl_time_usec();
+    ret = 0;
 
     for(i = 0; i < count; i++)
     {
@@ -800,24 +1013,31 @@ int sahara_flash_all(char *main_file_path, char *oem_file_path, char *carrier_fi
             if ((uint32_t)nBytes != pspkt->length)
             {
                 fprintf(stderr, "Sahara pkt length not matching");
-                return -EINVAL;
+                qdl_close(&qdl);
+                ret = -EINVAL;
+                goto EXIT;
             }
 
             if (pspkt->cmd == 3)
             {
-                start_image_transfer(&qdl , pspkt , current_file_name);
+                start_image_transfer(&qdl , pspkt , &images[i]);
                 continue;
             }
             if  (pspkt->cmd == QUEC_SAHARA_FW_UPDATE_PROCESS_REPORT_ID)
             {
                 dbg("Writing %d percent %c", le_uint32(pspkt->packet_fw_update_process_report.percent), (le_uint32(pspkt->packet_fw_update_process_report.percent == 100) ? '\n' : '\r'));
+                /* the target reports per image, the session covers all of them */
+                qdl_target_report(target, NULL, (i * 100 + le_uint32(pspkt->packet_fw_update_process_report.percent)) / count);
                 continue;
             }
 
             if (pspkt->cmd == QUEC_SAHARA_FW_UPDATE_END_ID)
             {
                 if (le_uint32(pspkt->packet_fw_update_end.successful))
+                {
                     dbg("firmware flash error (%d)", le_uint32(pspkt->packet_fw_update_end.successful));
+                    ret = -EIO;
+                }
                 else
                 {
                     dbg("firmware flash successful");
@@ -826,6 +1046,14 @@ int sahara_flash_all(char *main_file_path, char *oem_file_path, char *carrier_fi
             }
         }
     }
+    qdl_print_tx_stats(&qdl, start_usec);
     qdl_close(&qdl);
-    return 0;
+
+EXIT:
+    for (i = 0; i < count; i++)
+        sahara_image_unmap(&images[i]);
+    /* the modem reboots into normal mode after the session */
+    if (!target || !target->port)
+        usb_index_invalidate();
+    return ret;
 }
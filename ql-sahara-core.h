@@ -22,12 +22,12 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <getopt.h>
-#include <libudev.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -39,6 +39,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <time.h>
 
 #define SWITCHED_TO_EDL 1
 #define SWITCHED_TO_SBL 0
@@ -54,6 +55,12 @@
 #define SAHARA_RAW_BUFFER_SIZE (8 * 1024)
 #define SINGLE_IMAGE_HDR_SIZE (4 * 1024)
 
+/* qdl_write() transfer modes */
+#define QDL_XFER_PACKET 0 /* one USBDEVFS_BULK per wMaxPacketSize */
+#define QDL_XFER_LARGE 1  /* whole buffers, up to max_xfer per USBDEVFS_BULK */
+#define QDL_MAX_BULK_XFER (1024 * 1024)
+#define QDL_LEGACY_BULK_XFER (16 * 1024) /* usbfs limit on pre-3.x kernels */
+
 #define MAX_NUM_ENDPOINTS 0xff
 #define MAX_NUM_INTERFACES 0xff
 
@@ -67,6 +74,9 @@
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
 
 struct image_layout
 {
@@ -109,13 +119,52 @@ typedef enum
   QUEC_FW_UPGRADE_ERR_FLASH_FAILED,
 } quec_x_fw_upgrade_err_code;
 
+/* Which modem a flash session talks to, and how far it has got */
+struct qdl_target
+{
+    const char *port; /* sysfs port name, NULL: the first modem in download mode */
+    const char *name;
+    const char *volatile stage; /* such as "switching" or "flashing", set by whoever drives the session */
+    volatile int percent;
+    /* called from the flashing thread whenever stage or percent change */
+    void (*progress)(struct qdl_target *target);
+    void *user;
+};
+
 struct qdl_device
 {
+    struct qdl_target *target;
     int fd;
     int in_ep;
     int out_ep;
     size_t in_maxpktsize;
     size_t out_maxpktsize;
+    int xfer_mode;
+    size_t max_xfer;
+    size_t tx_bytes;
+    unsigned long tx_calls;
+};
+
+struct zimage;
+struct bundle;
+struct bundle_entry;
+
+/*
+ * An image mapped once per Sahara session and served to READ_DATA requests.
+ * For a compressed image, base is the content being decompressed by z and
+ * sahara_image_wait() must be called before reading it. An image inside a
+ * bundle points into the bundle's mapping.
+ */
+struct sahara_image
+{
+    const char *path;
+    int fd;
+    uint8_t *base;
+    size_t size;
+    uint32_t next_offset;
+    struct zimage *z;
+    struct bundle *bundle;
+    const struct bundle_entry *entry;
 };
 
 struct sahara_pkt
@@ -185,20 +234,35 @@ struct sahara_pkt
         } packet_fw_update_process_report;
     };
 };
+extern int qdl_xfer_mode;
+
 uint32_t le_uint32(uint32_t v32);
+uint64_t qdl_time_usec(void);
+int file_replace_open(const char *path, char *tmp_path, size_t size);
+int file_replace_commit(const char *tmp_path, const char *path, int ok);
+void qdl_target_report(struct qdl_target *target, const char *stage, int percent);
+void qdl_print_tx_stats(struct qdl_device *qdl, uint64_t start_usec);
 uint8_t to_hex(uint8_t ch);
 void print_hex_dump(const char *prefix, const void *buf, size_t len);
 int qdl_mode_check();
 int qdl_write(struct qdl_device *qdl, const void *buf, size_t len);
 int qdl_read(struct qdl_device *qdl, void *buf, size_t len, unsigned int timeout);
 int qdl_open(struct qdl_device *qdl);
+int qdl_open_target(struct qdl_device *qdl, struct qdl_target *target);
 int qdl_close(struct qdl_device *qdl);
 
 int sahara_rx_data(struct qdl_device *qdl, void *rx_buffer, size_t bytes_to_read);
+int check_quec_usb_desc(const void *desc, size_t n, struct qdl_device *qdl, int *intf);
+
+int sahara_image_map(struct sahara_image *img, const char *path);
+void sahara_image_unmap(struct sahara_image *img);
+int sahara_image_wait(const struct sahara_image *img, uint64_t offset, uint64_t length);
+int sahara_image_versions(const char *path, char main_version[16], char oem_version[16], char carrier_version[16]);
 
 int sahara_reboot_modem();
 int sahara_flash_carrier(char *file_name);
 int sahara_flash_all(char * main_file_path,char*  oem_file_path,char* carrier_file_path);
+int sahara_flash_target(struct qdl_target *target, char *main_file_path, char *oem_file_path, char *carrier_file_path);
 int flash_mode_check(void);
 
 #endif
@@ -0,0 +1,429 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-usb-index.h"
+#include "ql-sahara-core.h"
+#include <libudev.h>
+#include <poll.h>
+
+/*
+ * One scan of /sys/bus/usb/devices shared by every discovery path. Each
+ * device costs one read of its cached descriptors, only Quectel, Qualcomm
+ * and NetPrisma devices are looked at further, and nothing is opened under
+ * /dev, so unrelated (possibly suspended) devices are left alone. The
+ * result is cached until something re-enumerates the modem and calls
+ * usb_index_invalidate() or usb_index_refresh().
+ */
+
+static const char *usb_index_root = "/sys/bus/usb/devices";
+static struct usb_index s_index;
+
+static int usb_index_read_value(const char *name, const char *attr, int base)
+{
+    char path[PATH_LENGTH];
+    int value = -1;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", usb_index_root, name, attr);
+    fp = fopen(path, "r");
+    if (fp)
+    {
+        if (fscanf(fp, base == 16 ? "%x" : "%d", &value) != 1)
+            value = -1;
+        fclose(fp);
+    }
+
+    return value;
+}
+
+static void usb_index_read_string(const char *name, const char *attr, char *buf, size_t size)
+{
+    char path[PATH_LENGTH];
+    FILE *fp;
+
+    buf[0] = '\0';
+    snprintf(path, sizeof(path), "%s/%s/%s", usb_index_root, name, attr);
+    fp = fopen(path, "r");
+    if (!fp)
+        return;
+    if (!fgets(buf, size, fp))
+        buf[0] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    fclose(fp);
+}
+
+/* Record every interface of the first configuration and its first bulk endpoints */
+static void usb_index_parse_interfaces(const uint8_t *desc, size_t len, struct usb_index_device *dev)
+{
+    struct usb_index_interface *intf = NULL;
+    size_t pos = desc[0];
+    int configs = 0;
+
+    while (pos + 2 <= len && desc[pos] >= 2 && pos + desc[pos] <= len)
+    {
+        const uint8_t *d = desc + pos;
+
+        pos += d[0];
+        if (d[1] == USB_DT_CONFIG && ++configs > 1)
+            break;
+
+        if (d[1] == USB_DT_INTERFACE && d[0] >= USB_DT_INTERFACE_SIZE)
+        {
+            const struct usb_interface_descriptor *ifc = (const struct usb_interface_descriptor *)d;
+
+            intf = NULL;
+            if (ifc->bAlternateSetting != 0 || dev->num_interfaces == USB_INDEX_MAX_INTERFACES)
+                continue;
+            intf = &dev->interfaces[dev->num_interfaces++];
+            memset(intf, 0, sizeof(struct usb_index_interface));
+            intf->bInterfaceNumber = ifc->bInterfaceNumber;
+            intf->bInterfaceClass = ifc->bInterfaceClass;
+            intf->bInterfaceSubClass = ifc->bInterfaceSubClass;
+            intf->bInterfaceProtocol = ifc->bInterfaceProtocol;
+            intf->bNumEndpoints = ifc->bNumEndpoints;
+        }
+        else if (d[1] == USB_DT_ENDPOINT && d[0] >= USB_DT_ENDPOINT_SIZE && intf)
+        {
+            const struct usb_endpoint_descriptor *ept = (const struct usb_endpoint_descriptor *)d;
+
+            if ((ept->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_BULK)
+                continue;
+            if ((ept->bEndpointAddress & USB_DIR_IN) && !intf->bulk_in)
+            {
+                intf->bulk_in = ept->bEndpointAddress;
+                intf->in_maxpktsize = ept->wMaxPacketSize;
+            }
+            else if (!(ept->bEndpointAddress & USB_DIR_IN) && !intf->bulk_out)
+            {
+                intf->bulk_out = ept->bEndpointAddress;
+                intf->out_maxpktsize = ept->wMaxPacketSize;
+            }
+        }
+    }
+}
+
+static void usb_index_find_cdc_wdm(struct usb_index_device *dev)
+{
+    char path[PATH_LENGTH];
+    struct dirent *ent;
+    DIR *pDir;
+
+    dev->cdc_wdm[0] = '\0';
+    snprintf(path, sizeof(path), "%s/%s:1.0/usbmisc", usb_index_root, dev->port);
+    pDir = opendir(path);
+    if (!pDir)
+        return;
+
+    while ((ent = readdir(pDir)) != NULL)
+    {
+        if (!strncmp(ent->d_name, "cdc-wdm", strlen("cdc-wdm")))
+        {
+            snprintf(dev->cdc_wdm, sizeof(dev->cdc_wdm), "/dev/%.24s", ent->d_name);
+            break;
+        }
+    }
+    closedir(pDir);
+}
+
+static const struct usb_index_interface *usb_index_interface(const struct usb_index_device *dev, int number)
+{
+    unsigned i;
+
+    for (i = 0; i < dev->num_interfaces; i++)
+    {
+        if (dev->interfaces[i].bInterfaceNumber == number)
+            return &dev->interfaces[i];
+    }
+    return NULL;
+}
+
+/*
+ * EDL is the Qualcomm 9008 download mode. In SBL download mode the MBIM
+ * function on interface 0 is still listed but has no endpoints.
+ */
+static int usb_index_classify(const struct usb_index_device *dev)
+{
+    const struct usb_index_interface *mbim = usb_index_interface(dev, 0);
+
+    if (dev->idVendor == 0x05c6 || dev->idProduct == 0x9008)
+        return SWITCHED_TO_EDL;
+
+    if (dev->num_interfaces == 4 && mbim
+        && mbim->bInterfaceClass == 0x02 && mbim->bInterfaceSubClass == 0x0e
+        && mbim->bInterfaceProtocol == 0x00 && mbim->bNumEndpoints == 0)
+        return SWITCHED_TO_SBL;
+
+    return NORMAL_OPERATION;
+}
+
+/* Fill dev from the sysfs entry of one port, -1 if it is not one of our modems */
+int usb_index_probe(const char *port, struct usb_index_device *dev)
+{
+    const struct usb_device_descriptor *devd;
+    uint8_t desc[USB_INDEX_MAX_DESCRIPTORS];
+    char path[PATH_LENGTH];
+    ssize_t len;
+    int fd;
+
+    memset(dev, 0, sizeof(struct usb_index_device));
+    dev->download_intf = -1;
+
+    /* the kernel keeps a copy of the descriptors, reading it leaves the device alone */
+    snprintf(path, sizeof(path), "%s/%s/descriptors", usb_index_root, port);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    len = read(fd, desc, sizeof(desc));
+    close(fd);
+    if (len < (ssize_t)sizeof(struct usb_device_descriptor))
+        return -1;
+
+    devd = (const struct usb_device_descriptor *)desc;
+    if (devd->bDescriptorType != USB_DT_DEVICE)
+        return -1;
+    if (devd->idVendor != 0x2c7c && devd->idVendor != 0x05c6 && devd->idVendor != NP_VID)
+        return -1;
+
+    dev->idVendor = devd->idVendor;
+    dev->idProduct = devd->idProduct;
+    dev->busnum = usb_index_read_value(port, "busnum", 10);
+    dev->devnum = usb_index_read_value(port, "devnum", 10);
+    if (dev->busnum < 0 || dev->devnum < 0)
+        return -1;
+
+    snprintf(dev->port, sizeof(dev->port), "%.31s", port);
+    if (devd->iSerialNumber)
+        usb_index_read_string(port, "serial", dev->serial, sizeof(dev->serial));
+    snprintf(dev->dev_node, sizeof(dev->dev_node), "/dev/bus/usb/%03d/%03d", dev->busnum, dev->devnum);
+    usb_index_parse_interfaces(desc, len, dev);
+    dev->mode = usb_index_classify(dev);
+
+    if (dev->mode == NORMAL_OPERATION)
+    {
+        const struct usb_index_interface *mbim = usb_index_interface(dev, 0);
+
+        if (mbim && mbim->bInterfaceClass == 0x02 && mbim->bInterfaceSubClass == 0x0e)
+            usb_index_find_cdc_wdm(dev);
+    }
+    else
+    {
+        struct qdl_device qdl;
+        int intf = -1;
+        int ret;
+
+        memset(&qdl, 0, sizeof(qdl));
+        ret = check_quec_usb_desc(desc, len, &qdl, &intf);
+        if ((ret == SWITCHED_TO_EDL || ret == SWITCHED_TO_SBL) && intf >= 0)
+        {
+            dev->download_intf = intf;
+            dev->download_in = qdl.in_ep;
+            dev->download_out = qdl.out_ep;
+            dev->download_in_maxpktsize = qdl.in_maxpktsize;
+            dev->download_out_maxpktsize = qdl.out_maxpktsize;
+        }
+    }
+
+    return 0;
+}
+
+int usb_index_scan(struct usb_index *index)
+{
+    struct dirent *ent;
+    DIR *pDir;
+
+    index->count = 0;
+    index->valid = 0;
+
+    pDir = opendir(usb_index_root);
+    if (!pDir)
+    {
+        syslog(0, "could not open [%s] dir", usb_index_root);
+        return -1;
+    }
+
+    while ((ent = readdir(pDir)) != NULL && index->count < USB_INDEX_MAX_DEVICES)
+    {
+        /* interfaces (1-1:1.0) and root hubs (usb1) are not modems */
+        if (strchr(ent->d_name, ':') || !isdigit((unsigned char)ent->d_name[0]))
+            continue;
+        if (usb_index_probe(ent->d_name, &index->devices[index->count]) == 0)
+            index->count++;
+    }
+    closedir(pDir);
+
+    index->valid = 1;
+    return index->count;
+}
+
+/* The cached index, scanned on first use. NULL if sysfs is not readable. */
+const struct usb_index *usb_index_get(void)
+{
+    if (!s_index.valid && usb_index_scan(&s_index) < 0)
+        return NULL;
+    return &s_index;
+}
+
+const struct usb_index *usb_index_refresh(void)
+{
+    usb_index_invalidate();
+    return usb_index_get();
+}
+
+void usb_index_invalidate(void)
+{
+    s_index.valid = 0;
+}
+
+/* First indexed modem in one of the modes of mode_mask */
+const struct usb_index_device *usb_index_find(int mode_mask)
+{
+    const struct usb_index *index = usb_index_get();
+    unsigned i;
+
+    for (i = 0; index && i < index->count; i++)
+    {
+        if (USB_INDEX_MODE(index->devices[i].mode) & mode_mask)
+            return &index->devices[i];
+    }
+    return NULL;
+}
+
+/* First indexed modem with an MBIM control node */
+const struct usb_index_device *usb_index_find_mbim(void)
+{
+    const struct usb_index *index = usb_index_get();
+    unsigned i;
+
+    for (i = 0; index && i < index->count; i++)
+    {
+        if (index->devices[i].cdc_wdm[0])
+            return &index->devices[i];
+    }
+    return NULL;
+}
+
+/* A modem in normal mode is only usable once its MBIM control node is bound */
+static int usb_index_match(const struct usb_index_device *dev, int mode_mask)
+{
+    if (!(USB_INDEX_MODE(dev->mode) & mode_mask))
+        return 0;
+    return dev->mode != NORMAL_OPERATION || dev->cdc_wdm[0];
+}
+
+static int usb_index_lookup(const char *port, int mode_mask, const char *stale_node, struct usb_index_device *dev)
+{
+    struct usb_index_device probe;
+    const struct usb_index *index;
+    unsigned i;
+
+    if (port)
+    {
+        if (usb_index_probe(port, &probe) || !usb_index_match(&probe, mode_mask)
+            || (stale_node && !strcmp(probe.dev_node, stale_node)))
+            return 0;
+        if (dev)
+            memcpy(dev, &probe, sizeof(probe));
+        return 1;
+    }
+
+    index = usb_index_get();
+    for (i = 0; index && i < index->count; i++)
+    {
+        if (usb_index_match(&index->devices[i], mode_mask)
+            && !(stale_node && !strcmp(index->devices[i].dev_node, stale_node)))
+        {
+            if (dev)
+                memcpy(dev, &index->devices[i], sizeof(struct usb_index_device));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Block until a modem (the one on port, or any if port is NULL) shows up in
+ * one of the modes of mode_mask, or timeout_ms expires. sysfs is only
+ * re-read when udev reports a USB device or cdc-wdm node change; the udev
+ * (not kernel) netlink source is used so the device node permissions are
+ * already set up when we wake. Without udev this degrades to polling.
+ * A device still on stale_node (its usbfs node before a reset) is ignored,
+ * re-enumeration always gives it a new one.
+ * Returns 0 and fills dev if not NULL, -ETIMEDOUT otherwise.
+ */
+int usb_index_wait(const char *port, int mode_mask, const char *stale_node, unsigned timeout_ms,
+                   struct usb_index_device *dev)
+{
+    uint64_t deadline = qdl_time_usec() + (uint64_t)timeout_ms * 1000;
+    struct udev_monitor *mon = NULL;
+    struct udev *udev = udev_new();
+    struct pollfd pfd = { .fd = -1, .events = POLLIN };
+    int ret = -ETIMEDOUT;
+
+    /* subscribe before the first look so that no event can slip in between */
+    if (udev)
+        mon = udev_monitor_new_from_netlink(udev, "udev");
+    if (mon)
+    {
+        udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", "usb_device");
+        udev_monitor_filter_add_match_subsystem_devtype(mon, "usbmisc", NULL);
+        if (udev_monitor_enable_receiving(mon) == 0)
+            pfd.fd = udev_monitor_get_fd(mon);
+    }
+    if (pfd.fd < 0)
+        dbg("udev monitor not available, polling every %d ms", USB_INDEX_POLL_MS);
+
+    for (;;)
+    {
+        uint64_t now;
+        int wait_ms;
+
+        if (!port)
+            usb_index_invalidate();
+        if (usb_index_lookup(port, mode_mask, stale_node, dev))
+        {
+            ret = 0;
+            break;
+        }
+
+        now = qdl_time_usec();
+        if (now >= deadline)
+            break;
+        wait_ms = (int)((deadline - now + 999) / 1000);
+
+        if (pfd.fd < 0)
+        {
+            if (wait_ms > USB_INDEX_POLL_MS)
+                wait_ms = USB_INDEX_POLL_MS;
+            usleep(wait_ms * 1000);
+            continue;
+        }
+
+        if (poll(&pfd, 1, wait_ms) > 0)
+        {
+            struct udev_device *event;
+
+            /* the monitor socket is non-blocking, drain everything queued */
+            while ((event = udev_monitor_receive_device(mon)) != NULL)
+                udev_device_unref(event);
+        }
+    }
+
+    if (mon)
+        udev_monitor_unref(mon);
+    if (udev)
+        udev_unref(udev);
+    return ret;
+}
@@ -0,0 +1,81 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_USB_INDEX_H_
+#define __QL_USB_INDEX_H_
+#include <stdint.h>
+
+#define USB_INDEX_MAX_DEVICES 32
+#define USB_INDEX_MAX_INTERFACES 8
+#define USB_INDEX_MAX_DESCRIPTORS 4096
+#define USB_INDEX_POLL_MS 500
+
+/* usb_index_find() masks, one bit per SWITCHED_TO_SBL/SWITCHED_TO_EDL/NORMAL_OPERATION */
+#define USB_INDEX_MODE(mode) (1 << (mode))
+#define USB_INDEX_DOWNLOAD (USB_INDEX_MODE(SWITCHED_TO_SBL) | USB_INDEX_MODE(SWITCHED_TO_EDL))
+#define USB_INDEX_ANY (USB_INDEX_DOWNLOAD | USB_INDEX_MODE(NORMAL_OPERATION))
+
+struct usb_index_interface
+{
+    uint8_t bInterfaceNumber;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t bNumEndpoints;
+    uint8_t bulk_in;  /* first bulk endpoint of each direction, 0 if none */
+    uint8_t bulk_out;
+    uint16_t in_maxpktsize;
+    uint16_t out_maxpktsize;
+};
+
+struct usb_index_device
+{
+    char port[32];     /* sysfs name such as 1-1.4, stable across mode switches */
+    char dev_node[32]; /* /dev/bus/usb/BBB/DDD */
+    char cdc_wdm[32];  /* MBIM control node of interface 0, empty if none */
+    char serial[64];   /* iSerialNumber string, empty if none */
+    uint16_t idVendor;
+    uint16_t idProduct;
+    int busnum;
+    int devnum;
+    int mode;
+    unsigned num_interfaces;
+    struct usb_index_interface interfaces[USB_INDEX_MAX_INTERFACES];
+    int download_intf; /* Sahara/Firehose interface in EDL/SBL mode, -1 otherwise */
+    uint8_t download_in;
+    uint8_t download_out;
+    uint16_t download_in_maxpktsize;
+    uint16_t download_out_maxpktsize;
+};
+
+struct usb_index
+{
+    struct usb_index_device devices[USB_INDEX_MAX_DEVICES];
+    unsigned count;
+    int valid;
+};
+
+int usb_index_probe(const char *port, struct usb_index_device *dev);
+int usb_index_scan(struct usb_index *index);
+
+const struct usb_index *usb_index_get(void);
+const struct usb_index *usb_index_refresh(void);
+void usb_index_invalidate(void);
+const struct usb_index_device *usb_index_find(int mode_mask);
+const struct usb_index_device *usb_index_find_mbim(void);
+int usb_index_wait(const char *port, int mode_mask, const char *stale_node, unsigned timeout_ms,
+                   struct usb_index_device *dev);
+
+#endif
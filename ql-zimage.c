@@ -0,0 +1,386 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ql-sahara-core.h"
+#include "ql-zimage.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Firmware images compressed in the zstd seekable format: independent zstd
+ * frames followed by a skippable frame holding the size of each, so that
+ * any offset can be served without decompressing what precedes it (see
+ * contrib/seekable_format in the zstd sources). The seek table is read
+ * without libzstd, a compressed image is never mistaken for a raw one even
+ * when the helper is built without HAVE_ZSTD.
+ */
+
+static uint32_t zimage_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * 1 and the frames if the length bytes at offset in fd are a seekable
+ * image, 0 if they are not, -EINVAL if the image is broken
+ */
+static int zimage_read_table(int fd, uint64_t offset, uint64_t length, struct zimage_frame **frames,
+                             uint32_t *count, uint64_t *content_size)
+{
+    uint8_t footer[ZIMAGE_FOOTER_SIZE], header[8];
+    uint64_t table_size, c_offset = 0, d_offset = 0;
+    uint32_t i, n, entry_size;
+    uint8_t *table;
+
+    if (length < ZIMAGE_FOOTER_SIZE + sizeof(header))
+        return 0;
+    if (pread(fd, footer, sizeof(footer), offset + length - sizeof(footer)) != (ssize_t)sizeof(footer)
+        || zimage_le32(footer + 5) != ZIMAGE_SEEKABLE_MAGIC)
+        return 0;
+
+    n = zimage_le32(footer);
+    /* bit 7: a checksum per entry, bits 2-6 are reserved */
+    if (footer[4] & 0x7c || n == 0 || n > ZIMAGE_MAX_FRAMES)
+        return -EINVAL;
+    entry_size = footer[4] & 0x80 ? 12 : 8;
+    table_size = (uint64_t)n * entry_size + ZIMAGE_FOOTER_SIZE;
+    if (table_size + sizeof(header) > length)
+        return -EINVAL;
+    if (pread(fd, header, sizeof(header), offset + length - table_size - sizeof(header)) != (ssize_t)sizeof(header)
+        || zimage_le32(header) != ZIMAGE_SKIPPABLE_MAGIC || zimage_le32(header + 4) != table_size)
+        return -EINVAL;
+
+    table = malloc(table_size - ZIMAGE_FOOTER_SIZE);
+    *frames = calloc(n, sizeof(struct zimage_frame));
+    if (!table || !*frames
+        || pread(fd, table, table_size - ZIMAGE_FOOTER_SIZE, offset + length - table_size) != (ssize_t)(table_size - ZIMAGE_FOOTER_SIZE))
+        goto ERROR;
+
+    for (i = 0; i < n; i++)
+    {
+        struct zimage_frame *frame = &(*frames)[i];
+
+        frame->c_offset = c_offset;
+        frame->d_offset = d_offset;
+        frame->c_size = zimage_le32(table + i * entry_size);
+        frame->d_size = zimage_le32(table + i * entry_size + 4);
+        c_offset += frame->c_size;
+        d_offset += frame->d_size;
+    }
+    /* the frames must fill everything up to the seek table */
+    if (c_offset != length - table_size - sizeof(header) || d_offset == 0)
+        goto ERROR;
+
+    free(table);
+    *count = n;
+    *content_size = d_offset;
+    return 1;
+
+ERROR:
+    free(table);
+    free(*frames);
+    *frames = NULL;
+    return -EINVAL;
+}
+
+/*
+ * 1 and the decompressed size if the length bytes at offset in fd are a
+ * seekable image, 0 if not, < 0 if broken. A bundle entry is probed in the
+ * bundle file, see bundle_open_range().
+ */
+int zimage_probe(int fd, uint64_t offset, uint64_t length, uint64_t *content_size)
+{
+    struct zimage_frame *frames = NULL;
+    uint32_t count;
+    int ret;
+
+    ret = zimage_read_table(fd, offset, length, &frames, &count, content_size);
+    free(frames);
+    return ret;
+}
+
+#ifdef HAVE_ZSTD
+
+/* The first pending frame of the window, -1 if there is none */
+static int zimage_pick(struct zimage *z)
+{
+    uint64_t end = z->frames[z->read_frame].d_offset + ZIMAGE_WINDOW_SIZE;
+    uint32_t i;
+
+    /* released frames are only decompressed again once waited on */
+    for (i = MAX(z->read_frame, z->release_frame); i < z->frame_count && z->frames[i].d_offset < end; i++)
+    {
+        if (z->frames[i].state == ZIMAGE_FRAME_PENDING)
+            return i;
+    }
+    return -1;
+}
+
+static void *zimage_worker(void *arg)
+{
+    struct zimage *z = (struct zimage *)arg;
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+    for (;;)
+    {
+        struct zimage_frame *frame;
+        size_t ret;
+        int idx;
+
+        pthread_mutex_lock(&z->lock);
+        if (!dctx)
+            z->error = -ENOMEM;
+        /* idle until a reader moves the window */
+        while (!z->stop && !z->error && (idx = zimage_pick(z)) < 0)
+            pthread_cond_wait(&z->cond, &z->lock);
+        if (z->stop || z->error)
+        {
+            pthread_mutex_unlock(&z->lock);
+            break;
+        }
+        z->frames[idx].state = ZIMAGE_FRAME_BUSY;
+        pthread_mutex_unlock(&z->lock);
+
+        frame = &z->frames[idx];
+        ret = ZSTD_decompressDCtx(dctx, z->base + frame->d_offset, frame->d_size,
+                                  z->src + frame->c_offset, frame->c_size);
+
+        pthread_mutex_lock(&z->lock);
+        if (ZSTD_isError(ret) || ret != frame->d_size)
+        {
+            dbg("%s: frame %d: %s", z->path, idx, ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "wrong size");
+            z->error = -EBADMSG;
+        }
+        frame->state = ZIMAGE_FRAME_DONE;
+        pthread_cond_broadcast(&z->cond);
+        pthread_mutex_unlock(&z->lock);
+    }
+
+    ZSTD_freeDCtx(dctx);
+    pthread_mutex_lock(&z->lock);
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    return NULL;
+}
+
+/*
+ * Map the seekable image held by the length bytes at offset in fd and start
+ * decompressing its first window. fd can be closed afterwards.
+ */
+int zimage_open(struct zimage *z, int fd, uint64_t offset, uint64_t length, const char *path)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t delta = offset % sysconf(_SC_PAGESIZE);
+    unsigned threads;
+    uint64_t size;
+    int ret;
+
+    memset(z, 0, sizeof(struct zimage));
+    z->path = path;
+    z->base = MAP_FAILED;
+    z->map = MAP_FAILED;
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->cond, NULL);
+
+    ret = zimage_read_table(fd, offset, length, &z->frames, &z->frame_count, &size);
+    if (ret <= 0)
+    {
+        dbg("%s: broken seek table", path);
+        ret = -EINVAL;
+        goto ERROR;
+    }
+    z->src_size = length;
+    z->size = size;
+
+    /* mappings start on a page, a bundle entry need not */
+    z->map_size = length + delta;
+    z->map = mmap(NULL, z->map_size, PROT_READ, MAP_SHARED, fd, offset - delta);
+    z->base = mmap(NULL, z->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (z->map == MAP_FAILED || z->base == MAP_FAILED)
+    {
+        ret = -errno;
+        goto ERROR;
+    }
+    z->src = (const uint8_t *)z->map + delta;
+    madvise(z->map, z->map_size, MADV_SEQUENTIAL);
+
+    threads = cpus > 0 ? (unsigned)cpus : 1;
+    if (threads > ZIMAGE_MAX_THREADS)
+        threads = ZIMAGE_MAX_THREADS;
+    while (z->thread_count < threads
+           && pthread_create(&z->threads[z->thread_count], NULL, zimage_worker, z) == 0)
+        z->thread_count++;
+    if (!z->thread_count)
+    {
+        ret = -EAGAIN;
+        goto ERROR;
+    }
+
+    return 0;
+
+ERROR:
+    zimage_close(z);
+    return ret;
+}
+
+/* Block until [offset, offset + length) of the content is decompressed */
+int zimage_wait(struct zimage *z, uint64_t offset, uint64_t length)
+{
+    uint32_t lo = 0, hi = z->frame_count - 1, i;
+    int ret;
+
+    if (!length)
+        return 0;
+    if (offset + length > z->size)
+        return -EINVAL;
+
+    /* the last frame starting at or before offset */
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi + 1) / 2;
+
+        if (z->frames[mid].d_offset <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    pthread_mutex_lock(&z->lock);
+    if (lo < z->release_frame)
+        z->release_frame = lo;
+    /* the window follows the reader */
+    if (z->read_frame != lo)
+    {
+        z->read_frame = lo;
+        pthread_cond_broadcast(&z->cond);
+    }
+    for (i = lo; i < z->frame_count && z->frames[i].d_offset < offset + length && !z->error; i++)
+    {
+        while (z->frames[i].state != ZIMAGE_FRAME_DONE && !z->error)
+        {
+            /* past the window, move it */
+            if (z->read_frame != i)
+            {
+                z->read_frame = i;
+                pthread_cond_broadcast(&z->cond);
+            }
+            pthread_cond_wait(&z->cond, &z->lock);
+        }
+    }
+    ret = z->error;
+    pthread_mutex_unlock(&z->lock);
+
+    return ret;
+}
+
+/*
+ * Give back the memory of the frames wholly before offset, for a reader
+ * that won't come back to them. They are decompressed again if waited on.
+ */
+void zimage_release(struct zimage *z, uint64_t offset)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t from, to;
+    uint32_t end;
+
+    pthread_mutex_lock(&z->lock);
+    end = z->release_frame;
+    while (end < z->frame_count && z->frames[end].state == ZIMAGE_FRAME_DONE
+           && z->frames[end].d_offset + z->frames[end].d_size <= offset)
+        end++;
+    if (end == z->release_frame)
+    {
+        pthread_mutex_unlock(&z->lock);
+        return;
+    }
+
+    /* whole pages only: a page shared with a frame still in use stays */
+    from = z->frames[z->release_frame].d_offset;
+    if (z->release_frame == 0 || z->frames[z->release_frame - 1].state == ZIMAGE_FRAME_PENDING)
+        from = from / page * page;
+    else
+        from = (from + page - 1) / page * page;
+    to = (z->frames[end - 1].d_offset + z->frames[end - 1].d_size) / page * page;
+    if (to > from)
+        madvise(z->base + from, to - from, MADV_DONTNEED);
+    /* the compressed side is file backed and simply read again if needed */
+    from = ((uintptr_t)z->src + z->frames[z->release_frame].c_offset) / page * page;
+    to = ((uintptr_t)z->src + z->frames[end - 1].c_offset + z->frames[end - 1].c_size) / page * page;
+    if (to > from)
+        madvise((void *)(uintptr_t)from, to - from, MADV_DONTNEED);
+    for (; z->release_frame < end; z->release_frame++)
+        z->frames[z->release_frame].state = ZIMAGE_FRAME_PENDING;
+    pthread_mutex_unlock(&z->lock);
+}
+
+void zimage_close(struct zimage *z)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&z->lock);
+    z->stop = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    for (i = 0; i < z->thread_count; i++)
+        pthread_join(z->threads[i], NULL);
+    z->thread_count = 0;
+
+    if (z->base != MAP_FAILED)
+        munmap(z->base, z->size);
+    if (z->map != MAP_FAILED)
+        munmap(z->map, z->map_size);
+    z->base = MAP_FAILED;
+    z->map = MAP_FAILED;
+    z->src = NULL;
+    free(z->frames);
+    z->frames = NULL;
+    pthread_cond_destroy(&z->cond);
+    pthread_mutex_destroy(&z->lock);
+}
+
+#else
+
+int zimage_open(struct zimage *z, int fd, uint64_t offset, uint64_t length, const char *path)
+{
+    (void)fd;
+    (void)offset;
+    (void)length;
+    memset(z, 0, sizeof(struct zimage));
+    dbg("%s is compressed, this helper was built without zstd support", path);
+    return -ENOTSUP;
+}
+
+int zimage_wait(struct zimage *z, uint64_t offset, uint64_t length)
+{
+    (void)z;
+    (void)offset;
+    (void)length;
+    return -ENOTSUP;
+}
+
+void zimage_release(struct zimage *z, uint64_t offset)
+{
+    (void)z;
+    (void)offset;
+}
+
+void zimage_close(struct zimage *z)
+{
+    (void)z;
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QL_ZIMAGE_H_
+#define __QL_ZIMAGE_H_
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZIMAGE_SKIPPABLE_MAGIC 0x184d2a5e
+#define ZIMAGE_SEEKABLE_MAGIC 0x8f92eab1
+#define ZIMAGE_FOOTER_SIZE 9
+#define ZIMAGE_MAX_FRAMES (1 << 20)
+#define ZIMAGE_MAX_THREADS 4
+#define ZIMAGE_WINDOW_SIZE (32 << 20) /* decompressed ahead of the reader */
+
+enum zimage_frame_state
+{
+    ZIMAGE_FRAME_PENDING,
+    ZIMAGE_FRAME_BUSY,
+    ZIMAGE_FRAME_DONE,
+};
+
+struct zimage_frame
+{
+    uint64_t c_offset; /* in the compressed file */
+    uint64_t d_offset; /* in the content */
+    uint32_t c_size;
+    uint32_t d_size;
+    int state;
+};
+
+/*
+ * A zstd seekable image, decompressed into memory by a pool of workers in
+ * the background, up to ZIMAGE_WINDOW_SIZE past where the last reader
+ * waited. A sequential reader releases what it has consumed, so only the
+ * window stays resident.
+ */
+struct zimage
+{
+    const char *path;
+    const uint8_t *src; /* the compressed bytes, mapped */
+    size_t src_size;
+    void *map;          /* the pages holding them */
+    size_t map_size;
+    uint8_t *base;      /* the content, valid frame by frame */
+    size_t size;
+    struct zimage_frame *frames;
+    uint32_t frame_count;
+    uint32_t read_frame;    /* where the window starts, moved by waiting readers */
+    uint32_t release_frame; /* frames before it were released */
+    int error;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[ZIMAGE_MAX_THREADS];
+    unsigned thread_count;
+};
+
+int zimage_probe(int fd, uint64_t offset, uint64_t length, uint64_t *content_size);
+int zimage_open(struct zimage *z, int fd, uint64_t offset, uint64_t length, const char *path);
+int zimage_wait(struct zimage *z, uint64_t offset, uint64_t length);
+void zimage_release(struct zimage *z, uint64_t offset);
+void zimage_close(struct zimage *z);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+  Copyright 2023 Quectel Wireless Solutions Co.,Ltd
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __QMODEMHELPER_H_
+#define __QMODEMHELPER_H_
+#include <stdint.h>
+
+/*
+ * libqmodemhelper: what the qmodemhelper command does, callable in-process.
+ *
+ * A context stands for one modem and keeps its MBIM session open between
+ * calls. Contexts are independent: several modems can be driven from one
+ * process, one thread per context. A context itself must not be used from
+ * two threads at once.
+ *
+ * The MBIM layer is loaded on first use from the qmodemhelper-mbim module
+ * (see QMODEMHELPER_MBIM_MODULE). Only the qmh_* functions are exported.
+ *
+ * Functions returning int return 0 or a negative errno.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define QMH_EXPORT __attribute__((visibility("default")))
+
+#define QMH_MAX_MODEMS 32
+
+/* Same values as SWITCHED_TO_SBL, SWITCHED_TO_EDL and NORMAL_OPERATION */
+enum qmh_mode
+{
+    QMH_MODE_SBL = 0,
+    QMH_MODE_EDL = 1,
+    QMH_MODE_NORMAL = 2,
+};
+
+struct qmh_modem
+{
+    char port[32];     /* sysfs name such as 1-1.4, stable across mode switches */
+    char dev_node[32]; /* /dev/bus/usb/BBB/DDD */
+    char cdc_wdm[32];  /* MBIM control node, empty outside of normal mode */
+    char serial[64];
+    uint16_t vid;
+    uint16_t pid;
+    int mode;          /* enum qmh_mode */
+};
+
+struct qmh_version
+{
+    char main_version[128];
+    char carrier_uuid[128];
+    char carrier_version[128];
+    char oem_version[128];
+};
+
+/* stage is one of recovery, rebooting, switching, flashing, done, failed */
+typedef void (*qmh_progress_cb)(void *user, const char *stage, int percent);
+
+struct qmh_context;
+
+/* The modem on port, NULL: the first one found, from then on that one */
+QMH_EXPORT struct qmh_context *qmh_context_new(const char *port);
+QMH_EXPORT void qmh_context_free(struct qmh_context *ctx);
+
+/* Fill up to max modems, returns how many are attached */
+QMH_EXPORT int qmh_discover(struct qmh_modem *modems, unsigned max);
+
+QMH_EXPORT int qmh_get_version(struct qmh_context *ctx, struct qmh_version *version);
+QMH_EXPORT int qmh_prepare_to_flash(struct qmh_context *ctx);
+/* From whatever mode the modem is in; progress is called from this thread */
+QMH_EXPORT int qmh_flash(struct qmh_context *ctx,
+              const char *main_file_path,
+              const char *oem_file_path,
+              const char *carrier_file_path,
+              qmh_progress_cb progress,
+              void *user);
+/* Pulse reset_line of gpio_chip, or reboot over MBIM if gpio_chip is NULL */
+QMH_EXPORT int qmh_reset(struct qmh_context *ctx, const char *gpio_chip, int reset_line, unsigned long pulse_usec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif